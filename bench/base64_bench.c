@@ -0,0 +1,180 @@
+/*
+   sudolog File System - base64 benchmark
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Runs base64_encode_block() + base64_encode_blockend() over a range of
+   input sizes, with every encoder the CPU supports, and the decoder the
+   receiver uses. Reports ns per input byte and the allocations per call
+   (malloc and friends are wrapped at link time, see Makefile.am, there
+   should be none). Before timing, the output of each encoder is compared
+   with the scalar one and decoded again; a mismatch fails the benchmark.
+   With BENCH_QUICK set ("make check"), the timing loops only do 1 MiB.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cdecode.h"
+#include "cencode.h"
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__real_calloc(size_t n, size_t size);
+void *__wrap_calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __real_calloc(n, size);
+}
+
+void *__real_realloc(void *p, size_t size);
+void *__wrap_realloc(void *p, size_t size)
+{
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int encode(const char *in, int len, char *out)
+{
+	base64_encodestate state;
+	int n;
+	base64_init_encodestate(&state);
+	n = base64_encode_block(in, len, out, &state);
+	return n + base64_encode_blockend(out + n, &state);
+}
+
+static int decode(const char *in, int len, char *out)
+{
+	base64_decodestate state;
+	base64_init_decodestate(&state);
+	return base64_decode_block(in, len, out, &state);
+}
+
+/* the scalar encoder is the reference, the decoder has to give back the input */
+static int check(const char *impl, const char *in, int len, char *out, char *ref, char *back)
+{
+	int n, r;
+	base64_encode_select("scalar");
+	r = encode(in, len, ref);
+	base64_encode_select(impl);
+	n = encode(in, len, out);
+	if (n != r || memcmp(out, ref, n)) {
+		fprintf(stderr, "impl=%s size=%d: output differs from the scalar encoder\n", impl, len);
+		return -1;
+	}
+	if (decode(out, n, back) != len || memcmp(back, in, len)) {
+		fprintf(stderr, "impl=%s size=%d: decoding does not give the input back\n", impl, len);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "usage: %s [-i impl] [-m MiB per size] [size...]\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int default_sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+	static const char *impls[] = { "scalar", "ssse3", "avx2", "avx512vbmi", NULL };
+	const char *only = NULL;
+	int opt, i, j, nsizes, maxsize = 0, mib = 256, failed = 0;
+	int sizes[32];
+	char *in, *out, *ref, *back;
+
+	if (getenv("BENCH_QUICK"))
+		mib = 1;
+	while ((opt = getopt(argc, argv, "i:m:")) != -1) {
+		switch (opt) {
+		case 'i':
+			only = optarg;
+			break;
+		case 'm':
+			mib = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (nsizes = 0; optind < argc && nsizes < 32; nsizes++)
+		sizes[nsizes] = atoi(argv[optind++]);
+	if (!nsizes) {
+		nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+	for (i = 0; i < nsizes; i++) {
+		if (sizes[i] <= 0)
+			usage(argv[0]);
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	}
+	in = malloc(maxsize);
+	out = malloc(maxsize / 3 * 4 + 8);
+	ref = malloc(maxsize / 3 * 4 + 8);
+	back = malloc(maxsize + 8);
+	if (!in || !out || !ref || !back)
+		return 1;
+	for (i = 0; i < maxsize; i++)
+		in[i] = random();
+
+	for (j = 0; impls[j]; j++) {
+		if ((only && strcmp(only, impls[j])) || base64_encode_select(impls[j]) < 0)
+			continue;
+		for (i = 0; i < nsizes; i++) {
+			unsigned long calls, c, a;
+			double t, td;
+			int n = 0;
+			/* odd lengths as well, for the tail handling */
+			if (check(impls[j], in, sizes[i], out, ref, back) < 0 ||
+			    check(impls[j], in + 1, sizes[i] - 1, out, ref, back) < 0) {
+				failed = 1;
+				continue;
+			}
+			calls = ((unsigned long)mib << 20) / sizes[i];
+			if (!calls)
+				calls = 1;
+			a = allocs;
+			t = now();
+			for (c = 0; c < calls; c++)
+				n = encode(in, sizes[i], out);
+			t = now() - t;
+			a = allocs - a;
+			td = now();
+			for (c = 0; c < calls; c++)
+				decode(out, n, back);
+			td = now() - td;
+			printf("impl=%s size=%d calls=%lu encode_ns/byte=%.3f encode_MB/s=%.0f "
+			       "decode_ns/byte=%.3f allocs/call=%.2f\n",
+			       impls[j], sizes[i], calls, t * 1e9 / calls / sizes[i],
+			       (double)calls * sizes[i] / t / 1e6, td * 1e9 / calls / sizes[i],
+			       (double)a / calls);
+		}
+	}
+	free(in);
+	free(out);
+	free(ref);
+	free(back);
+	return failed;
+}
@@ -0,0 +1,554 @@
+/*
+   sudolog File System - end-to-end benchmark
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Mounts sudologfs on a temporary directory, shipping to a sink on the
+   loopback interface that runs in this program, and replays typical sudo
+   I/O log workloads on the mount:
+     tiny      one session with many small writes, like an interactive shell
+     bulk      one session with 64 KiB writes, like "cat" of a large file
+     sessions  concurrent sessions with a mix of both
+   For each of them, one line of key=value pairs reports the latency of
+   write() (p50/p99/max), the MiB/s and packets/s shipped (until the sink
+   got the last packet), the CPU time sudologfs used per MiB, and the
+   packets that the sink did not get, from the sequence numbers.
+
+   sudologfs answers only requests of root, so the benchmark has to run
+   as root, with FUSE available. Otherwise, or if the mount fails, it
+   exits with 77, so that "make bench" skips it.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "logparse.h"
+
+#define SINK_BATCH 64
+#define SINK_BUFSIZE 65536
+/* files the sink keeps the sequence numbers of */
+#define SINK_FILES 4096
+/* ms without a packet after which everything is considered shipped */
+#define DRAIN_IDLE 250
+#define DRAIN_MAX 30000
+/* the text the sessions write */
+#define TEXT_SIZE (1 << 20)
+
+struct sink_file {
+	uint64_t hash;
+	unsigned int seq;
+};
+
+static int sink_proto;
+static unsigned long sink_packets, sink_expected, sink_bad;
+static uint64_t sink_last;	/* ns, CLOCK_MONOTONIC */
+static struct sink_file sink_files[SINK_FILES];
+
+enum workload_type {
+	WL_TINY,
+	WL_BULK,
+	WL_SESSIONS
+};
+
+static const char *workload_names[] = { "tiny", "bulk", "sessions" };
+
+struct session {
+	pthread_t thread;
+	enum workload_type type;
+	char path[160];
+	unsigned long writes;
+	uint64_t bytes;
+	uint32_t *lat;		/* ns per write() */
+	unsigned int seed;
+	int err;
+};
+
+static char *text;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* count the packets, and the ones missing from the sequence numbers */
+static void sink_packet(const char *buf, size_t len)
+{
+	struct log_msg m;
+	struct sink_file *f;
+	uint64_t h;
+	unsigned int i;
+	if (log_parse(buf, len, &m) < 0) {
+		__atomic_add_fetch(&sink_bad, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	h = log_hash(&m) | 1;
+	for (i = 0; i < SINK_FILES; i++) {
+		f = &sink_files[(h + i) % SINK_FILES];
+		if (f->hash == h || !f->hash)
+			break;
+	}
+	if (i < SINK_FILES) {
+		f->hash = h;
+		if (m.seq > f->seq) {
+			__atomic_add_fetch(&sink_expected, m.seq - f->seq, __ATOMIC_RELAXED);
+			f->seq = m.seq;
+		}
+	}
+	__atomic_add_fetch(&sink_packets, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sink_last, now_ns(), __ATOMIC_RELAXED);
+}
+
+static void *udp_sink(void *arg)
+{
+	int fd = (intptr_t)arg;
+	static char bufs[SINK_BATCH][SINK_BUFSIZE];
+	struct mmsghdr mh[SINK_BATCH];
+	struct iovec iov[SINK_BATCH];
+	int i, n;
+	memset(mh, 0, sizeof(mh));
+	for (i = 0; i < SINK_BATCH; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = SINK_BUFSIZE;
+		mh[i].msg_hdr.msg_iov = &iov[i];
+		mh[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (1) {
+		n = recvmmsg(fd, mh, SINK_BATCH, MSG_WAITFORONE, NULL);
+		for (i = 0; i < n; i++)
+			sink_packet(bufs[i], mh[i].msg_len);
+	}
+	return NULL;
+}
+
+/* one connection at a time, octet-counted frames */
+static void *tcp_sink(void *arg)
+{
+	int lfd = (intptr_t)arg, fd;
+	size_t size = 2 << 20, len, frame;
+	char *buf = malloc(size), *p, *q, *end;
+	ssize_t n;
+	while (buf) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		len = 0;
+		while ((n = read(fd, buf + len, size - len)) > 0) {
+			len += n;
+			p = buf;
+			end = buf + len;
+			while ((q = memchr(p, ' ', end - p))) {
+				frame = strtoul(p, NULL, 10);
+				if (frame > size / 2 || (size_t)(end - q - 1) < frame)
+					break;
+				sink_packet(q + 1, frame);
+				p = q + 1 + frame;
+			}
+			len = end - p;
+			memmove(buf, p, len);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int sink_start(int proto, struct sockaddr_in *addr)
+{
+	socklen_t alen = sizeof(struct sockaddr_in);
+	int fd, size = 32 << 20;
+	pthread_t t;
+
+	sink_proto = proto;
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, proto, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(fd, (struct sockaddr *)addr, alen) < 0 ||
+	    getsockname(fd, (struct sockaddr *)addr, &alen) < 0 ||
+	    (proto == SOCK_STREAM && listen(fd, 4) < 0))
+		return -1;
+	return pthread_create(&t, NULL, proto == SOCK_STREAM ? tcp_sink : udp_sink,
+			      (void *)(intptr_t)fd) ? -1 : 0;
+}
+
+/* wait until the sink got nothing for a while, returns the time of the
+ * last packet */
+static uint64_t sink_drain(void)
+{
+	uint64_t start = now_ns(), last;
+	while (1) {
+		usleep(DRAIN_IDLE * 1000 / 5);
+		last = __atomic_load_n(&sink_last, __ATOMIC_RELAXED);
+		if (now_ns() - last > DRAIN_IDLE * 1000000ULL ||
+		    now_ns() - start > DRAIN_MAX * 1000000ULL)
+			return last;
+	}
+}
+
+/* utime + stime of pid in seconds */
+static double cpu_of(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	int fd;
+	ssize_t n;
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	/* the command may contain spaces, the fields after it do not */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			 &utime, &stime) != 2)
+		return 0;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int mounted(const char *mnt, const char *parent)
+{
+	struct stat a, b;
+	return stat(mnt, &a) == 0 && stat(parent, &b) == 0 && a.st_dev != b.st_dev;
+}
+
+static void show_log(const char *log)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd = open(log, O_RDONLY);
+	if (fd < 0)
+		return;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stderr);
+	close(fd);
+}
+
+static pid_t mount_fs(const char *bin, const char *dir, const char *dest, const char *opts)
+{
+	char backing[PATH_MAX], mnt[PATH_MAX], log[PATH_MAX];
+	const char *argv[8];
+	int argc = 0, i, fd;
+	pid_t pid;
+
+	snprintf(backing, sizeof(backing), "%s/backing", dir);
+	snprintf(mnt, sizeof(mnt), "%s/mnt", dir);
+	snprintf(log, sizeof(log), "%s/sudologfs.log", dir);
+	if (mkdir(backing, 0700) < 0 || mkdir(mnt, 0700) < 0)
+		return -1;
+	argv[argc++] = bin;
+	argv[argc++] = "-f";
+	if (opts) {
+		argv[argc++] = "-o";
+		argv[argc++] = opts;
+	}
+	argv[argc++] = backing;
+	argv[argc++] = mnt;
+	argv[argc++] = dest;
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid == 0) {
+		fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execv(bin, (char **)argv);
+		perror(bin);
+		_exit(127);
+	}
+	if (pid < 0)
+		return -1;
+	for (i = 0; i < 100; i++) {
+		if (mounted(mnt, dir))
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "mounting sudologfs failed\n");
+			show_log(log);
+			return -1;
+		}
+		usleep(50000);
+	}
+	fprintf(stderr, "sudologfs did not mount within 5 seconds\n");
+	show_log(log);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void umount_fs(pid_t pid)
+{
+	/* sudologfs unmounts when it gets SIGTERM */
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static size_t next_size(struct session *s)
+{
+	unsigned int r = rand_r(&s->seed);
+	switch (s->type) {
+	case WL_TINY:
+		return 1 + r % 64;
+	case WL_BULK:
+		return 65536;
+	case WL_SESSIONS:
+		return r % 10 ? 1 + r % 256 : 4096;
+	}
+	return 1;
+}
+
+static void *session_thread(void *arg)
+{
+	struct session *s = arg;
+	unsigned long w;
+	uint64_t t;
+	size_t len, off = 0;
+	ssize_t ret;
+	int fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		s->err = errno;
+		return NULL;
+	}
+	for (w = 0; w < s->writes; w++) {
+		len = next_size(s);
+		if (off + len > TEXT_SIZE)
+			off = 0;
+		t = now_ns();
+		ret = write(fd, text + off, len);
+		t = now_ns() - t;
+		if (ret < 0) {
+			s->err = errno;
+			break;
+		}
+		s->lat[w] = t > UINT32_MAX ? UINT32_MAX : t;
+		s->bytes += ret;
+		off += len;
+	}
+	s->writes = w;
+	close(fd);
+	return NULL;
+}
+
+static int by_value(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int run(enum workload_type type, const char *mnt, pid_t pid,
+	       unsigned int nsessions, unsigned long writes)
+{
+	struct session *s;
+	unsigned long total = 0, packets, lost, n;
+	uint64_t bytes = 0, start, end;
+	uint32_t *lat;
+	double cpu, secs, mib;
+	unsigned int i;
+	char dir[128];
+
+	if (type != WL_SESSIONS)
+		nsessions = 1;
+	s = calloc(nsessions, sizeof(struct session));
+	if (!s)
+		return -1;
+	snprintf(dir, sizeof(dir), "%s/%s", mnt, workload_names[type]);
+	if (mkdir(dir, 0700) < 0)
+		return -1;
+	for (i = 0; i < nsessions; i++) {
+		s[i].type = type;
+		s[i].writes = writes / nsessions;
+		s[i].seed = i + 1;
+		s[i].lat = malloc(s[i].writes * sizeof(uint32_t));
+		if (!s[i].lat)
+			return -1;
+		snprintf(s[i].path, sizeof(s[i].path), "%s/%02x", dir, i);
+		if (mkdir(s[i].path, 0700) < 0)
+			return -1;
+		strcat(s[i].path, "/ttyout");
+	}
+
+	n = __atomic_load_n(&sink_expected, __ATOMIC_RELAXED) -
+	    __atomic_load_n(&sink_packets, __ATOMIC_RELAXED);
+	packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED);
+	cpu = cpu_of(pid);
+	start = now_ns();
+	for (i = 0; i < nsessions; i++)
+		pthread_create(&s[i].thread, NULL, session_thread, &s[i]);
+	for (i = 0; i < nsessions; i++)
+		pthread_join(s[i].thread, NULL);
+	end = sink_drain();
+	cpu = cpu_of(pid) - cpu;
+	packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED) - packets;
+	lost = __atomic_load_n(&sink_expected, __ATOMIC_RELAXED) -
+	       __atomic_load_n(&sink_packets, __ATOMIC_RELAXED) - n;
+
+	for (i = 0; i < nsessions; i++) {
+		if (s[i].err) {
+			fprintf(stderr, "%s: %s\n", s[i].path, strerror(s[i].err));
+			return -1;
+		}
+		total += s[i].writes;
+		bytes += s[i].bytes;
+	}
+	lat = malloc((total ? total : 1) * sizeof(uint32_t));
+	if (!lat)
+		return -1;
+	for (n = 0, i = 0; i < nsessions; i++) {
+		memcpy(lat + n, s[i].lat, s[i].writes * sizeof(uint32_t));
+		n += s[i].writes;
+		free(s[i].lat);
+	}
+	qsort(lat, total, sizeof(uint32_t), by_value);
+	if (!total)
+		lat[0] = 0;
+	secs = end > start ? (end - start) / 1e9 : 1e-9;
+	mib = (double)bytes / (1 << 20);
+	printf("workload=%s proto=%s sessions=%u writes=%lu bytes=%llu "
+	       "write_p50_us=%.2f write_p99_us=%.2f write_max_us=%.2f "
+	       "MiB_s=%.2f packets_s=%.0f cpu_ms_MiB=%.3f packets=%lu lost=%lu\n",
+	       workload_names[type], sink_proto == SOCK_STREAM ? "tcp" : "udp",
+	       nsessions, total, (unsigned long long)bytes,
+	       lat[total / 2] / 1e3, lat[total * 99 / 100] / 1e3,
+	       lat[total ? total - 1 : 0] / 1e3,
+	       mib / secs, packets / secs, mib ? cpu * 1000 / mib : 0, packets, lost);
+	fflush(stdout);
+	free(lat);
+	free(s);
+	return 0;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	remove(path);
+	return 0;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "usage: %s [-b sudologfs] [-t] [-o options] [-n sessions] "
+			"[-w writes] [-m MiB] [tiny|bulk|sessions...]\n"
+			"    -b  the sudologfs binary (default ../src/sudologfs)\n"
+			"    -t  ship via TCP instead of UDP\n"
+			"    -o  mount options for sudologfs, e.g. compress=zstd,senders=4\n"
+			"    -n  concurrent sessions of \"sessions\" (default 8)\n"
+			"    -w  writes of \"tiny\" and \"sessions\" (default 100000)\n"
+			"    -m  MiB written by \"bulk\" (default 64)\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *bin = "../src/sudologfs", *opts = NULL;
+	char dir[] = "/tmp/sudologfs-bench.XXXXXX", mnt[64], dest[64];
+	struct sockaddr_in addr;
+	unsigned int nsessions = 8, i, j;
+	unsigned long writes = 100000, mib = 64;
+	int opt, proto = SOCK_DGRAM, ret = 0, types[3], ntypes = 0;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "b:to:n:w:m:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bin = optarg;
+			break;
+		case 't':
+			proto = SOCK_STREAM;
+			break;
+		case 'o':
+			opts = optarg;
+			break;
+		case 'n':
+			nsessions = atoi(optarg);
+			break;
+		case 'w':
+			writes = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			mib = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (; optind < argc && ntypes < 3; optind++) {
+		for (j = 0; j < 3; j++)
+			if (!strcmp(argv[optind], workload_names[j]))
+				break;
+		if (j == 3)
+			usage(argv[0]);
+		types[ntypes++] = j;
+	}
+	if (!ntypes)
+		for (; ntypes < 3; ntypes++)
+			types[ntypes] = ntypes;
+	if (!nsessions)
+		usage(argv[0]);
+	/* every request of another user gets EACCES from sudologfs */
+	if (geteuid() != 0) {
+		fprintf(stderr, "sudologfs only serves root, run the benchmark as root\n");
+		return 77;
+	}
+
+	/* terminal output: words, a few escape sequences and line ends */
+	text = malloc(TEXT_SIZE);
+	if (!text)
+		return 1;
+	srand(1);
+	for (i = 0; i < TEXT_SIZE; i++) {
+		int r = rand() % 64;
+		text[i] = r < 52 ? 'a' + r % 26 : r < 60 ? ' ' : r < 62 ? '\n' : r < 63 ? '\r' : '\033';
+	}
+
+	if (sink_start(proto, &addr) < 0) {
+		perror("sink");
+		return 1;
+	}
+	snprintf(dest, sizeof(dest), "%s://127.0.0.1:%d",
+		 proto == SOCK_STREAM ? "tcp" : "udp", ntohs(addr.sin_port));
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return 1;
+	}
+	pid = mount_fs(bin, dir, dest, opts);
+	if (pid < 0) {
+		nftw(dir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+		return 77;
+	}
+	snprintf(mnt, sizeof(mnt), "%s/mnt", dir);
+	for (i = 0; i < (unsigned int)ntypes && !ret; i++)
+		ret = run(types[i], mnt, pid, nsessions,
+			  types[i] == WL_BULK ? mib * 16 : writes);
+	if (ret < 0)
+		fprintf(stderr, "the benchmark failed\n");
+	umount_fs(pid);
+	nftw(dir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	if (__atomic_load_n(&sink_bad, __ATOMIC_RELAXED))
+		fprintf(stderr, "%lu packets at the sink were not understood\n", sink_bad);
+	return ret < 0;
+}
@@ -0,0 +1,306 @@
+/*
+   sudolog File System - packetizer benchmark
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Calls log_send() directly for a range of write sizes and reports
+   how many send syscalls, packets, allocations and how much CPU time it
+   takes to ship one MiB. The send and allocation functions are wrapped
+   at link time (see Makefile.am) to count the calls; with -n, the
+   packets are not passed on to the kernel at all, which leaves only the
+   user space part.
+
+   Before timing, the packets of one MiB of writes are captured, decoded
+   and put together again, and compared with what was written; a
+   mismatch fails the benchmark. With BENCH_QUICK set ("make check"),
+   the timing loops only do 1 MiB per size.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "cdecode.h"
+#include "logparse.h"
+#include "my_syslog.h"
+#include "transport.h"
+
+static unsigned long syscalls, packets, allocs;
+static int null_sink;
+/* the packets while checking, as "length, data" */
+static char *cap;
+static size_t caplen, capsize;
+static int capturing;
+
+static void capture(const struct msghdr *msg)
+{
+	size_t len = 0, i;
+	char *tmp;
+	for (i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+	if (caplen + sizeof(len) + len > capsize) {
+		capsize = (caplen + sizeof(len) + len) * 2;
+		tmp = realloc(cap, capsize);
+		if (!tmp) {
+			capturing = 0;
+			return;
+		}
+		cap = tmp;
+	}
+	memcpy(cap + caplen, &len, sizeof(len));
+	caplen += sizeof(len);
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		memcpy(cap + caplen, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		caplen += msg->msg_iov[i].iov_len;
+	}
+}
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__real_calloc(size_t n, size_t size);
+void *__wrap_calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __real_calloc(n, size);
+}
+
+void *__real_realloc(void *p, size_t size);
+void *__wrap_realloc(void *p, size_t size)
+{
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+int __real_sendmmsg(int fd, struct mmsghdr *vec, unsigned int vlen, int flags);
+int __wrap_sendmmsg(int fd, struct mmsghdr *vec, unsigned int vlen, int flags)
+{
+	int ret = vlen;
+	unsigned int i;
+	syscalls++;
+	if (capturing)
+		for (i = 0; i < vlen; i++)
+			capture(&vec[i].msg_hdr);
+	if (!null_sink)
+		ret = __real_sendmmsg(fd, vec, vlen, flags);
+	if (ret > 0)
+		packets += ret;
+	return ret;
+}
+
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	ssize_t ret = 1;
+	syscalls++;
+	if (capturing)
+		capture(msg);
+	if (!null_sink)
+		ret = __real_sendmsg(fd, msg, flags);
+	if (ret >= 0)
+		packets++;
+	return ret;
+}
+
+ssize_t __real_sendto(int fd, const void *buf, size_t len, int flags,
+		      const struct sockaddr *addr, socklen_t alen);
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+		      const struct sockaddr *addr, socklen_t alen)
+{
+	ssize_t ret = len;
+	syscalls++;
+	if (!null_sink)
+		ret = __real_sendto(fd, buf, len, flags, addr, alen);
+	if (ret >= 0)
+		packets++;
+	return ret;
+}
+
+static double cpu_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* put the captured packets together again and compare them with buf,
+ * which was written len bytes at a time, total bytes */
+static int check(const char *buf, int len, size_t total)
+{
+	struct log_msg m;
+	base64_decodestate state;
+	char *img = calloc(1, total), *out = malloc(LOG_TCP_MAX_LENGTH);
+	size_t p, plen, pos = 0, n;
+	unsigned int seq = 0;
+	int ret = 0;
+
+	if (!img || !out)
+		return -1;
+	for (p = 0; p < caplen && !ret; p += plen) {
+		memcpy(&plen, cap + p, sizeof(plen));
+		p += sizeof(plen);
+		if (log_parse(cap + p, plen, &m) < 0 || m.seq != ++seq || (seq == 1 && !m.first)) {
+			fprintf(stderr, "size=%d: packet %u is not understood\n", len, seq);
+			ret = -1;
+			break;
+		}
+		if (m.first) {
+			if (m.offset + m.size > total || m.flag) {
+				fprintf(stderr, "size=%d: record %zu@%llu is wrong\n", len, m.size,
+					(unsigned long long)m.offset);
+				ret = -1;
+				break;
+			}
+			base64_init_decodestate(&state);
+			pos = m.offset;
+		}
+		n = base64_decode_block(m.data, m.datalen, out, &state);
+		if (pos + n > total) {
+			fprintf(stderr, "size=%d: record too long\n", len);
+			ret = -1;
+			break;
+		}
+		memcpy(img + pos, out, n);
+		pos += n;
+	}
+	for (pos = 0; pos < total && !ret; pos += len)
+		if (memcmp(img + pos, buf, total - pos < (size_t)len ? total - pos : len)) {
+			fprintf(stderr, "size=%d: data at %zu differs\n", len, pos);
+			ret = -1;
+		}
+	free(out);
+	free(img);
+	return ret;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "usage: %s [-n] [-m MiB per size] [-l msgsize|auto] [size...]\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int default_sizes[] = { 16, 256, 4096, 65536, 131072 };
+	struct bb_state bb_data;
+	struct log_dest dest;
+	struct file_state file_state, check_state;
+	struct sockaddr_in sink;
+	socklen_t slen = sizeof(sink);
+	int rx, opt, i, nsizes, mib = 64, msgsize = 0, failed = 0;
+	int sizes[32];
+	char *buf, spec[64];
+
+	if (getenv("BENCH_QUICK"))
+		mib = 1;
+	while ((opt = getopt(argc, argv, "nm:l:")) != -1) {
+		switch (opt) {
+		case 'n':
+			null_sink = 1;
+			break;
+		case 'm':
+			mib = atoi(optarg);
+			break;
+		case 'l':
+			msgsize = strcmp(optarg, "auto") ? atoi(optarg) : LOG_SIZE_AUTO;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (nsizes = 0; optind < argc && nsizes < 32; nsizes++)
+		sizes[nsizes] = atoi(argv[optind++]);
+	if (!nsizes) {
+		nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+
+	/* a loopback sink that is never read, the kernel drops what overflows */
+	memset(&sink, 0, sizeof(sink));
+	sink.sin_family = AF_INET;
+	sink.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx < 0 || bind(rx, (struct sockaddr *)&sink, sizeof(sink)) < 0 ||
+	    getsockname(rx, (struct sockaddr *)&sink, &slen) < 0) {
+		perror("sink socket");
+		return 1;
+	}
+	memset(&bb_data, 0, sizeof(bb_data));
+	snprintf(spec, sizeof(spec), "udp://127.0.0.1:%d", ntohs(sink.sin_port));
+	if (dest_open(&dest, spec, 0, msgsize, 1) < 0)
+		return 1;
+	bb_data.log = &dest;
+	bb_data.nlog = 1;
+	strcpy(bb_data.hostname, "benchhost");
+	memset(&file_state, 0, sizeof(file_state));
+	if (log_header(&bb_data, &file_state, "/00/00/01/ttyout") < 0)
+		return 1;
+
+	for (i = 0; i < nsizes; i++) {
+		unsigned long writes, w, a;
+		double t, mb;
+		off_t offset = 0;
+		if (sizes[i] <= 0)
+			usage(argv[0]);
+		buf = malloc(sizes[i]);
+		if (!buf)
+			return 1;
+		for (w = 0; w < (unsigned long)sizes[i]; w++)
+			buf[w] = random();
+
+		/* one MiB into a file of its own, captured and checked */
+		memset(&check_state, 0, sizeof(check_state));
+		if (log_header(&bb_data, &check_state, "/00/00/02/ttyout") < 0)
+			return 1;
+		writes = (1 << 20) / sizes[i];
+		if (!writes)
+			writes = 1;
+		caplen = 0;
+		capturing = 1;
+		for (w = 0; w < writes; w++)
+			log_send(&bb_data, &check_state, buf, sizes[i], (off_t)w * sizes[i]);
+		capturing = 0;
+		free(check_state.hdr);
+		if (check(buf, sizes[i], (size_t)writes * sizes[i]) < 0) {
+			failed = 1;
+			free(buf);
+			continue;
+		}
+
+		writes = ((unsigned long)mib << 20) / sizes[i];
+		if (!writes)
+			writes = 1;
+		syscalls = packets = 0;
+		a = allocs;
+		t = cpu_now();
+		for (w = 0; w < writes; w++) {
+			log_send(&bb_data, &file_state, buf, sizes[i], offset);
+			offset += sizes[i];
+		}
+		t = cpu_now() - t;
+		a = allocs - a;
+		mb = (double)offset / (1 << 20);
+		printf("size=%d writes=%lu packets/write=%.2f syscalls/write=%.2f "
+		       "syscalls/MiB=%.1f cpu_ms/MiB=%.3f ns/byte=%.3f allocs/write=%.2f\n",
+		       sizes[i], writes, (double)packets / writes, (double)syscalls / writes,
+		       syscalls / mb, t * 1000 / mb, t * 1e9 / offset, (double)a / writes);
+		free(buf);
+	}
+	dest_close(&dest);
+	close(rx);
+	free(cap);
+	return failed;
+}
@@ -0,0 +1,227 @@
+/*
+   sudolog File System - TCP spool overflow check
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Sends numbered messages to a loopback TCP listener that does not read,
+   with an 8 MiB spool, until the spool overflows while a message is
+   only sent in part. Then it reads everything, and checks that every
+   connection carries whole, well-formed octet counted frames in order:
+   only the last frame of a connection may be cut off, and is sent again
+   on the next one. Messages the spool dropped are just missing.
+
+   Exits with 77 (skipped) if the socket buffers of this system take so
+   much that the overflow cannot be reached.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "spool.h"
+#include "transport.h"
+
+#define BATCH 64
+#define MAX_CONNS 64
+/* give up on reaching the overflow after this many messages */
+#define MAX_MSGS 500000
+
+struct conn {
+	int fd;
+	char *buf;
+	size_t len, size;
+};
+
+static struct conn conns[MAX_CONNS];
+static int nconns;
+
+/* about the same length, so that the rest of a cut off message is
+ * shorter than the next one */
+static size_t body_len(unsigned int n)
+{
+	return 1000 + n % 100;
+}
+
+static size_t make_msg(char *p, unsigned int n)
+{
+	size_t len = body_len(n);
+	int k = sprintf(p, "msg %08u ", n);
+	memset(p + k, 'a' + n % 26, len - k);
+	return len;
+}
+
+/* take the new connections, and whatever arrived on all of them */
+static int drain(int lfd)
+{
+	struct conn *c;
+	ssize_t ret;
+	int fd, i;
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		if (nconns == MAX_CONNS) {
+			fprintf(stderr, "too many connections\n");
+			return -1;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		conns[nconns++].fd = fd;
+	}
+	for (i = 0; i < nconns; i++) {
+		c = &conns[i];
+		while (c->fd >= 0) {
+			if (c->size - c->len < 65536) {
+				char *tmp;
+				c->size = c->size ? c->size * 2 : 1 << 20;
+				tmp = realloc(c->buf, c->size);
+				if (!tmp)
+					return -1;
+				c->buf = tmp;
+			}
+			ret = recv(c->fd, c->buf + c->len, c->size - c->len, 0);
+			if (ret > 0) {
+				c->len += ret;
+				continue;
+			}
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+	return 0;
+}
+
+/* the frames of connection i, *last is the number of the last whole one */
+static int check_conn(int i, long *last)
+{
+	struct conn *c = &conns[i];
+	char want[1200], *p = c->buf, *end = c->buf + c->len, *q;
+	unsigned long len, n, frames = 0;
+	while (p < end) {
+		len = strtoul(p, &q, 10);
+		if (q == p || q >= end || *q != ' ') {
+			if (memchr(p, ' ', end - p))
+				goto bad;
+			break; /* the octet count itself was cut off */
+		}
+		q++;
+		if ((size_t)(end - q) < len)
+			break; /* cut off, sent again on the next connection */
+		if (len < 13 || sscanf(q, "msg %08lu ", &n) != 1 || n > MAX_MSGS ||
+		    len != body_len(n) || (long)n < *last || (frames && (long)n == *last))
+			goto bad;
+		make_msg(want, n);
+		if (memcmp(q, want, len))
+			goto bad;
+		*last = n;
+		frames++;
+		p = q + len;
+	}
+	printf("connection %d: %lu messages, up to %ld\n", i, frames, *last);
+	return 0;
+bad:
+	fprintf(stderr, "connection %d: broken frame at byte %zu after message %ld: %.40s\n",
+		i, (size_t)(p - c->buf), *last, p);
+	return -1;
+}
+
+int main(void)
+{
+	static char bodies[BATCH][1200], frames[BATCH][16];
+	struct iovec iov[BATCH][2];
+	struct mmsghdr mh[BATCH];
+	struct log_dest dest;
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	char dir[] = "/tmp/spool_check.XXXXXX", spec[64], cmd[64];
+	unsigned int n = 0, i;
+	unsigned long lost;
+	size_t backlog;
+	int up, lfd, rcvbuf = 4096, hit = 0, failed = 0;
+	long last = -1;
+
+	/* a listener with a small receive buffer, not read for now */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || setsockopt(lfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0 ||
+	    bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &alen) < 0 || listen(lfd, 16) < 0) {
+		perror("listener");
+		return 1;
+	}
+	fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(spec, sizeof(spec), "tcp://127.0.0.1:%d", ntohs(addr.sin_port));
+	memset(&dest, 0, sizeof(dest));
+	if (dest_open(&dest, spec, 0, 0, 1) < 0 || dest_spool(&dest, dir, 8 << 20) < 0)
+		return 1;
+	while (dest_poll(&dest, NULL))
+		usleep(1000);
+
+	/* fill it up, until a drop hits a message that is on its way */
+	while (!hit && n < MAX_MSGS) {
+		for (i = 0; i < BATCH; i++, n++) {
+			iov[i][1].iov_base = bodies[i];
+			iov[i][1].iov_len = make_msg(bodies[i], n);
+			iov[i][0].iov_base = frames[i];
+			iov[i][0].iov_len = sprintf(frames[i], "%zu ", iov[i][1].iov_len);
+			memset(&mh[i], 0, sizeof(mh[i]));
+			mh[i].msg_hdr.msg_iov = iov[i];
+			mh[i].msg_hdr.msg_iovlen = 2;
+		}
+		lost = dest.spool->lost;
+		dest_health(&dest, &up, &backlog);
+		hit = up && dest.osent;
+		dest_send(&dest, 0, mh, BATCH);
+		hit = hit && dest.spool->lost != lost;
+	}
+	if (!hit) {
+		printf("the spool did not overflow while sending, skipped\n");
+		dest_close(&dest);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		return system(cmd) ? 1 : 77;
+	}
+	printf("%u messages sent, the spool dropped %lu segments\n", n, dest.spool->dropped);
+
+	/* read it all */
+	while (dest_poll(&dest, NULL) || dest.osent) {
+		if (drain(lfd) < 0)
+			return 1;
+		poll(NULL, 0, 1);
+	}
+	dest_close(&dest);
+	if (drain(lfd) < 0)
+		return 1;
+	for (i = 0; (int)i < nconns; i++) {
+		while (conns[i].fd >= 0) {
+			poll(NULL, 0, 1);
+			if (drain(lfd) < 0)
+				return 1;
+		}
+		if (check_conn(i, &last) < 0)
+			failed = 1;
+		free(conns[i].buf);
+	}
+	if (!failed && last != (long)n - 1) {
+		fprintf(stderr, "the last message %u did not arrive, got up to %ld\n", n - 1, last);
+		failed = 1;
+	}
+	close(lfd);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd))
+		failed = 1;
+	return failed;
+}
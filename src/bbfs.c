@@ -17,29 +17,46 @@
    This program can be distributed under the terms of the GNU GPLv3.
    See the file COPYING.
 
-   This code is derived from function prototypes found /usr/include/fuse/fuse.h
+   This code is derived from function prototypes found /usr/include/fuse3/fuse_lowlevel.h
    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
    His code is licensed under the LGPLv2.
-   A copy of that code is included in the file fuse.h
 
+   It uses the low-level API: the kernel talks about inodes, not paths.
+   Each inode it knows has an O_PATH fd into the backing directory (see
+   inode.c), the operations work relative to these with the *at()
+   syscalls, so no path is built or looked up twice.
  */
 
 #include "config.h"
 
 #include "my_syslog.h"
+#include "compress.h"
+#include "inode.h"
 #include "params.h"
+#include "pool.h"
+#include "sender.h"
+#include "spool.h"
+#include "stats.h"
+#include "transport.h"
+#include "uring.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fnmatch.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <syslog.h>
 
@@ -47,89 +64,297 @@
 #include <sys/xattr.h>
 #endif
 
-/* replace the old log_syscall() behaviour of modifying return code if it was < 0 */
-#define RETURN(x) do { int __y = x;if (__y < 0) return -errno; else return __y; } while(0)
+/* reply with the errno of a syscall that returned x, or with success */
+#define REPLY_ERR(x) do { int __y = x; fuse_reply_err(req, __y < 0 ? errno : 0); } while(0)
 
 /* primitive access control option, as we need to mount with "allow other" */
-#define CHECKPERM do { if (fuse_get_context()->uid) return -EACCES; } while(0)
+#define CHECKPERM do { if (fuse_req_ctx(req)->uid) { fuse_reply_err(req, EACCES); return; } } while(0)
+
+/* nothing can be created in or below /.sudologfs */
+#define CHECKDIR(dir) do { if ((dir)->special) { fuse_reply_err(req, EACCES); return; } } while(0)
+
+/* what we ask the kernel for. With FUSE 3 and Linux 4.20 or later, it
+ * takes up to 256 pages, older kernels stop at 32 */
+#define BB_MAX_WRITE (1024 * 1024)
+
+/* how long the kernel may cache names and attributes, in seconds. The
+ * same as the high-level API's default */
+#define BB_TIMEOUT 1.0
 
 /* helper macro to avoid "unused parameter" warnings from gcc */
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 
-//  All the paths I see are relative to the root of the mounted
-//  filesystem.  In order to get to the underlying filesystem, I need to
-//  have the mountpoint.  I'll save it away early on in main(), and then
-//  whenever I need a path for something I'll call this to construct
-//  it.
-static void bb_fullpath(char fpath[PATH_MAX], const char *path)
+#define INODE bb_inode(req, ino)
+
+// the kernel calls the root FUSE_ROOT_ID, all other inode numbers are
+// the addresses of our struct bb_inode
+static struct bb_inode *bb_inode(fuse_req_t req, fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return inode_root(BB_DATA->inodes);
+	return (struct bb_inode *)(uintptr_t)ino;
+}
+
+static fuse_ino_t bb_ino(fuse_req_t req, struct bb_inode *inode)
+{
+	if (inode == inode_root(BB_DATA->inodes))
+		return FUSE_ROOT_ID;
+	return (uintptr_t)inode;
+}
+
+// what cannot be done with an O_PATH fd is done through its /proc link
+static void bb_procname(char proc[64], int fd)
+{
+	snprintf(proc, 64, "/proc/self/fd/%d", fd);
+}
+
+// The syslog header names the file relative to the mount point,
+// "/00/00/01/ttyout". It is only needed on open, so it is asked from
+// the kernel instead of keeping the names of all inodes.
+static int bb_relpath(struct bb_state *bb_data, int fd, char path[PATH_MAX])
 {
-	strcpy(fpath, BB_DATA->rootdir);
-	strncat(fpath, path, PATH_MAX - strlen(fpath) -1 ); // ridiculously long paths will
-	// break here
+	char proc[64];
+	size_t n = strlen(bb_data->rootdir);
+	ssize_t len;
+	bb_procname(proc, fd);
+	len = readlink(proc, path, PATH_MAX - 1);
+	if (len < 0)
+		return -1;
+	path[len] = '\0';
+	if (n == 1)	/* the root directory is "/" */
+		n = 0;
+	if (strncmp(path, bb_data->rootdir, n) || (path[n] && path[n] != '/')) {
+		errno = EXDEV;
+		return -1;
+	}
+	memmove(path, path + n, len - n + 1);
+	if (!path[0])
+		strcpy(path, "/");
+	return 0;
+}
+
+// The statistics (see stats.c) appear as /.sudologfs/stats. They are
+// made up here, the backing directory never sees these names.
+#define SPECIAL_DIR 1
+#define SPECIAL_STATS 2
+static struct bb_inode special_dir = { .fd = -1, .special = SPECIAL_DIR };
+static struct bb_inode special_stats = { .fd = -1, .special = SPECIAL_STATS };
+
+static void bb_special_getattr(struct bb_inode *inode, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(struct stat));
+	statbuf->st_ino = (uintptr_t)inode;
+	if (inode->special == SPECIAL_DIR) {
+		statbuf->st_mode = S_IFDIR | 0555;
+		statbuf->st_nlink = 2;
+	} else {
+		// the size is only known once it is rendered, like in /proc
+		statbuf->st_mode = S_IFREG | 0444;
+		statbuf->st_nlink = 1;
+	}
+	statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+}
+
+// every open gets its own snapshot of the counters
+static int bb_stats_open(struct bb_state *bb_data, struct fuse_file_info *fi)
+{
+	struct bb_file *fh;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	fh = calloc(sizeof(struct bb_file), 1);
+	if (!fh)
+		return -ENOMEM;
+	fh->fd = -1;
+	fh->snapshot = stats_render(bb_data, &fh->snaplen);
+	if (!fh->snapshot) {
+		free(fh);
+		return -ENOMEM;
+	}
+	// reads must not be cut off at the st_size of 0
+	fi->direct_io = 1;
+	fi->fh = (uint64_t)fh;
+	return 0;
+}
+
+// the entry of name in dir: look it up, which counts the reference
+// the kernel gets with the reply. Returns 0 or an errno
+static int bb_entry(fuse_req_t req, struct bb_inode *dir, const char *name,
+		struct fuse_entry_param *e)
+{
+	struct bb_inode *inode;
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->attr_timeout = e->entry_timeout = BB_TIMEOUT;
+	if (dir->special) {
+		if (dir->special != SPECIAL_DIR || strcmp(name, "stats"))
+			return ENOENT;
+		inode = &special_stats;
+		bb_special_getattr(inode, &e->attr);
+	} else if (dir == inode_root(BB_DATA->inodes) && !strcmp(name, ".sudologfs")) {
+		inode = &special_dir;
+		bb_special_getattr(inode, &e->attr);
+	} else {
+		inode = inode_lookup(BB_DATA->inodes, dir->fd, name, &e->attr);
+		if (!inode)
+			return errno;
+	}
+	e->ino = bb_ino(req, inode);
+	return 0;
+}
+
+// the reply to everything that creates a name
+static void bb_reply_entry(fuse_req_t req, struct bb_inode *dir, const char *name)
+{
+	struct fuse_entry_param e;
+	int err = bb_entry(req, dir, name, &e);
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
 }
 
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
-// come from /usr/include/fuse.h
+// come from /usr/include/fuse3/fuse_lowlevel.h
 //
-/** Get file attributes.
- *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
- * ignored.  The 'st_ino' field is ignored except if the 'use_ino'
- * mount option is given.
+/**
+ * Look up a directory entry by name and get its attributes.
  */
-int bb_getattr(const char *path, struct stat *statbuf)
+void bb_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	int retstat;
-	char fpath[PATH_MAX];
 	CHECKPERM;
-	bb_fullpath(fpath, path);
+	bb_reply_entry(req, bb_inode(req, parent), name);
+}
 
-	retstat = lstat(fpath, statbuf);
+/**
+ * Forget about an inode
+ *
+ * This function is called when the kernel removes an inode
+ * from its internal caches.
+ *
+ * The inode's lookup count increases by one for every call to
+ * fuse_reply_entry and fuse_reply_create. The nlookup parameter
+ * indicates by how much the lookup count should be decreased.
+ */
+// the special inodes are static, their lookups are not counted
+void bb_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	if (!INODE->special)
+		inode_forget(BB_DATA->inodes, INODE, nlookup);
+	fuse_reply_none(req);
+}
 
-	RETURN(retstat);
+/**
+ * Forget about multiple inodes
+ */
+void bb_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		struct bb_inode *inode = bb_inode(req, forgets[i].ino);
+		if (!inode->special)
+			inode_forget(BB_DATA->inodes, inode, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
 }
 
-/** Read the target of a symbolic link
- *
- * The buffer should be filled with a null terminated string.  The
- * buffer size argument includes the space for the terminating
- * null character.  If the linkname is too long to fit in the
- * buffer, it should be truncated.  The return value should be 0
- * for success.
+/**
+ * Get file attributes.
  */
-// Note the system readlink() will truncate and lose the terminating
-// null.  So, the size passed to to the system readlink() must be one
-// less than the size passed to bb_readlink()
-// bb_readlink() code by Bernardo F Costa (thanks!)
-int bb_readlink(const char *UNUSED(path), char *link, size_t size)
+void bb_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *UNUSED(fi))
 {
-	int retstat;
-	char fpath[PATH_MAX];
+	struct stat statbuf;
 	CHECKPERM;
+	if (INODE->special)
+		bb_special_getattr(INODE, &statbuf);
+	else if (fstatat(INODE->fd, "", &statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_attr(req, &statbuf, BB_TIMEOUT);
+}
 
-	retstat = readlink(fpath, link, size - 1);
-	if (retstat >= 0) {
-		link[retstat] = '\0';
-		retstat = 0;
+/**
+ * Set file attributes
+ *
+ * In the 'attr' argument only members indicated by the 'to_set'
+ * bitmask contain valid values.  Other members contain undefined
+ * values.
+ *
+ * If the setattr was invoked from the ftruncate() system call,
+ * the 'fi->fh' will contain the value set by the open method.
+ */
+// chmod, chown, truncate and utimens of the high-level API in one
+void bb_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi)
+{
+	struct bb_inode *inode = INODE;
+	char proc[64];
+	int res = 0;
+	CHECKPERM;
+	CHECKDIR(inode);
+	bb_procname(proc, inode->fd);
+
+	if (to_set & FUSE_SET_ATTR_MODE)
+		res = chmod(proc, attr->st_mode);
+	if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t)-1;
+		gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t)-1;
+		res = fchownat(inode->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	}
+	// only a regular file can be truncated, so fh is one of ours
+	if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+		res = fi ? ftruncate(FILE_HANDLE->fd, attr->st_size) : truncate(proc, attr->st_size);
+	if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec tv[2] = { { 0, UTIME_OMIT }, { 0, UTIME_OMIT } };
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+		res = utimensat(AT_FDCWD, proc, tv, 0);
+	}
+	if (res < 0) {
+		fuse_reply_err(req, errno);
+		return;
 	}
+	bb_getattr(req, ino, fi);
+}
+
+/**
+ * Read symbolic link
+ */
+void bb_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char link[PATH_MAX];
+	ssize_t retstat;
+	CHECKPERM;
+	CHECKDIR(INODE);
 
-	RETURN(retstat);
+	retstat = readlinkat(INODE->fd, "", link, sizeof(link) - 1);
+	if (retstat < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	link[retstat] = '\0';
+	fuse_reply_readlink(req, link);
 }
 
-/** Create a file node
+/**
+ * Create file node
  *
- * There is no create() operation, mknod() will be called for
- * creation of all non-directory, non-symlink nodes.
+ * Create a regular file, character device, block device, fifo or
+ * socket node.
  */
-// shouldn't that comment be "if" there is no.... ?
-int bb_mknod(const char *path, mode_t mode, dev_t dev)
+void bb_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev)
 {
+	struct bb_inode *dir = bb_inode(req, parent);
 	int retstat;
-	char fpath[PATH_MAX];
 	CHECKPERM;
-	bb_fullpath(fpath, path);
+	CHECKDIR(dir);
 
 	// On Linux this could just be 'mknod(path, mode, dev)' but this
 	// tries to be be more portable by honoring the quote in the Linux
@@ -137,571 +362,1036 @@ int bb_mknod(const char *path, mode_t mode, dev_t dev)
 	// make a fifo, but saying it should never actually be used for
 	// that.
 	if (S_ISREG(mode)) {
-		retstat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+		retstat = openat(dir->fd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (retstat >= 0)
 			retstat = close(retstat);
 	} else
 		if (S_ISFIFO(mode))
-			retstat = mkfifo(fpath, mode);
+			retstat = mkfifoat(dir->fd, name, mode);
 		else
-			retstat = mknod(fpath, mode, dev);
+			retstat = mknodat(dir->fd, name, mode, dev);
 
-	RETURN(retstat);
+	if (retstat < 0)
+		fuse_reply_err(req, errno);
+	else
+		bb_reply_entry(req, dir, name);
 }
 
 /** Create a directory */
-int bb_mkdir(const char *path, mode_t mode)
+void bb_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-	char fpath[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, parent);
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(mkdir(fpath, mode));
+	CHECKDIR(dir);
+	if (mkdirat(dir->fd, name, mode) < 0)
+		fuse_reply_err(req, errno);
+	else
+		bb_reply_entry(req, dir, name);
 }
 
 /** Remove a file */
-int bb_unlink(const char *path)
+void bb_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	char fpath[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, parent);
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(unlink(fpath));
+	CHECKDIR(dir);
+	REPLY_ERR(unlinkat(dir->fd, name, 0));
 }
 
 /** Remove a directory */
-int bb_rmdir(const char *path)
+void bb_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	char fpath[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, parent);
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(rmdir(fpath));
+	CHECKDIR(dir);
+	REPLY_ERR(unlinkat(dir->fd, name, AT_REMOVEDIR));
 }
 
 /** Create a symbolic link */
-// The parameters here are a little bit confusing, but do correspond
-// to the symlink() system call.  The 'path' is where the link points,
-// while the 'link' is the link itself.  So we need to leave the path
-// unaltered, but insert the link into the mounted directory.
-int bb_symlink(const char *path, const char *link)
+// 'link' is where the link points, 'name' is the link itself
+void bb_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
-	char flink[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, parent);
 	CHECKPERM;
-	bb_fullpath(flink, link);
-	RETURN(symlink(path, flink));
+	CHECKDIR(dir);
+	if (symlinkat(link, dir->fd, name) < 0)
+		fuse_reply_err(req, errno);
+	else
+		bb_reply_entry(req, dir, name);
 }
 
-/** Rename a file */
-// both path and newpath are fs-relative
-int bb_rename(const char *path, const char *newpath)
+/** Rename a file
+ *
+ * If the target exists it should be atomically replaced. If
+ * the target's inode's lookup count is non-zero, the file
+ * system is expected to postpone any removal of the inode
+ * until the lookup count reaches zero (see description of the
+ * forget function).
+ */
+// RENAME_EXCHANGE and RENAME_NOREPLACE are not passed on, sudo does
+// not use them
+void bb_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
-	char fpath[PATH_MAX];
-	char fnewpath[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, parent), *newdir = bb_inode(req, newparent);
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-	bb_fullpath(fnewpath, newpath);
-	RETURN(rename(fpath, fnewpath));
+	CHECKDIR(dir);
+	CHECKDIR(newdir);
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	REPLY_ERR(renameat(dir->fd, name, newdir->fd, newname));
 }
 
-/** Create a hard link to a file */
-int bb_link(const char *path, const char *newpath)
+/** Create a hard link */
+void bb_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
 {
-	char fpath[PATH_MAX], fnewpath[PATH_MAX];
+	struct bb_inode *dir = bb_inode(req, newparent);
+	char proc[64];
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-	bb_fullpath(fnewpath, newpath);
-	RETURN(link(fpath, fnewpath));
+	CHECKDIR(INODE);
+	CHECKDIR(dir);
+	// linkat() of an O_PATH fd with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH,
+	// following the /proc link does not
+	bb_procname(proc, INODE->fd);
+	if (linkat(AT_FDCWD, proc, dir->fd, newname, AT_SYMLINK_FOLLOW) < 0)
+		fuse_reply_err(req, errno);
+	else
+		bb_reply_entry(req, dir, newname);
 }
 
-/** Change the permission bits of a file */
-int bb_chmod(const char *path, mode_t mode)
+// -o noship=PATTERN[:PATTERN...]: the writes to files whose path
+// relative to the mount point matches one of these are not shipped
+static int bb_noship(struct bb_state *bb_data, const char *path)
 {
-	char fpath[PATH_MAX];
-	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(chmod(fpath, mode));
+	const char *p, *end;
+	char pattern[PATH_MAX];
+	if (!bb_data->noship)
+		return 0;
+	for (p = bb_data->noship; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ':');
+		if (end - p >= PATH_MAX)
+			continue;
+		memcpy(pattern, p, end - p);
+		pattern[end - p] = '\0';
+		if (!fnmatch(pattern, path, 0))
+			return 1;
+	}
+	return 0;
 }
 
-/** Change the owner and group of a file */
-int bb_chown(const char *path, uid_t uid, gid_t gid)
+#ifdef FUSE_CAP_PASSTHROUGH
+/*
+ * With FUSE passthrough (Linux 6.9 and later), the kernel reads and
+ * writes a backing file that we registered with it itself, without
+ * asking us. The kernel takes only one backing file per inode, and
+ * while it has one, it fails every open of the inode that is not passed
+ * through with EIO. So only the files that are not shipped get one, and
+ * it is opened for reading and writing, so that all of their opens can
+ * share it. The writes to shipped files have to come through us, and
+ * sudo opens them again while e.g. sudoreplay reads them: they never
+ * get a backing file. Its own fd is not kept, the kernel holds a
+ * reference as long as the backing_id is registered.
+ */
+
+// 1 if the open can be passed through
+static int bb_passthrough_open(fuse_req_t req, struct bb_inode *inode,
+		struct fuse_file_info *fi)
+{
+	pthread_mutex_t *lock = inode_lock(BB_DATA->inodes, inode);
+	char proc[64];
+	int fd, id = 0;
+	pthread_mutex_lock(lock);
+	if (inode->backing_id) {
+		inode->backing_refs++;
+		id = inode->backing_id;
+	} else {
+		bb_procname(proc, inode->fd);
+		fd = open(proc, O_RDWR);
+		if (fd >= 0) {
+			id = fuse_passthrough_open(req, fd);
+			close(fd);
+		}
+		if (id > 0) {
+			inode->backing_id = id;
+			inode->backing_refs = 1;
+		} else {
+			id = 0;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	fi->backing_id = id;
+	return id > 0;
+}
 
+static void bb_passthrough_release(fuse_req_t req, struct bb_inode *inode)
 {
-	char fpath[PATH_MAX];
-	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(chown(fpath, uid, gid));
+	pthread_mutex_t *lock = inode_lock(BB_DATA->inodes, inode);
+	pthread_mutex_lock(lock);
+	if (!--inode->backing_refs) {
+		fuse_passthrough_close(req, inode->backing_id);
+		inode->backing_id = 0;
+	}
+	pthread_mutex_unlock(lock);
 }
+#endif
 
-/** Change the size of a file */
-int bb_truncate(const char *path, off_t newsize)
+// a new file_state for the first open of a file, NULL and errno set
+// if there is no memory
+static struct file_state *bb_file_state(struct bb_state *bb_data, int fd)
 {
-	char fpath[PATH_MAX];
-	CHECKPERM;
-	bb_fullpath(fpath, path);
-	RETURN(truncate(fpath, newsize));
+	struct file_state *file_state;
+	char path[PATH_MAX];
+	int err;
+	file_state = calloc(sizeof(struct file_state), 1);
+	if (!file_state || bb_relpath(bb_data, fd, path) < 0 ||
+	    !(file_state->path = strdup(path))) {
+		err = file_state ? errno : ENOMEM;
+		free(file_state);
+		errno = err;
+		return NULL;
+	}
+	file_state->refs = 1;
+	file_state->noship = bb_noship(bb_data, path);
+	// the syslog header only depends on the file name, so prepare it
+	// now instead of on every write. If the name is too long, the file
+	// can still be used, but writes are not shipped (log_header() logs it)
+	if (!file_state->noship)
+		log_header(bb_data, file_state, path);
+	sender_attach(bb_data, file_state);
+	stats_open(file_state);
+	return file_state;
 }
 
-/** Change the access and/or modification times of a file */
-/* note -- I'll want to change this as soon as 2.6 is in debian testing */
-int bb_utime(const char *path, struct utimbuf *ubuf)
+// The handle of a freshly opened backing file. sudo opens some of its
+// files more than once, all opens of a file share one file_state, which
+// hangs off the inode, so that the writes of all of them are shipped by
+// the same sender, one after the other and with one sequence of numbers.
+static int bb_open_fd(fuse_req_t req, struct bb_inode *inode, int fd,
+		struct fuse_file_info *fi)
 {
-	char fpath[PATH_MAX];
-	CHECKPERM;
-	bb_fullpath(fpath, path);
+	pthread_mutex_t *lock = inode_lock(BB_DATA->inodes, inode);
+	struct bb_file *fh;
+	int err;
+	fh = calloc(sizeof(struct bb_file), 1);
+	if (!fh) {
+		close(fd);
+		return -ENOMEM;
+	}
+	fh->fd = fd;
+	pthread_mutex_lock(lock);
+	if (inode->ship) {
+		inode->ship->refs++;
+		fh->file_state = inode->ship;
+	} else {
+		fh->file_state = inode->ship = bb_file_state(BB_DATA, fd);
+	}
+	err = errno;
+	pthread_mutex_unlock(lock);
+	if (!fh->file_state) {
+		free(fh);
+		close(fd);
+		return -err;
+	}
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (BB_DATA->passthrough && fh->file_state->noship) {
+		fh->passthrough = bb_passthrough_open(req, inode, fi);
+		// an open of a file that is not shipped, that could not be
+		// passed through, must not keep later ones from it: the kernel
+		// refuses passthrough while the inode is in its page cache,
+		// direct I/O does not count
+		if (!fh->passthrough)
+			fi->direct_io = 1;
+	}
+#endif
+	fi->fh = (uint64_t)fh;
+	return 0;
+}
 
-	RETURN(utime(fpath, ubuf));
+// the last handle of a file takes the file_state with it, the sender
+// frees it after shipping what is still queued
+static void bb_release_fd(fuse_req_t req, struct bb_inode *inode, struct bb_file *fh)
+{
+	pthread_mutex_t *lock = inode_lock(BB_DATA->inodes, inode);
+	struct file_state *file_state = fh->file_state;
+	int last;
+	pthread_mutex_lock(lock);
+	last = !--file_state->refs;
+	if (last)
+		inode->ship = NULL;
+	pthread_mutex_unlock(lock);
+	if (last) {
+		stats_close(file_state);
+		sender_release(BB_DATA, file_state);
+	}
+	free(fh);
 }
 
-/** File open operation
+/**
+ * Open a file
  *
- * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
- * will be passed to open().  Open should check if the operation
- * is permitted for the given flags.  Optionally open may also
- * return an arbitrary filehandle in the fuse_file_info structure,
- * which will be passed to all file operations.
+ * Open flags are available in fi->flags. Creation (O_CREAT,
+ * O_EXCL, O_NOCTTY) flags will be filtered out.
  *
- * Changed in version 2.2
+ * Filesystem may store an arbitrary file handle (pointer, index,
+ * etc) in fi->fh, and use this in other all other file operations
+ * (read, write, flush, release, fsync).
  */
-int bb_open(const char *path, struct fuse_file_info *fi)
+void bb_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	int retstat = 0;
-	int fd;
-	struct file_state *file_state;
-	char fpath[PATH_MAX];
+	char proc[64];
+	int fd, retstat;
 	CHECKPERM;
-	file_state = calloc(sizeof(struct file_state), 1);
-	if (!file_state)
-		return -ENOMEM;
-
-	bb_fullpath(fpath, path);
+	if (INODE->special) {
+		retstat = INODE->special == SPECIAL_STATS ? bb_stats_open(BB_DATA, fi) : -EISDIR;
+		if (retstat < 0)
+			fuse_reply_err(req, -retstat);
+		else
+			fuse_reply_open(req, fi);
+		return;
+	}
 
-	// if the open call succeeds, my retstat is the file descriptor,
-	// else it's -errno.  I'm making sure that in that case the saved
-	// file descriptor is exactly -1.
-	fd = open(fpath, fi->flags);
-	if (fd < 0)
-		retstat = -errno;
+	// reopen the O_PATH fd for real
+	bb_procname(proc, INODE->fd);
+	fd = open(proc, fi->flags & ~O_NOFOLLOW);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	retstat = bb_open_fd(req, INODE, fd, fi);
+	if (retstat < 0)
+		fuse_reply_err(req, -retstat);
+	else
+		fuse_reply_open(req, fi);
+}
 
-	file_state->fd = fd;
-	fi->fh = (uint64_t)file_state;
+/**
+ * Create and open a file
+ *
+ * If the file does not exist, first create it with the specified
+ * mode, and then open it.
+ */
+void bb_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		struct fuse_file_info *fi)
+{
+	struct bb_inode *dir = bb_inode(req, parent), *inode;
+	struct fuse_entry_param e;
+	int fd, retstat;
+	CHECKPERM;
+	CHECKDIR(dir);
 
-	return retstat;
+	fd = openat(dir->fd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	// the inode is needed before the open for passthrough
+	retstat = bb_entry(req, dir, name, &e);
+	if (retstat) {
+		close(fd);
+		fuse_reply_err(req, retstat);
+		return;
+	}
+	inode = bb_inode(req, e.ino);
+	retstat = inode->special ? -EEXIST : bb_open_fd(req, inode, fd, fi);
+	if (retstat < 0) {
+		if (inode->special)
+			close(fd);
+		else
+			inode_forget(BB_DATA->inodes, inode, 1);
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_create(req, &e, fi);
+	}
 }
 
-/** Read data from an open file
+/**
+ * Read data
  *
- * Read should return exactly the number of bytes requested except
+ * Read should send exactly the number of bytes requested except
  * on EOF or error, otherwise the rest of the data will be
- * substituted with zeroes.  An exception to this is when the
- * 'direct_io' mount option is specified, in which case the return
+ * substituted with zeroes.  An exception to this is when the file
+ * has been opened in 'direct_io' mode, in which case the return
  * value of the read system call will reflect the return value of
  * this operation.
- *
- * Changed in version 2.2
  */
-// I don't fully understand the documentation above -- it doesn't
-// match the documentation for the read() system call which says it
-// can return with anything up to the amount of data requested. nor
-// with the fusexmp code which returns the amount of data also
-// returned by read.
-int bb_read(const char *UNUSED(path), char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// hand out the backing fd, so that libfuse can splice() from the
+// page cache into /dev/fuse without a copy in between
+void bb_read(fuse_req_t req, fuse_ino_t UNUSED(ino), size_t size, off_t offset,
+		struct fuse_file_info *fi)
 {
-	int retstat = 0;
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
 	CHECKPERM;
 
-	retstat = pread(FILE_STATE->fd, buf, size, offset);
-	RETURN(retstat);
+	if (FILE_HANDLE->snapshot) {
+		if (offset >= (off_t)FILE_HANDLE->snaplen)
+			size = 0;
+		else if (size > FILE_HANDLE->snaplen - offset)
+			size = FILE_HANDLE->snaplen - offset;
+		fuse_reply_buf(req, FILE_HANDLE->snapshot + offset, size);
+		return;
+	}
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = FILE_HANDLE->fd;
+	buf.buf[0].pos = offset;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void bb_write_account(struct file_state *file_state, size_t size)
+{
+	stats_add(ST_WRITES, 1);
+	stats_add(ST_WRITE_BYTES, size);
+	__atomic_fetch_add(&file_state->st_writes, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&file_state->st_bytes, size, __ATOMIC_RELAXED);
+}
+
+// the data is in memory: ship a copy and write it to the backing file.
+// Returns the bytes written or -errno
+static int bb_write(struct bb_state *bb_data, struct bb_file *fh,
+		const char *buf, size_t size, off_t offset)
+{
+	struct file_state *file_state = fh->file_state;
+	int retstat = 0;
+	unsigned long long start, t;
+
+	PROBE3(write__start, file_state->path, size, offset);
+	start = stats_now();
+	// queue the data for shipping first: if we cannot ship it, it
+	// shall not end up in the local file either.
+	retstat = sender_write(bb_data, file_state, file_state->path, buf, size, offset);
+	t = stats_time(H_QUEUE, start);
+	if (retstat < 0) {
+		stats_add(ST_WRITE_ERRORS, 1);
+		PROBE3(write__done, file_state->path, size, retstat);
+		return retstat;
+	}
+	bb_write_account(file_state, size);
+	retstat = pwrite(fh->fd, buf, size, offset);
+	if (retstat < 0)
+		retstat = -errno;
+	t = stats_time(H_PWRITE, t);
+	stats_record(H_WRITE, t - start);
+	PROBE3(write__done, file_state->path, size, retstat);
+	return retstat;
+}
+
+/*
+ * with splice, the data of big writes arrives in a pipe. It has to end
+ * up in the backing file and, base64 encoded, on the log hosts, but
+ * reading it out of the pipe consumes it. So it is tee()d into a second
+ * pipe first, which is spliced into the backing file, and only the
+ * shipped copy is read into memory. Each FUSE thread has its own pipe.
+ */
+struct tee_pipe {
+	int fd[2];
+	size_t size;
+};
+static pthread_key_t tee_key;
+static pthread_once_t tee_once = PTHREAD_ONCE_INIT;
+
+static void tee_free(void *arg)
+{
+	struct tee_pipe *tp = arg;
+	close(tp->fd[0]);
+	close(tp->fd[1]);
+	free(tp);
 }
 
-/** Write data to an open file
+static void tee_key_init(void)
+{
+	if (pthread_key_create(&tee_key, tee_free))
+		syslog(LOG_ERR, "%s: pthread_key_create failed", __func__);
+}
+
+/* a pipe that can take size bytes, NULL if there is none */
+static struct tee_pipe *tee_get(size_t size)
+{
+	struct tee_pipe *tp;
+	int n;
+	pthread_once(&tee_once, tee_key_init);
+	tp = pthread_getspecific(tee_key);
+	if (!tp) {
+		tp = malloc(sizeof(struct tee_pipe));
+		if (!tp)
+			return NULL;
+		if (pipe(tp->fd) < 0) {
+			free(tp);
+			return NULL;
+		}
+		tp->size = fcntl(tp->fd[0], F_GETPIPE_SZ);
+		if (pthread_setspecific(tee_key, tp)) {
+			tee_free(tp);
+			return NULL;
+		}
+	}
+	/* the data may start in the middle of a page */
+	if (tp->size < size + getpagesize()) {
+		n = fcntl(tp->fd[0], F_SETPIPE_SZ, size + getpagesize());
+		if (n < 0)
+			return NULL;
+		tp->size = n;
+	}
+	return tp;
+}
+
+/* after an error, there may be data left in the pipe */
+static void tee_drop(struct tee_pipe *tp)
+{
+	pthread_setspecific(tee_key, NULL);
+	tee_free(tp);
+}
+
+/* the data is in a pipe: splice it into the backing file and ship what
+ * got there. -ENOTSUP if it has to go the bb_write() way */
+static int bb_write_tee(struct bb_state *bb_data, struct bb_file *fh,
+		struct fuse_bufvec *buf, size_t size, off_t offset)
+{
+	struct file_state *file_state = fh->file_state;
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	struct tee_pipe *tp;
+	unsigned long long start, t;
+	ssize_t n;
+	int retstat;
+	char *data;
+
+	if (buf->count != 1 || buf->idx || buf->off ||
+	    (buf->buf[0].flags & (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK)) != FUSE_BUF_IS_FD)
+		return -ENOTSUP;
+	if (!(tp = tee_get(size)))
+		return -ENOTSUP;
+	n = tee(buf->buf[0].fd, tp->fd[1], size, SPLICE_F_NONBLOCK);
+	if (n != (ssize_t)size) {
+		if (n > 0)
+			tee_drop(tp);
+		return -ENOTSUP;
+	}
+
+	PROBE3(write__start, file_state->path, size, offset);
+	start = stats_now();
+	// the one copy in user memory: straight into the record for the
+	// sender. Taken before anything is written, so that a used up
+	// memory budget still fails the write as a whole
+	data = sender_buffer(bb_data, size);
+	if (!data) {
+		retstat = -errno;
+		tee_drop(tp);
+		stats_add(ST_WRITE_ERRORS, 1);
+		PROBE3(write__done, file_state->path, size, retstat);
+		return retstat;
+	}
+	mem.buf[0].mem = data;
+	n = fuse_buf_copy(&mem, buf, FUSE_BUF_NO_SPLICE);
+	if (n != (ssize_t)size) {
+		sender_discard(data);
+		tee_drop(tp);
+		return n < 0 ? n : -EIO;
+	}
+	src.buf[0].flags = FUSE_BUF_IS_FD;
+	src.buf[0].fd = tp->fd[0];
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fh->fd;
+	dst.buf[0].pos = offset;
+	// falls back to read() and write() if the backing file system
+	// cannot splice
+	n = fuse_buf_copy(&dst, &src, FUSE_BUF_SPLICE_MOVE);
+	if (n != (ssize_t)size)
+		tee_drop(tp);
+	t = stats_time(H_PWRITE, start);
+	// a short write ships just the part that is in the file
+	if (n <= 0) {
+		sender_discard(data);
+		retstat = n;
+	} else {
+		retstat = sender_submit(bb_data, file_state, file_state->path, data, n, offset);
+		t = stats_time(H_QUEUE, t);
+		if (retstat < 0)
+			stats_add(ST_WRITE_ERRORS, 1);
+		else {
+			bb_write_account(file_state, n);
+			retstat = n;
+		}
+	}
+	stats_record(H_WRITE, t - start);
+	PROBE3(write__done, file_state->path, size, retstat);
+	return retstat;
+}
+
+/**
+ * Write data made available in a buffer
  *
- * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
+ * This is a more generic version of the ->write() method.  If
+ * FUSE_CAP_SPLICE_READ is set in fuse_conn_info.want and the
+ * kernel supports splicing from the fuse device, then the
+ * data will be made available in pipe for supporting zero
+ * copy data transfer.
  *
- * Changed in version 2.2
+ * Write should return exactly the number of bytes requested
+ * except on error.
  */
-// As  with read(), the documentation above is inconsistent with the
-// documentation for the write() system call.
-int bb_write(const char *path, const char *buf, size_t size, off_t offset,
+void bb_write_buf(fuse_req_t req, fuse_ino_t UNUSED(ino), struct fuse_bufvec *buf, off_t offset,
 		struct fuse_file_info *fi)
 {
-	int retstat = 0;
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	ssize_t n;
+	int retstat;
 	CHECKPERM;
 
-	retstat = pwrite(FILE_STATE->fd, buf, size, offset);
-	log_send(BB_DATA, FILE_STATE, path, buf, size, offset);
-	RETURN(retstat);
+	if (FILE_HANDLE->snapshot) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	// not shipped, and not passed through: just the backing file
+	if (FILE_STATE->noship) {
+		mem.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		mem.buf[0].fd = FILE_HANDLE->fd;
+		mem.buf[0].pos = offset;
+		n = fuse_buf_copy(&mem, buf, FUSE_BUF_SPLICE_MOVE);
+		if (n < 0)
+			fuse_reply_err(req, -n);
+		else
+			fuse_reply_write(req, n);
+		return;
+	}
+	// small writes come in memory anyway
+	if (buf->count == 1 && !buf->idx && !buf->off && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		retstat = bb_write(BB_DATA, FILE_HANDLE, buf->buf[0].mem, size, offset);
+	else
+		retstat = bb_write_tee(BB_DATA, FILE_HANDLE, buf, size, offset);
+	if (retstat == -ENOTSUP) {
+		// no second pipe: read it into memory and take the usual way
+		mem.buf[0].mem = malloc(size);
+		if (!mem.buf[0].mem) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		n = fuse_buf_copy(&mem, buf, FUSE_BUF_NO_SPLICE);
+		if (n < 0)
+			retstat = n;
+		else
+			retstat = bb_write(BB_DATA, FILE_HANDLE, mem.buf[0].mem, n, offset);
+		free(mem.buf[0].mem);
+	}
+	if (retstat < 0)
+		fuse_reply_err(req, -retstat);
+	else
+		fuse_reply_write(req, retstat);
 }
 
-/** Get file system statistics
- *
- * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
- *
- * Replaced 'struct statfs' parameter with 'struct statvfs' in
- * version 2.5
+/**
+ * Get file system statistics
  */
-int bb_statfs(const char *path, struct statvfs *statv)
+void bb_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	int retstat = 0;
-	char fpath[PATH_MAX];
+	struct statvfs statv;
+	struct bb_inode *inode = INODE;
 	CHECKPERM;
-	bb_fullpath(fpath, path);
+	if (inode->special)
+		inode = inode_root(BB_DATA->inodes);
 
 	// get stats for underlying filesystem
-	retstat = statvfs(fpath, statv);
-	RETURN(retstat);
+	if (fstatvfs(inode->fd, &statv) < 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &statv);
 }
 
-/** Possibly flush cached data
- *
- * BIG NOTE: This is not equivalent to fsync().  It's not a
- * request to sync dirty data.
+/**
+ * Flush method
  *
- * Flush is called on each close() of a file descriptor.  So if a
- * filesystem wants to return write errors in close() and the file
- * has cached dirty data, this is a good place to write back data
- * and return any errors.  Since many applications ignore close()
- * errors this is not always useful.
+ * This is called on each close() of the opened file.
  *
- * NOTE: The flush() method may be called more than once for each
- * open().  This happens if more than one file descriptor refers
- * to an opened file due to dup(), dup2() or fork() calls.  It is
- * not possible to determine if a flush is final, so each flush
- * should be treated equally.  Multiple write-flush sequences are
- * relatively rare, so this shouldn't be a problem.
+ * Since file descriptors can be duplicated (dup, dup2, fork), for
+ * one open call there may be many flush calls.
  *
  * Filesystems shouldn't assume that flush will always be called
  * after some writes, or that if will be called at all.
  *
- * Changed in version 2.2
+ * NOTE: the name of the method is misleading, since (unlike
+ * fsync) the filesystem is not forced to flush pending writes.
+ * One reason to flush data is if the filesystem wants to return
+ * write errors during close.  However, such use is non-portable
+ * because POSIX does not require [close] to wait for delayed I/O to
+ * complete.
  */
-// this is a no-op in BBFS.  It just logs the call and returns success
-int bb_flush(const char *UNUSED(path), struct fuse_file_info *UNUSED(fi))
+// Nothing to do for the backing file, but small writes that the sender
+// is still holding back for coalescing are shipped now.
+void bb_flush(fuse_req_t req, fuse_ino_t UNUSED(ino), struct fuse_file_info *fi)
 {
-	// no need to get fpath on this one, since I work from fi->fh not the path
-	return 0;
+	if (!FILE_HANDLE->snapshot)
+		sender_flush(BB_DATA, FILE_STATE);
+	fuse_reply_err(req, 0);
 }
 
-/** Release an open file
+/**
+ * Release an open file
  *
  * Release is called when there are no more references to an open
  * file: all file descriptors are closed and all memory mappings
  * are unmapped.
  *
- * For every open() call there will be exactly one release() call
- * with the same flags and file descriptor.  It is possible to
- * have a file opened more than once, in which case only the last
- * release will mean, that no more reads/writes will happen on the
- * file.  The return value of release is ignored.
- *
- * Changed in version 2.2
+ * For every open call there will be exactly one release call (unless
+ * the filesystem is force-unmounted).
  */
-int bb_release(const char *UNUSED(path), struct fuse_file_info *fi)
+void bb_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	// We need to close the file.  Had we allocated any resources
-	// (buffers etc) we'd need to free them here as well.
-	int ret = close(FILE_STATE->fd);
-	free(FILE_STATE);
-	RETURN(ret);
+	// We need to close the file.  The file_state is still referenced
+	// by queued records, so the sender frees it after shipping them.
+	int ret;
+	if (FILE_HANDLE->snapshot) {
+		free(FILE_HANDLE->snapshot);
+		free(FILE_HANDLE);
+		fuse_reply_err(req, 0);
+		return;
+	}
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (FILE_HANDLE->passthrough)
+		bb_passthrough_release(req, INODE);
+#endif
+	ret = close(FILE_HANDLE->fd);
+	bb_release_fd(req, INODE, FILE_HANDLE);
+	REPLY_ERR(ret);
 }
 
-/** Synchronize file contents
+/**
+ * Synchronize file contents
  *
  * If the datasync parameter is non-zero, then only the user data
  * should be flushed, not the meta data.
- *
- * Changed in version 2.2
  */
-int bb_fsync(const char *UNUSED(path), int datasync, struct fuse_file_info *fi)
+void bb_fsync(fuse_req_t req, fuse_ino_t UNUSED(ino), int datasync, struct fuse_file_info *fi)
 {
 	// some unix-like systems (notably freebsd) don't have a datasync call
 	CHECKPERM;
+	if (FILE_HANDLE->snapshot) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	sender_flush(BB_DATA, FILE_STATE);
 #ifdef HAVE_FDATASYNC
 	if (datasync)
-		RETURN(fdatasync(FILE_STATE->fd));
+		REPLY_ERR(fdatasync(FILE_HANDLE->fd));
 	else
-#endif	
-		RETURN(fsync(FILE_STATE->fd));
+#endif
+		REPLY_ERR(fsync(FILE_HANDLE->fd));
 }
 
 #ifdef HAVE_SYS_XATTR_H
-/** Set extended attributes */
-int bb_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+// there are no f*xattr() calls for O_PATH fds, the /proc link of one
+// leads to the inode itself, also for a symlink
+
+/** Set an extended attribute */
+void bb_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+		size_t size, int flags)
 {
-	char fpath[PATH_MAX];
+	char proc[64];
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	RETURN(lsetxattr(fpath, name, value, size, flags));
+	CHECKDIR(INODE);
+	bb_procname(proc, INODE->fd);
+	REPLY_ERR(setxattr(proc, name, value, size, flags));
 }
 
-/** Get extended attributes */
-int bb_getxattr(const char *path, const char *name, char *value, size_t size)
+/**
+ * Get an extended attribute
+ *
+ * If size is zero, the size of the value should be sent with
+ * fuse_reply_xattr.
+ */
+void bb_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
-	int retstat = 0;
-	char fpath[PATH_MAX];
+	char proc[64], *value = NULL;
+	ssize_t retstat;
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	retstat = lgetxattr(fpath, name, value, size);
-	RETURN(retstat);
+	if (INODE->special) {
+		fuse_reply_err(req, ENODATA);
+		return;
+	}
+	bb_procname(proc, INODE->fd);
+	if (size && !(value = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	retstat = getxattr(proc, name, value, size);
+	if (retstat < 0)
+		fuse_reply_err(req, errno);
+	else if (size)
+		fuse_reply_buf(req, value, retstat);
+	else
+		fuse_reply_xattr(req, retstat);
+	free(value);
 }
 
-/** List extended attributes */
-int bb_listxattr(const char *path, char *list, size_t size)
+/**
+ * List extended attribute names
+ *
+ * If size is zero, the total size of the attribute list should be
+ * sent with fuse_reply_xattr.
+ */
+void bb_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	int retstat = 0;
-	char fpath[PATH_MAX];
+	char proc[64], *list = NULL;
+	ssize_t retstat = 0;
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	retstat = llistxattr(fpath, list, size);
-	RETURN(retstat);
+	if (size && !(list = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (!INODE->special) {
+		bb_procname(proc, INODE->fd);
+		retstat = listxattr(proc, list, size);
+	}
+	if (retstat < 0)
+		fuse_reply_err(req, errno);
+	else if (size)
+		fuse_reply_buf(req, list, retstat);
+	else
+		fuse_reply_xattr(req, retstat);
+	free(list);
 }
 
-/** Remove extended attributes */
-int bb_removexattr(const char *path, const char *name)
+/** Remove an extended attribute */
+void bb_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
-	char fpath[PATH_MAX];
+	char proc[64];
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	RETURN(lremovexattr(fpath, name));
+	CHECKDIR(INODE);
+	bb_procname(proc, INODE->fd);
+	REPLY_ERR(removexattr(proc, name));
 }
 #endif
 
-/** Open directory
- *
- * This method should check if the open operation is permitted for
- * this  directory
+/* an open directory, readdir() may stop in the middle of an entry */
+struct bb_dir {
+	DIR *dp;
+	struct dirent *entry;	/* read, but not handed out yet */
+	off_t offset;
+};
+
+/**
+ * Open a directory
  *
- * Introduced in version 2.3
+ * Filesystem may store an arbitrary file handle (pointer, index,
+ * etc) in fi->fh, and use this in other all other directory
+ * stream operations (readdir, releasedir, fsyncdir).
  */
-int bb_opendir(const char *path, struct fuse_file_info *fi)
+void bb_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	DIR *dp;
-	int retstat = 0;
-	char fpath[PATH_MAX];
+	struct bb_dir *d;
+	int fd;
 	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	// since opendir returns a pointer, takes some custom handling of
-	// return status.
-	dp = opendir(fpath);
-	if (dp == NULL)
-		retstat = -errno;
-
-	fi->fh = (intptr_t) dp;
+	// no bb_dir for /.sudologfs, bb_readdir() makes up its contents
+	if (INODE->special) {
+		if (INODE->special != SPECIAL_DIR) {
+			fuse_reply_err(req, ENOTDIR);
+			return;
+		}
+		fi->fh = 0;
+		fuse_reply_open(req, fi);
+		return;
+	}
 
-	return retstat;
+	d = calloc(1, sizeof(struct bb_dir));
+	if (!d) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fd = openat(INODE->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || !(d->dp = fdopendir(fd))) {
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		free(d);
+		fuse_reply_err(req, err);
+		return;
+	}
+	fi->fh = (uintptr_t)d;
+	fuse_reply_open(req, fi);
 }
 
-/** Read directory
- *
- * This supersedes the old getdir() interface.  New applications
- * should use this.
- *
- * The filesystem may choose between two modes of operation:
- *
- * 1) The readdir implementation ignores the offset parameter, and
- * passes zero to the filler function's offset.  The filler
- * function will not return '1' (unless an error happens), so the
- * whole directory is read in a single readdir operation.  This
- * works just like the old getdir() method.
+/**
+ * Read directory
  *
- * 2) The readdir implementation keeps track of the offsets of the
- * directory entries.  It uses the offset parameter and always
- * passes non-zero offset to the filler function.  When the buffer
- * is full (or an error happens) the filler function will return
- * '1'.
+ * Send a buffer filled using fuse_add_direntry(), with size not
+ * exceeding the requested size.  Send an empty buffer on end of
+ * stream.
  *
- * Introduced in version 2.3
+ * The offset passed in is the offset of the entry after the last
+ * one returned, or zero for the first call.
  */
-
-int bb_readdir(const char *UNUSED(path), void *buf, fuse_fill_dir_t filler, off_t UNUSED(offset),
+void bb_readdir(fuse_req_t req, fuse_ino_t UNUSED(ino), size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	int retstat = 0;
-	DIR *dp;
-	struct dirent *de;
+	static const char *special[] = { ".", "..", "stats" };
+	struct bb_dir *d = (struct bb_dir *)(uintptr_t)fi->fh;
+	struct stat st;
+	char *buf, *p;
+	size_t rem = size, n;
+	int err = 0;
 	CHECKPERM;
 
-	// once again, no need for fullpath -- but note that I need to cast fi->fh
-	dp = (DIR *) (uintptr_t) fi->fh;
-
-	// Every directory contains at least two entries: . and ..  If my
-	// first call to the system readdir() returns NULL I've got an
-	// error; near as I can tell, that's the only condition under
-	// which I can get an error from readdir()
-	de = readdir(dp);
-	if (de == 0) {
-		return -errno;
-	}
-
-	// This will copy the entire directory into the buffer.  The loop exits
-	// when either the system readdir() returns NULL, or filler()
-	// returns something non-zero.  The first case just means I've
-	// read the whole directory; the second means the buffer is full.
-	do {
-		if (filler(buf, de->d_name, NULL, 0) != 0) {
-			return -ENOMEM;
+	buf = p = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memset(&st, 0, sizeof(st));
+	if (!d) {
+		for (; offset < 3; offset++) {
+			n = fuse_add_direntry(req, p, rem, special[offset], &st, offset + 1);
+			if (n > rem)
+				break;
+			p += n;
+			rem -= n;
 		}
-	} while ((de = readdir(dp)) != NULL);
-
-	return retstat;
+	} else {
+		if (offset != d->offset) {
+			seekdir(d->dp, offset);
+			d->entry = NULL;
+			d->offset = offset;
+		}
+		for (;;) {
+			if (!d->entry) {
+				errno = 0;
+				d->entry = readdir(d->dp);
+				if (!d->entry) {
+					// an error only counts if nothing was read
+					if (errno && rem == size)
+						err = errno;
+					break;
+				}
+			}
+			st.st_ino = d->entry->d_ino;
+			st.st_mode = d->entry->d_type << 12;
+			n = fuse_add_direntry(req, p, rem, d->entry->d_name, &st, d->entry->d_off);
+			if (n > rem)
+				break;
+			p += n;
+			rem -= n;
+			d->offset = d->entry->d_off;
+			d->entry = NULL;
+		}
+	}
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, buf, size - rem);
+	free(buf);
 }
 
-/** Release directory
+/**
+ * Release an open directory
  *
- * Introduced in version 2.3
+ * For every opendir call there will be exactly one releasedir
+ * call (unless the filesystem is force-unmounted).
  */
-int bb_releasedir(const char *UNUSED(path), struct fuse_file_info *fi)
+void bb_releasedir(fuse_req_t req, fuse_ino_t UNUSED(ino), struct fuse_file_info *fi)
 {
-	int retstat = 0;
-	closedir((DIR *) (uintptr_t) fi->fh);
-	return retstat;
+	struct bb_dir *d = (struct bb_dir *)(uintptr_t)fi->fh;
+	if (d) {
+		closedir(d->dp);
+		free(d);
+	}
+	fuse_reply_err(req, 0);
 }
 
-/** Synchronize directory contents
- *
- * If the datasync parameter is non-zero, then only the user data
- * should be flushed, not the meta data
+/**
+ * Synchronize directory contents
  *
- * Introduced in version 2.3
+ * If the datasync parameter is non-zero, then only the directory
+ * contents should be flushed, not the meta data.
  */
 // when exactly is this called?  when a user calls fsync and it
 // happens to be a directory? ??? >>> I need to implement this...
-int bb_fsyncdir(const char *UNUSED(path), int UNUSED(datasync), struct fuse_file_info *UNUSED(fi))
+void bb_fsyncdir(fuse_req_t req, fuse_ino_t UNUSED(ino), int UNUSED(datasync),
+		struct fuse_file_info *UNUSED(fi))
 {
-	int retstat = 0;
-	return retstat;
+	fuse_reply_err(req, 0);
 }
 
 /**
  * Initialize filesystem
  *
- * The return value will passed in the private_data field of
- * fuse_context to all file operations and as a parameter to the
- * destroy() method.
- *
- * Introduced in version 2.3
- * Changed in version 2.6
+ * This function is called when libfuse establishes
+ * communication with the FUSE kernel module. The file system
+ * should use this module to inspect and/or modify the
+ * connection parameters provided in the `conn` structure.
  */
-// Undocumented but extraordinarily useful fact:  the fuse_context is
-// set up before this function is called, and
-// fuse_get_context()->private_data returns the user_data passed to
-// fuse_main().  Really seems like either it should be a third
-// parameter coming in here, or else the fact should be documented
-// (and this might as well return void, as it did in older versions of
-// FUSE).
-void *bb_init(struct fuse_conn_info *UNUSED(conn))
+void bb_init(void *userdata, struct fuse_conn_info *conn)
 {
-	return BB_DATA;
+	struct bb_state *bb_data = (struct bb_state *)userdata;
+	// bulk output should not arrive in single pages
+	conn->max_write = BB_MAX_WRITE;
+	// let big writes arrive in a pipe and reads go out of one, see
+	// bb_write_buf() and bb_read()
+	conn->want |= conn->capable &
+		(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#ifdef FUSE_CAP_PASSTHROUGH
+	// the I/O on files that are not shipped does not need to come
+	// through us at all, see bb_open_fd()
+	if (bb_data->noship && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		bb_data->passthrough = 1;
+	}
+#endif
+	// the sender threads need to be started here and not in main(),
+	// since fuse_daemonize() forks into the background before.
+	if (sender_start(bb_data) < 0) {
+		syslog(LOG_ERR, "cannot start sender threads, exiting");
+		exit(1);
+	}
+	// without it, the latencies are still in the stats file
+	stats_start();
 }
 
 /**
- * Clean up filesystem
+ * Clean up filesystem.
  *
  * Called on filesystem exit.
- *
- * Introduced in version 2.3
  */
 void bb_destroy(void *userdata)
 {
 	/* clean up, free allocated stuff */
 	struct bb_state *bb_data = (struct bb_state *)userdata;
+	stats_stop();
+	sender_stop(bb_data);
+	log_close(bb_data);
+	inode_table_free(bb_data->inodes);
 	free(bb_data->rootdir);
+	free(bb_data->noship);
 	free(bb_data);
 }
 
 /**
  * Check file access permissions
  *
- * This will be called for the access() system call.  If the
- * 'default_permissions' mount option is given, this method is not
- * called.
- *
- * This method is not called under Linux kernel versions 2.4.x
- *
- * Introduced in version 2.5
- */
-int bb_access(const char *path, int mask)
-{
-	int retstat = 0;
-	char fpath[PATH_MAX];
-	CHECKPERM;
-	bb_fullpath(fpath, path);
-
-	retstat = access(fpath, mask);
-	RETURN(retstat);
-}
-
-/**
- * Create and open a file
- *
- * If the file does not exist, first create it with the specified
- * mode, and then open it.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the mknod() and open() methods
- * will be called instead.
- *
- * Introduced in version 2.5
- */
-// Not implemented.  I had a version that used creat() to create and
-// open the file, which it turned out opened the file write-only.
-
-/**
- * Change the size of an open file
- *
- * This method is called instead of the truncate() method if the
- * truncation was invoked from an ftruncate() system call.
- *
- * If this method is not implemented or under Linux kernel
- * versions earlier than 2.6.15, the truncate() method will be
- * called instead.
- *
- * Introduced in version 2.5
+ * This will be called for the access() and chdir() system
+ * calls.  If the 'default_permissions' mount option is given,
+ * this method is not called.
  */
-int bb_ftruncate(const char *UNUSED(path), off_t offset, struct fuse_file_info *fi)
+void bb_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	int retstat = 0;
+	char proc[64];
 	CHECKPERM;
-	retstat = ftruncate(FILE_STATE->fd, offset);
-	RETURN(retstat);
-}
-
-/**
- * Get attributes from an open file
- *
- * This method is called instead of the getattr() method if the
- * file information is available.
- *
- * Currently this is only called after the create() method if that
- * is implemented (see above).  Later it may be called for
- * invocations of fstat() too.
- *
- * Introduced in version 2.5
- */
-int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
-{
-	int retstat = 0;
-	CHECKPERM;
-	// On FreeBSD, trying to do anything with the mountpoint ends up
-	// opening it, and then using the FD for an fgetattr.  So in the
-	// special case of a path of "/", I need to do a getattr on the
-	// underlying root directory instead of doing the fgetattr().
-	if (!strcmp(path, "/"))
-		return bb_getattr(path, statbuf);
-
-	retstat = fstat(FILE_STATE->fd, statbuf);
-	RETURN(retstat);
+	if (INODE->special) {
+		fuse_reply_err(req, mask & W_OK ? EACCES : 0);
+		return;
+	}
+	bb_procname(proc, INODE->fd);
+	REPLY_ERR(access(proc, mask));
 }
 
-struct fuse_operations bb_oper = {
+struct fuse_lowlevel_ops bb_oper = {
+	.init = bb_init,
+	.destroy = bb_destroy,
+	.lookup = bb_lookup,
+	.forget = bb_forget,
+	.forget_multi = bb_forget_multi,
 	.getattr = bb_getattr,
+	.setattr = bb_setattr,
 	.readlink = bb_readlink,
-	// no .getdir -- that's deprecated
-	.getdir = NULL,
 	.mknod = bb_mknod,
 	.mkdir = bb_mkdir,
 	.unlink = bb_unlink,
@@ -709,14 +1399,10 @@ struct fuse_operations bb_oper = {
 	.symlink = bb_symlink,
 	.rename = bb_rename,
 	.link = bb_link,
-	.chmod = bb_chmod,
-	.chown = bb_chown,
-	.truncate = bb_truncate,
-	.utime = bb_utime,
 	.open = bb_open,
+	.create = bb_create,
 	.read = bb_read,
-	.write = bb_write,
-	/** Just a placeholder, don't set */ // huh???
+	.write_buf = bb_write_buf,
 	.statfs = bb_statfs,
 	.flush = bb_flush,
 	.release = bb_release,
@@ -733,23 +1419,83 @@ struct fuse_operations bb_oper = {
 	.readdir = bb_readdir,
 	.releasedir = bb_releasedir,
 	.fsyncdir = bb_fsyncdir,
-	.init = bb_init,
-	.destroy = bb_destroy,
 	.access = bb_access,
-	.ftruncate = bb_ftruncate,
-	.fgetattr = bb_fgetattr
 };
 
 void bb_usage()
 {
 	fprintf(stderr, "usage:  bbfs [FUSE and mount options] rootDir mountPoint loghost\n");
+	fprintf(stderr, "sudologfs options:\n"
+			"    -o senders=N           number of sender threads (1)\n"
+			"    -o queue_len=N         records queued per sender (%d)\n"
+			"    -o backpressure=block  wait for the sender if the queue is full (default)\n"
+			"    -o backpressure=fail   fail the write with ENOBUFS instead\n"
+			"    -o mem_limit=MiB       data queued or being shipped, then backpressure (%d)\n"
+			"    -o coalesce_delay=MS   merge small appends for up to MS milliseconds (%d, 0: off)\n"
+			"    -o compress=METHOD     compress shipped data: none (default), zlib, zstd\n"
+			"    -o tcp_cork            batch TCP messages into full segments while busy\n"
+			"    -o io_uring            send to all UDP log hosts with one io_uring_enter()\n"
+			"    -o msgsize=N           maximum syslog message size (udp: %d, tcp: %d)\n"
+			"    -o msgsize=auto        udp: largest message that is not fragmented\n"
+			"    -o spool_dir=DIR       keep messages here while the log host is unreachable\n"
+			"    -o spool_size=MiB      maximum size of the spool (%d)\n"
+			"    -o shard               send each session to one of the log hosts only\n"
+			"    -o noship=PATTERN[:..] do not ship writes to files matching these patterns\n"
+			"FUSE options:\n"
+			"    -f                     stay in the foreground\n"
+			"    -s                     single threaded\n"
+			"    -o max_idle_threads=N  FUSE threads kept around while idle (10)\n"
+			"loghost is [udp://|tcp://]host[:port], the default is udp and port 514.\n"
+			"Several log hosts can be given separated by commas, all get every message\n"
+			"unless -o shard is given\n",
+			SENDER_QUEUE_LEN, POOL_BUDGET, SENDER_COALESCE_DELAY, LOG_UDP_LENGTH, LOG_TCP_LENGTH, SPOOL_SIZE);
 	abort();
 }
 
+#define BB_OPT(t, p, v) { t, offsetof(struct bb_state, p), v }
+static struct fuse_opt bb_opts[] = {
+	BB_OPT("senders=%u", senders, 0),
+	BB_OPT("queue_len=%u", queue_len, 0),
+	BB_OPT("backpressure=block", backpressure, BP_BLOCK),
+	BB_OPT("backpressure=fail", backpressure, BP_FAIL),
+	BB_OPT("mem_limit=%u", mem_limit, 0),
+	BB_OPT("coalesce_delay=%d", coalesce_delay, 0),
+	BB_OPT("compress=none", compress, COMPRESS_NONE),
+	BB_OPT("compress=zlib", compress, COMPRESS_ZLIB),
+	BB_OPT("compress=zstd", compress, COMPRESS_ZSTD),
+	BB_OPT("tcp_cork", tcp_cork, 1),
+	BB_OPT("io_uring", uring, 1),
+	/* "auto" has to come first, "%d" would match it as well */
+	BB_OPT("msgsize=auto", msgsize, LOG_SIZE_AUTO),
+	BB_OPT("msgsize=%d", msgsize, 0),
+	BB_OPT("spool_dir=%s", spool_dir, 0),
+	BB_OPT("spool_size=%u", spool_size, 0),
+	BB_OPT("shard", shard, 1),
+	BB_OPT("noship=%s", noship, 0),
+	FUSE_OPT_END
+};
+
+/* the spool is written by the daemon itself, going through the
+ * mount for that would deadlock */
+static int spool_inside(const char *spool, const char *mnt)
+{
+	char *s = realpath(spool, NULL), *m = realpath(mnt, NULL);
+	size_t n = m ? strlen(m) : 0;
+	int ret = s && m && !strncmp(s, m, n) && (s[n] == '/' || !s[n] || n == 1);
+	free(s);
+	free(m);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int fuse_stat;
 	struct bb_state *bb_data;
+	struct fuse_args args;
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	char *loghost;
 
 	// See which version of fuse we're running
 	fprintf(stderr, "Fuse library version %d.%d\n", FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
@@ -762,31 +1508,85 @@ int main(int argc, char *argv[])
 	if ((argc < 4) || (argv[argc-3][0] == '-') || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
 		bb_usage();
 
-	bb_data = malloc(sizeof(struct bb_state));
+	bb_data = calloc(sizeof(struct bb_state), 1);
 	if (bb_data == NULL) {
 		perror("main calloc");
 		abort();
 	}
+	bb_data->coalesce_delay = -1;	/* default, unless given as option */
+	bb_data->spool_size = SPOOL_SIZE;
+	bb_data->mem_limit = POOL_BUDGET;
 
 	// Pull the rootdir out of the argument list and save it in my
 	// internal data
 	/* realpath malloc()'s the space, so free it in destroy() */
 	bb_data->rootdir = realpath(argv[argc-3], NULL);
-	bb_data->log_fd = log_open(argv[argc-1], &bb_data->log_addr);
-	if (bb_data->log_fd < 0) {
-		fprintf(stderr, "Resolving '%s' failed, this is a fatal error.\n", argv[argc-1]);
-		free(bb_data->rootdir);
-		free(bb_data);
-		return 1;
-	}
+	loghost = argv[argc-1];
 	/* ugly hack :-) */
 	argv[argc-3] = "-oallow_other";
-	syslog(LOG_NOTICE, "mounting %s to %s, logging to %s", bb_data->rootdir, argv[argc-2], argv[argc-1]);
 	/* remove loghost parameter */
 	argv[argc-1] = NULL;
 	argc--;
-	// turn over control to fuse
-	fuse_stat = fuse_main(argc, argv, &bb_oper, bb_data);
+	args = (struct fuse_args)FUSE_ARGS_INIT(argc, argv);
+	// pick our own options out of the argument list, then the ones of
+	// libfuse's command line, the mount options are left
+	if (fuse_opt_parse(&args, bb_data, bb_opts, NULL) < 0 ||
+	    fuse_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint)
+		bb_usage();
+	if (compress_supported(bb_data->compress) < 0) {
+		fprintf(stderr, "the requested compression method was not compiled in.\n");
+		return 1;
+	}
+	if (bb_data->uring && uring_supported() < 0) {
+		fprintf(stderr, "io_uring support (liburing) was not compiled in.\n");
+		return 1;
+	}
+	if (!bb_data->rootdir || !(bb_data->inodes = inode_table_new(bb_data->rootdir))) {
+		fprintf(stderr, "Cannot open the backing directory %s.\n", argv[argc-3]);
+		return 1;
+	}
+	if (log_open(bb_data, loghost) < 0) {
+		fprintf(stderr, "Resolving '%s' failed, this is a fatal error.\n", loghost);
+		inode_table_free(bb_data->inodes);
+		free(bb_data->rootdir);
+		free(bb_data);
+		return 1;
+	}
+	if (bb_data->spool_dir && spool_inside(bb_data->spool_dir, opts.mountpoint)) {
+		fprintf(stderr, "The spool directory must not be inside the mount point.\n");
+		return 1;
+	}
+	syslog(LOG_NOTICE, "mounting %s to %s, logging to %s", bb_data->rootdir, opts.mountpoint, loghost);
+
+	// turn over control to fuse: what fuse_main() of the high-level
+	// API does, but with a /dev/fuse fd per thread
+	fuse_stat = 1;
+	se = fuse_session_new(&args, &bb_oper, sizeof(bb_oper), bb_data);
+	if (!se)
+		goto out;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_destroy;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signal;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		fuse_stat = fuse_session_loop(se);
+	} else {
+		// every thread reads its own clone of the /dev/fuse fd, so
+		// they do not all wake up on every request
+		config.clone_fd = 1;
+		config.max_idle_threads = opts.max_idle_threads;
+		fuse_stat = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+out_signal:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	// calls bb_destroy(), if bb_init() was called
+	fuse_session_destroy(se);
+out:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
 	syslog(LOG_NOTICE, "exiting with %d", fuse_stat);
 	closelog();
 
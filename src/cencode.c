@@ -5,6 +5,9 @@ This is part of the libb64 project, and has been placed in the public domain.
 For details, see http://sourceforge.net/projects/libb64
 */
 
+#include "config.h"
+
+#include <string.h>
 #include "cencode.h"
 
 #if 0
@@ -25,7 +28,7 @@ char base64_encode_value(char value_in)
 	return encoding[(int)value_in];
 }
 
-int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+static int base64_encode_block_scalar(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
 {
 	const char* plainchar = plaintext_in;
 	const char* const plaintextend = plaintext_in + length_in;
@@ -88,6 +91,214 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 	return codechar - code_out;
 }
 
+/*
+ * vectorized encoders, after Wojciech Muła's and Daniel Lemire's work:
+ * http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+ * They only handle whole 3 byte groups at state step_A and return the
+ * number of input bytes consumed, the scalar code above does the rest.
+ * Every loop reads a few bytes beyond the groups it encodes, so it
+ * stops early enough not to read beyond the end of the input.
+ */
+#ifdef HAVE_BASE64_SIMD
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_reshuffle_ssse3(__m128i in)
+{
+	/* 12 input bytes -> 16 sextets, each one in the low bits of a byte */
+	__m128i t0, t1, t2, t3;
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in)
+{
+	/* map 0..63 to the alphabet by adding a per-range offset */
+	const __m128i lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					  '/' - 63, 'A', 0, 0);
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+	idx = _mm_or_si128(idx, _mm_and_si128(less, _mm_set1_epi8(13)));
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(const char* in, int len, char* out)
+{
+	int done = 0;
+	while (len - done >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + done));
+		v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+		_mm_storeu_si128((__m128i*)out, v);
+		out += 16;
+		done += 12;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static int base64_encode_avx2(const char* in, int len, char* out)
+{
+	const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+					     10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					     '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					     '/' - 63, 'A', 0, 0,
+					     'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					     '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					     '/' - 63, 'A', 0, 0);
+	int done = 0;
+	while (len - done >= 28)
+	{
+		/* 12 bytes into each 128 bit lane */
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + done))),
+			_mm_loadu_si128((const __m128i*)(in + done + 12)), 1);
+		__m256i t0, t1, t2, t3, idx, less;
+		v = _mm256_shuffle_epi8(v, shuf);
+		t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		v = _mm256_or_si256(t1, t3);
+		idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+		less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), v);
+		idx = _mm256_or_si256(idx, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, idx));
+		_mm256_storeu_si256((__m256i*)out, v);
+		out += 32;
+		done += 24;
+	}
+	return done;
+}
+
+#ifdef HAVE_BASE64_AVX512
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static int base64_encode_avx512vbmi(const char* in, int len, char* out)
+{
+	/* gather the 3 byte groups into 32 bit words (bytes 1,0,2,1)... */
+	const __m512i shuf = _mm512_setr_epi32(
+		0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+		0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+		0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+		0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+	/* ...pick the 4 sextets of each word at these bit offsets... */
+	const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aULL);
+	/* ...and look them up in the alphabet, only the low 6 bits count */
+	const __m512i lut = _mm512_loadu_si512((const void*)
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/");
+	int done = 0;
+	while (len - done >= 64)
+	{
+		__m512i v = _mm512_loadu_si512((const void*)(in + done));
+		v = _mm512_permutexvar_epi8(shuf, v);
+		v = _mm512_multishift_epi64_epi8(shifts, v);
+		v = _mm512_permutexvar_epi8(v, lut);
+		_mm512_storeu_si512((void*)out, v);
+		out += 64;
+		done += 48;
+	}
+	return done;
+}
+#endif
+
+static int base64_encode_none(const char* in, int len, char* out)
+{
+	(void)in; (void)len; (void)out;
+	return 0;
+}
+
+static int base64_encode_resolve(const char* in, int len, char* out);
+static int (*base64_encode_bulk)(const char* in, int len, char* out) = base64_encode_resolve;
+static const char* base64_impl = "scalar";
+
+int base64_encode_select(const char* name)
+{
+	__builtin_cpu_init();
+#ifdef HAVE_BASE64_AVX512
+	if ((!name || !strcmp(name, "avx512vbmi")) && __builtin_cpu_supports("avx512vbmi")
+		&& __builtin_cpu_supports("avx512bw"))
+	{
+		base64_encode_bulk = base64_encode_avx512vbmi;
+		base64_impl = "avx512vbmi";
+		return 0;
+	}
+#endif
+	if ((!name || !strcmp(name, "avx2")) && __builtin_cpu_supports("avx2"))
+	{
+		base64_encode_bulk = base64_encode_avx2;
+		base64_impl = "avx2";
+		return 0;
+	}
+	if ((!name || !strcmp(name, "ssse3")) && __builtin_cpu_supports("ssse3"))
+	{
+		base64_encode_bulk = base64_encode_ssse3;
+		base64_impl = "ssse3";
+		return 0;
+	}
+	if (!name || !strcmp(name, "scalar"))
+	{
+		base64_encode_bulk = base64_encode_none;
+		base64_impl = "scalar";
+		return 0;
+	}
+	return -1;
+}
+
+/* picks the best encoder on the first call */
+static int base64_encode_resolve(const char* in, int len, char* out)
+{
+	base64_encode_select(NULL);
+	return base64_encode_bulk(in, len, out);
+}
+#else
+int base64_encode_select(const char* name)
+{
+	return (!name || !strcmp(name, "scalar")) ? 0 : -1;
+}
+
+static const char* base64_impl = "scalar";
+#endif
+
+const char* base64_encode_impl(void)
+{
+	return base64_impl;
+}
+
+int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+{
+	int out = 0;
+#ifdef HAVE_BASE64_SIMD
+	int done;
+	/* finish a 3 byte group that was started by the previous call */
+	if (state_in->step != step_A)
+	{
+		int head = (state_in->step == step_B) ? 2 : 1;
+		if (head > length_in)
+			head = length_in;
+		out = base64_encode_block_scalar(plaintext_in, head, code_out, state_in);
+		plaintext_in += head;
+		length_in -= head;
+	}
+	if (state_in->step == step_A)
+	{
+		done = base64_encode_bulk(plaintext_in, length_in, code_out + out);
+		plaintext_in += done;
+		length_in -= done;
+		out += done / 3 * 4;
+		state_in->stepcount += done / 3;
+	}
+#endif
+	return out + base64_encode_block_scalar(plaintext_in, length_in, code_out + out, state_in);
+}
+
 int base64_encode_blockend(char* code_out, base64_encodestate* state_in)
 {
 	char* codechar = code_out;
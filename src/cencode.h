@@ -28,5 +28,11 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 
 int base64_encode_blockend(char* code_out, base64_encodestate* state_in);
 
+/* select the encoder ("avx512vbmi", "avx2", "ssse3", "scalar"), NULL picks
+ * the best one the CPU supports, which is also done on first use */
+int base64_encode_select(const char* name);
+
+const char* base64_encode_impl(void);
+
 #endif /* BASE64_CENCODE_H */
 
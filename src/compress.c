@@ -0,0 +1,332 @@
+/*
+   sudolog File System - compression of shipped data
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Each open file gets its own compression stream, so that the many
+   small writes of a terminal session still benefit from what was
+   written before. Every record is flushed to a byte boundary, so the
+   receiver can decompress it as soon as all its packets arrived, but it
+   needs the previous records of the stream to do so. The first record
+   of a stream is marked with an upper case flag ("+Z" for zlib, "+S" for
+   zstd), all later ones with the lower case one, so that the receiver
+   knows when to start a new decompressor.
+
+   Over UDP, a lost packet makes the rest of its stream useless. So the
+   stream is started over every COMPRESS_RESTART_RECORDS records or
+   COMPRESS_RESTART_BYTES bytes, which keeps the context (and its
+   memory) but not the history.
+
+   The decompress_*() functions are the other end of that, used by the
+   receiver and the extractor.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <syslog.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+
+/* the compressed data of a record, reused by all records of a thread */
+static __thread char *cbuf;
+static __thread size_t cbuf_size;
+
+static int cbuf_grow(size_t size)
+{
+	char *tmp;
+	if (size <= cbuf_size)
+		return 0;
+	tmp = realloc(cbuf, size);
+	if (!tmp) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return -1;
+	}
+	cbuf = tmp;
+	cbuf_size = size;
+	return 0;
+}
+
+int compress_supported(int method)
+{
+	switch (method) {
+	case COMPRESS_NONE:
+		return 0;
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		return 0;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 0;
+#endif
+	}
+	return -1;
+}
+
+#ifdef HAVE_ZLIB
+static int compress_zlib(struct file_state *file_state, const char *msg, int len)
+{
+	z_stream *z = file_state->zctx;
+	size_t done = 0;
+	int ret;
+	if (!z) {
+		z = calloc(1, sizeof(z_stream));
+		if (!z)
+			return -1;
+		/* 8k window and memLevel 6 keep a stream at ~64k of memory,
+		 * which matters with a few thousand open files */
+		if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 13, 6, Z_DEFAULT_STRATEGY) != Z_OK) {
+			syslog(LOG_ERR, "deflateInit2: %s", z->msg ? z->msg : "failed");
+			free(z);
+			return -1;
+		}
+		file_state->zctx = z;
+	}
+	/* stored blocks plus the sync marker, usually enough in one go */
+	if (cbuf_grow(deflateBound(z, len) + 16) < 0)
+		return -1;
+	z->next_in = (Bytef *)msg;
+	z->avail_in = len;
+	while (1) {
+		z->next_out = (Bytef *)cbuf + done;
+		z->avail_out = cbuf_size - done;
+		ret = deflate(z, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			syslog(LOG_ERR, "deflate: %d", ret);
+			return -1;
+		}
+		done = cbuf_size - z->avail_out;
+		/* all flushed if there was space left over */
+		if (z->avail_out)
+			break;
+		if (cbuf_grow(cbuf_size * 2) < 0)
+			return -1;
+	}
+	return done;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int compress_zstd(struct file_state *file_state, const char *msg, int len)
+{
+	ZSTD_CCtx *z = file_state->zctx;
+	ZSTD_inBuffer in = { msg, len, 0 };
+	ZSTD_outBuffer out;
+	size_t ret;
+	if (!z) {
+		z = ZSTD_createCCtx();
+		if (!z)
+			return -1;
+		/* same reasoning as for zlib: keep the per-file memory small */
+		ZSTD_CCtx_setParameter(z, ZSTD_c_windowLog, 17);
+		file_state->zctx = z;
+	}
+	if (cbuf_grow(ZSTD_compressBound(len) + 32) < 0)
+		return -1;
+	out.dst = cbuf;
+	out.size = cbuf_size;
+	out.pos = 0;
+	do {
+		ret = ZSTD_compressStream2(z, &out, &in, ZSTD_e_flush);
+		if (ZSTD_isError(ret)) {
+			syslog(LOG_ERR, "ZSTD_compressStream2: %s", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		if (ret && cbuf_grow(cbuf_size * 2) < 0)
+			return -1;
+		out.dst = cbuf;
+		out.size = cbuf_size;
+	} while (ret);
+	return out.pos;
+}
+#endif
+
+/* the next record starts a new stream in the same context, -1 if the
+ * context cannot be reused */
+static int compress_reset(struct file_state *file_state)
+{
+	switch (file_state->zmethod) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		return deflateReset(file_state->zctx) == Z_OK ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_isError(ZSTD_CCtx_reset(file_state->zctx, ZSTD_reset_session_only)) ? -1 : 0;
+#endif
+	}
+	return -1;
+}
+
+int compress_record(int method, struct file_state *file_state, const char *msg, int len,
+		    char **out, const char **flag)
+{
+	int first = !file_state->zctx;
+	int ret = -1;
+	if (!first && (file_state->zrecords >= COMPRESS_RESTART_RECORDS ||
+		       file_state->zbytes >= COMPRESS_RESTART_BYTES)) {
+		if (compress_reset(file_state) < 0)
+			compress_free(file_state);
+		first = 1;
+	}
+	if (first) {
+		file_state->zmethod = method;
+		file_state->zrecords = 0;
+		file_state->zbytes = 0;
+	}
+	file_state->zrecords++;
+	file_state->zbytes += len;
+	switch (method) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		ret = compress_zlib(file_state, msg, len);
+		*flag = first ? "+Z" : "+z";
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		ret = compress_zstd(file_state, msg, len);
+		*flag = first ? "+S" : "+s";
+		break;
+#endif
+	default:
+		break;
+	}
+	/* the record is not sent, but part of it may be in the stream
+	 * already: the next one has to start a new stream */
+	if (ret < 0)
+		compress_free(file_state);
+	*out = cbuf;
+	return ret;
+}
+
+void compress_free(struct file_state *file_state)
+{
+	if (!file_state->zctx)
+		return;
+	switch (file_state->zmethod) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		deflateEnd(file_state->zctx);
+		free(file_state->zctx);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		ZSTD_freeCCtx(file_state->zctx);
+		break;
+#endif
+	}
+	file_state->zctx = NULL;
+}
+
+int compress_flag_method(char flag)
+{
+	switch (flag) {
+	case 'Z':
+	case 'z':
+		return COMPRESS_ZLIB;
+	case 'S':
+	case 's':
+		return COMPRESS_ZSTD;
+	}
+	return -1;
+}
+
+void *decompress_start(int method)
+{
+	switch (method) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB: {
+		z_stream *z = calloc(1, sizeof(z_stream));
+		/* 15 also takes the smaller window the sender uses */
+		if (z && inflateInit2(z, 15) != Z_OK) {
+			free(z);
+			z = NULL;
+		}
+		return z;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_createDCtx();
+#endif
+	}
+	return NULL;
+}
+
+int decompress_chunk(int method, void *ctx, const char *in, size_t len,
+		     void (*out)(void *arg, const char *buf, size_t len), void *arg)
+{
+	if (cbuf_grow(65536) < 0)
+		return -1;
+	switch (method) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB: {
+		z_stream *z = ctx;
+		int ret;
+		z->next_in = (Bytef *)in;
+		z->avail_in = len;
+		do {
+			z->next_out = (Bytef *)cbuf;
+			z->avail_out = cbuf_size;
+			ret = inflate(z, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return -1;
+			if (cbuf_size - z->avail_out)
+				out(arg, cbuf, cbuf_size - z->avail_out);
+			/* no progress possible: all input used up */
+			if (ret == Z_BUF_ERROR)
+				break;
+		} while (z->avail_in || !z->avail_out);
+		return 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD: {
+		ZSTD_inBuffer zin = { in, len, 0 };
+		ZSTD_outBuffer zout;
+		size_t ret;
+		do {
+			zout.dst = cbuf;
+			zout.size = cbuf_size;
+			zout.pos = 0;
+			ret = ZSTD_decompressStream(ctx, &zout, &zin);
+			if (ZSTD_isError(ret))
+				return -1;
+			if (zout.pos)
+				out(arg, cbuf, zout.pos);
+		} while (zin.pos < zin.size || zout.pos == zout.size);
+		return 0;
+	}
+#endif
+	}
+	return -1;
+}
+
+void decompress_end(int method, void *ctx)
+{
+	if (!ctx)
+		return;
+	switch (method) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		inflateEnd(ctx);
+		free(ctx);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		ZSTD_freeDCtx(ctx);
+		break;
+#endif
+	}
+}
@@ -0,0 +1,42 @@
+/*
+   sudolog File System - compression of shipped data
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "params.h"
+
+#define COMPRESS_NONE 0
+#define COMPRESS_ZLIB 1
+#define COMPRESS_ZSTD 2
+
+/* a new stream is started after that many records, or that many bytes
+ * before compression, whatever comes first. It bounds what a lost
+ * packet takes down with it */
+#define COMPRESS_RESTART_RECORDS 256
+#define COMPRESS_RESTART_BYTES (256 << 10)
+
+/* 0 if the method was compiled in */
+int compress_supported(int method);
+/* compress one record, *out points to a per-thread buffer afterwards.
+ * Returns the compressed length, or -1 on error. *flag is set to the
+ * marker for the "size@offset" prefix */
+int compress_record(int method, struct file_state *file_state, const char *msg, int len,
+		    char **out, const char **flag);
+void compress_free(struct file_state *file_state);
+
+/* the receiving side: COMPRESS_* for a "+Z" style flag, -1 if unknown */
+int compress_flag_method(char flag);
+void *decompress_start(int method);
+/* feed the next piece of a stream, out() gets the decompressed data.
+ * Returns 0, or -1 if the stream is broken */
+int decompress_chunk(int method, void *ctx, const char *in, size_t len,
+		     void (*out)(void *arg, const char *buf, size_t len), void *arg);
+void decompress_end(int method, void *ctx);
+
+#endif
@@ -0,0 +1,514 @@
+/*
+   sudolog File System - extractor
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   sudologfs-extract rebuilds the shipped files from syslog files, e.g.
+   the ones rsyslog writes with the configuration from the README, as
+   DIR/HOST/FILENAME.
+
+   The input files are mmap'd and cut into pieces at line boundaries,
+   which threads scan in parallel: every line that is a sudologfs message
+   (and passes the host and path filters) is added to the packet list of
+   its file, nothing is decoded yet. Then the files are distributed over
+   the threads. Each sorts the packets of a file by sequence number and
+   applies them like sudologfs-recv does, records outside of the time
+   range are skipped.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logparse.h"
+#include "rebuild.h"
+
+/* the input is scanned in pieces of at least that size */
+#define EXTRACT_CHUNK (4 << 20)
+#define EXTRACT_HASH 4096
+/* sequence numbers that go back by more than that start a new run, even
+ * if the first packet of the run was lost */
+#define EXTRACT_REORDER 256
+#define EXTRACT_MAX_HOSTS 64
+
+struct input {
+	const char *name;
+	char *map;
+	size_t size;
+	time_t mtime;
+};
+
+struct chunk {
+	unsigned int input;
+	size_t start, end;
+};
+
+struct pkt {
+	const char *line;
+	uint32_t len : 31;
+	uint32_t first : 1;
+	uint32_t seq;
+	uint64_t pos;		/* input << 40 | offset: the order they were logged in */
+	time_t ts;
+};
+
+/* a shipped file, with all its packets */
+struct xfile {
+	struct xfile *next;
+	uint64_t hash;
+	struct log_msg m;	/* the first packet, for the names */
+	struct pkt *pkts;
+	size_t npkts, size;
+};
+
+struct table {
+	struct xfile *files[EXTRACT_HASH];
+	size_t nfiles;
+};
+
+struct scanner {
+	pthread_t thread;
+	struct table table;
+	unsigned long lines, ignored, files, records, gaps, lost, dups, skipped, shortrec;
+	int failed;
+};
+
+static const char *outdir;
+static struct input *inputs;
+static struct chunk *chunks;
+static unsigned int nchunks, next_chunk;
+static struct xfile **work;
+static size_t nwork, next_work;
+static const char *hosts[EXTRACT_MAX_HOSTS];
+static int nhosts;
+static const char *prefix;
+static size_t prefixlen;
+static time_t tstart, tend;
+static int timefilter;
+
+static int want(const struct log_msg *m)
+{
+	int i;
+	if (prefix && ((size_t)m->filelen < prefixlen || memcmp(m->file, prefix, prefixlen)))
+		return 0;
+	if (!nhosts)
+		return 1;
+	for (i = 0; i < nhosts; i++)
+		if ((size_t)m->hostlen == strlen(hosts[i]) && !memcmp(m->host, hosts[i], m->hostlen))
+			return 1;
+	return 0;
+}
+
+static struct xfile *xfile_get(struct table *t, const struct log_msg *m, uint64_t hash)
+{
+	struct xfile **b = &t->files[(hash >> 32) % EXTRACT_HASH];
+	struct xfile *x;
+	for (x = *b; x; x = x->next)
+		if (x->hash == hash && x->m.hostlen == m->hostlen && x->m.filelen == m->filelen &&
+		    !memcmp(x->m.host, m->host, m->hostlen) && !memcmp(x->m.file, m->file, m->filelen))
+			return x;
+	x = calloc(1, sizeof(struct xfile));
+	if (!x)
+		return NULL;
+	x->hash = hash;
+	x->m = *m;
+	x->next = *b;
+	*b = x;
+	t->nfiles++;
+	return x;
+}
+
+static int xfile_add(struct xfile *x, const struct pkt *p, size_t n)
+{
+	struct pkt *tmp;
+	size_t size = x->size;
+	while (x->npkts + n > size)
+		size = size ? size * 2 : 256;
+	if (size != x->size) {
+		tmp = realloc(x->pkts, size * sizeof(struct pkt));
+		if (!tmp)
+			return -1;
+		x->pkts = tmp;
+		x->size = size;
+	}
+	memcpy(x->pkts + x->npkts, p, n * sizeof(struct pkt));
+	x->npkts += n;
+	return 0;
+}
+
+static void scan_chunk(struct scanner *s, const struct chunk *c)
+{
+	const struct input *in = &inputs[c->input];
+	const char *p = in->map + c->start, *end = in->map + c->end, *q;
+	struct log_clock clock;
+	struct log_msg m;
+	struct xfile *x;
+	struct pkt pkt;
+
+	log_clock_init(&clock, in->mtime);
+	for (; p < end && !s->failed; p = q + 1) {
+		q = memchr(p, '\n', end - p);
+		if (!q)
+			q = end;
+		s->lines++;
+		if (log_parse(p, q - p, &m) < 0) {
+			s->ignored++;
+			continue;
+		}
+		if (!want(&m))
+			continue;
+		pkt.line = p;
+		pkt.len = q - p;
+		pkt.first = m.first;
+		pkt.seq = m.seq;
+		pkt.pos = (uint64_t)c->input << 40 | (p - in->map);
+		pkt.ts = timefilter ? log_time(&clock, &m) : 0;
+		x = xfile_get(&s->table, &m, log_hash(&m));
+		if (!x || xfile_add(x, &pkt, 1) < 0) {
+			syslog(LOG_ERR, "out of memory");
+			s->failed = 1;
+		}
+	}
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scanner *s = arg;
+	unsigned int i;
+	while ((i = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < nchunks)
+		scan_chunk(s, &chunks[i]);
+	return NULL;
+}
+
+static int by_pos(const void *a, const void *b)
+{
+	const struct pkt *x = a, *y = b;
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static int by_seq(const void *a, const void *b)
+{
+	const struct pkt *x = a, *y = b;
+	if (x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return by_pos(a, b);
+}
+
+static int in_range(time_t ts)
+{
+	return ts == -1 || (ts >= tstart && ts <= tend);
+}
+
+static void extract_file(struct scanner *s, struct xfile *x, struct rbuf *buf)
+{
+	struct rfile f;
+	struct log_msg m;
+	size_t i, run;
+	uint32_t maxseq = 0;
+
+	if (timefilter) {
+		for (i = 0; i < x->npkts; i++)
+			if (in_range(x->pkts[i].ts))
+				break;
+		if (i == x->npkts)
+			return;
+	}
+	if (rfile_init(&f, outdir, &x->m) < 0) {
+		s->failed = 1;
+		return;
+	}
+	s->files++;
+	/* sudologfs starts over with sequence number 1 whenever the file is
+	 * opened again, so cut the packets into runs in the order they were
+	 * logged, and sort each run by sequence number */
+	qsort(x->pkts, x->npkts, sizeof(struct pkt), by_pos);
+	for (run = 0, i = 0; i <= x->npkts; i++) {
+		if (i < x->npkts && i > run &&
+		    !(x->pkts[i].first && x->pkts[i].seq == 1) &&
+		    x->pkts[i].seq + EXTRACT_REORDER > maxseq) {
+			if (x->pkts[i].seq > maxseq)
+				maxseq = x->pkts[i].seq;
+			continue;
+		}
+		if (i > run) {
+			qsort(x->pkts + run, i - run, sizeof(struct pkt), by_seq);
+			if (run)
+				rfile_restart(&f);
+			for (; run < i; run++) {
+				log_parse(x->pkts[run].line, x->pkts[run].len, &m);
+				if (m.first && timefilter)
+					f.discard = !in_range(x->pkts[run].ts);
+				rfile_packet(&f, &m, buf);
+			}
+		}
+		if (i < x->npkts)
+			maxseq = x->pkts[i].seq;
+	}
+	rfile_report(&f);
+	s->records += f.records;
+	s->gaps += f.gaps;
+	s->lost += f.lost;
+	s->dups += f.dups;
+	s->skipped += f.skipped;
+	s->shortrec += f.shortrec;
+	rfile_free(&f);
+}
+
+static void *extract_thread(void *arg)
+{
+	struct scanner *s = arg;
+	struct rbuf buf = { NULL, 0 };
+	size_t i;
+	while ((i = __atomic_fetch_add(&next_work, 1, __ATOMIC_RELAXED)) < nwork)
+		extract_file(s, work[i], &buf);
+	free(buf.data);
+	return NULL;
+}
+
+/* the largest files first, so that the threads finish at the same time */
+static int by_size(const void *a, const void *b)
+{
+	const struct xfile *x = *(struct xfile * const *)a, *y = *(struct xfile * const *)b;
+	return x->npkts > y->npkts ? -1 : x->npkts < y->npkts;
+}
+
+/* collect the files the scanners found into the first table */
+static int merge(struct scanner *s, unsigned int n)
+{
+	struct xfile *x, *y, *next;
+	unsigned int i, j;
+	for (i = 1; i < n; i++)
+		for (j = 0; j < EXTRACT_HASH; j++)
+			for (x = s[i].table.files[j]; x; x = next) {
+				next = x->next;
+				y = xfile_get(&s[0].table, &x->m, x->hash);
+				if (!y || xfile_add(y, x->pkts, x->npkts) < 0)
+					return -1;
+				free(x->pkts);
+				free(x);
+			}
+	work = malloc(s[0].table.nfiles * sizeof(struct xfile *));
+	if (!work)
+		return -1;
+	for (j = 0; j < EXTRACT_HASH; j++)
+		for (x = s[0].table.files[j]; x; x = x->next)
+			work[nwork++] = x;
+	qsort(work, nwork, sizeof(struct xfile *), by_size);
+	return 0;
+}
+
+static int open_input(struct input *in, const char *name)
+{
+	struct stat st;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	in->name = name;
+	in->size = st.st_size;
+	in->mtime = st.st_mtime;
+	in->map = NULL;
+	if (in->size) {
+		in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in->map == MAP_FAILED) {
+			perror(name);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/* cut the inputs into pieces of about size bytes that end with a newline */
+static int make_chunks(unsigned int ninputs, size_t size)
+{
+	unsigned int i, n = 0;
+	size_t pos, end, max = 0;
+	const char *nl;
+	for (i = 0; i < ninputs; i++)
+		max += inputs[i].size / size + 1;
+	chunks = malloc(max * sizeof(struct chunk));
+	if (!chunks)
+		return -1;
+	for (i = 0; i < ninputs; i++)
+		for (pos = 0; pos < inputs[i].size; pos = end) {
+			end = pos + size;
+			if (end >= inputs[i].size)
+				end = inputs[i].size;
+			else {
+				nl = memchr(inputs[i].map + end, '\n', inputs[i].size - end);
+				end = nl ? (size_t)(nl - inputs[i].map) + 1 : inputs[i].size;
+			}
+			chunks[n].input = i;
+			chunks[n].start = pos;
+			chunks[n].end = end;
+			n++;
+		}
+	nchunks = n;
+	return 0;
+}
+
+/* "YYYY-MM-DD[ HH:MM[:SS]]" in local time, or "@SECONDS" */
+static int parse_time(const char *s, time_t *t)
+{
+	static const char *formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+		"%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+	};
+	struct tm tm;
+	const char *end;
+	char *e;
+	int i;
+	if (*s == '@') {
+		*t = strtol(s + 1, &e, 10);
+		return *e || e == s + 1 ? -1 : 0;
+	}
+	for (i = 0; formats[i]; i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(s, formats[i], &tm);
+		if (end && !*end) {
+			tm.tm_isdst = -1;
+			*t = mktime(&tm);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: sudologfs-extract [-j THREADS] [-H HOST]... [-p PREFIX] "
+			"[-s TIME] [-e TIME] DIR LOGFILE...\n"
+			"    -j  number of threads (default: one per CPU)\n"
+			"    -H  only the files of this host (can be given more than once)\n"
+			"    -p  only the files whose name starts with PREFIX\n"
+			"    -s  only the records logged at or after TIME\n"
+			"    -e  only the records logged at or before TIME\n"
+			"TIME is \"YYYY-MM-DD[ HH:MM[:SS]]\" (local time) or \"@SECONDS\".\n"
+			"The files are rebuilt as DIR/HOST/FILENAME, the log files have to be\n"
+			"given in the order they were written, i.e. the oldest one first.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct scanner *s;
+	struct scanner total;
+	unsigned int i, nthreads, ninputs;
+	size_t size = 0, chunk;
+	long ncpu;
+	int opt;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? ncpu : 1;
+	tstart = 0;
+	tend = (time_t)((~(uint64_t)0) >> 1);
+	while ((opt = getopt(argc, argv, "j:H:p:s:e:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'H':
+			if (nhosts == EXTRACT_MAX_HOSTS)
+				usage();
+			hosts[nhosts++] = optarg;
+			break;
+		case 'p':
+			prefix = optarg;
+			prefixlen = strlen(prefix);
+			break;
+		case 's':
+			if (parse_time(optarg, &tstart) < 0)
+				usage();
+			timefilter = 1;
+			break;
+		case 'e':
+			if (parse_time(optarg, &tend) < 0)
+				usage();
+			timefilter = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2 || nthreads < 1)
+		usage();
+	outdir = argv[optind++];
+	openlog(NULL, LOG_PERROR, LOG_USER);
+	if (mkdir(outdir, 0750) < 0 && errno != EEXIST) {
+		perror(outdir);
+		return 1;
+	}
+
+	ninputs = argc - optind;
+	inputs = calloc(ninputs, sizeof(struct input));
+	s = calloc(nthreads, sizeof(struct scanner));
+	if (!inputs || !s)
+		return 1;
+	for (i = 0; i < ninputs; i++) {
+		if (open_input(&inputs[i], argv[optind + i]) < 0)
+			return 1;
+		size += inputs[i].size;
+	}
+	chunk = size / (nthreads * 8);
+	if (chunk < EXTRACT_CHUNK)
+		chunk = EXTRACT_CHUNK;
+	if (make_chunks(ninputs, chunk) < 0)
+		return 1;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&s[i].thread, NULL, scan_thread, &s[i])) {
+			fprintf(stderr, "cannot start the threads\n");
+			return 1;
+		}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(s[i].thread, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (s[i].failed)
+			return 1;
+	if (merge(s, nthreads) < 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&s[i].thread, NULL, extract_thread, &s[i])) {
+			fprintf(stderr, "cannot start the threads\n");
+			return 1;
+		}
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(s[i].thread, NULL);
+		total.lines += s[i].lines;
+		total.ignored += s[i].ignored;
+		total.files += s[i].files;
+		total.records += s[i].records;
+		total.gaps += s[i].gaps;
+		total.lost += s[i].lost;
+		total.dups += s[i].dups;
+		total.skipped += s[i].skipped;
+		total.shortrec += s[i].shortrec;
+		total.failed |= s[i].failed;
+	}
+	syslog(LOG_NOTICE, "%lu lines (%lu of them not from sudologfs), %lu files, %lu records, "
+	       "%lu packets missing in %lu gaps, %lu duplicates, %lu packets not placed, "
+	       "%lu records incomplete", total.lines, total.ignored, total.files, total.records,
+	       total.lost, total.gaps, total.dups, total.skipped, total.shortrec);
+	return total.failed || total.lost || total.skipped ? 2 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+   sudolog File System - the inodes the kernel knows about
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   The kernel refers to files by the inode numbers we gave it in lookup
+   replies, and tells us with forget when it dropped them. A file that
+   is looked up again (also under another name, a hard link) has to get
+   the same inode, so they are kept in a hash table by the st_ino/st_dev
+   of the backing file.
+
+   The table is looked up on every lookup, open and release, from all
+   FUSE threads, so it is not behind one lock: the buckets are striped
+   over INODE_LOCKS mutexes. As the number of buckets is a multiple of
+   that, a hash value keeps its lock when the table grows, only growing
+   takes all of them.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "inode.h"
+
+#define INODE_BUCKETS 1024	/* initially, grows with the number of inodes */
+#define INODE_LOCKS 64		/* a power of two, at most INODE_BUCKETS */
+
+struct inode_table {
+	struct bb_inode root;	/* never in the table, never forgotten */
+	struct bb_inode **bucket;
+	size_t size;		/* power of two, changes only under all locks */
+	size_t count;		/* atomic */
+	pthread_mutex_t lock[INODE_LOCKS];
+};
+
+static uint64_t inode_hash(ino_t ino, dev_t dev)
+{
+	uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ dev;
+	return h ^ h >> 32;
+}
+
+static pthread_mutex_t *inode_stripe(struct inode_table *t, ino_t ino, dev_t dev)
+{
+	return &t->lock[inode_hash(ino, dev) & (INODE_LOCKS - 1)];
+}
+
+struct inode_table *inode_table_new(const char *rootdir)
+{
+	struct inode_table *t = calloc(1, sizeof(struct inode_table));
+	struct stat st;
+	int i;
+	if (!t)
+		return NULL;
+	t->size = INODE_BUCKETS;
+	t->bucket = calloc(t->size, sizeof(struct bb_inode *));
+	t->root.fd = open(rootdir, O_PATH);
+	if (!t->bucket || t->root.fd < 0 || fstat(t->root.fd, &st) < 0) {
+		syslog(LOG_ERR, "%s: cannot open %s: %m", __func__, rootdir);
+		if (t->root.fd >= 0)
+			close(t->root.fd);
+		free(t->bucket);
+		free(t);
+		return NULL;
+	}
+	t->root.ino = st.st_ino;
+	t->root.dev = st.st_dev;
+	for (i = 0; i < INODE_LOCKS; i++)
+		pthread_mutex_init(&t->lock[i], NULL);
+	return t;
+}
+
+void inode_table_free(struct inode_table *t)
+{
+	struct bb_inode *inode, *next;
+	size_t i;
+	for (i = 0; i < t->size; i++) {
+		for (inode = t->bucket[i]; inode; inode = next) {
+			next = inode->next;
+			close(inode->fd);
+			free(inode);
+		}
+	}
+	close(t->root.fd);
+	for (i = 0; i < INODE_LOCKS; i++)
+		pthread_mutex_destroy(&t->lock[i]);
+	free(t->bucket);
+	free(t);
+}
+
+struct bb_inode *inode_root(struct inode_table *t)
+{
+	return &t->root;
+}
+
+pthread_mutex_t *inode_lock(struct inode_table *t, struct bb_inode *inode)
+{
+	return inode_stripe(t, inode->ino, inode->dev);
+}
+
+/* takes all locks. If there is no memory, the chains just get longer */
+static void inode_grow(struct inode_table *t)
+{
+	struct bb_inode **old, *inode, *next;
+	size_t i, oldsize;
+	for (i = 0; i < INODE_LOCKS; i++)
+		pthread_mutex_lock(&t->lock[i]);
+	old = t->bucket;
+	oldsize = t->size;
+	/* another thread was faster */
+	if (__atomic_load_n(&t->count, __ATOMIC_RELAXED) <= oldsize * 2)
+		goto out;
+	t->bucket = calloc(oldsize * 2, sizeof(struct bb_inode *));
+	if (!t->bucket) {
+		t->bucket = old;
+		goto out;
+	}
+	t->size = oldsize * 2;
+	for (i = 0; i < oldsize; i++) {
+		for (inode = old[i]; inode; inode = next) {
+			size_t h = inode_hash(inode->ino, inode->dev) & (t->size - 1);
+			next = inode->next;
+			inode->next = t->bucket[h];
+			t->bucket[h] = inode;
+		}
+	}
+	free(old);
+ out:
+	for (i = INODE_LOCKS; i-- > 0; )
+		pthread_mutex_unlock(&t->lock[i]);
+}
+
+struct bb_inode *inode_lookup(struct inode_table *t, int parentfd, const char *name,
+			      struct stat *st)
+{
+	struct bb_inode *inode;
+	pthread_mutex_t *lock;
+	size_t h, size;
+	int fd, err;
+	// open it first: two lookups of the same new file may race, the
+	// loser finds the winner's inode below and closes its fd again
+	fd = openat(parentfd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+	if (fstatat(fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (st->st_ino == t->root.ino && st->st_dev == t->root.dev) {
+		close(fd);
+		return &t->root;
+	}
+	lock = inode_stripe(t, st->st_ino, st->st_dev);
+	pthread_mutex_lock(lock);
+	h = inode_hash(st->st_ino, st->st_dev) & (t->size - 1);
+	for (inode = t->bucket[h]; inode; inode = inode->next)
+		if (inode->ino == st->st_ino && inode->dev == st->st_dev)
+			break;
+	if (inode) {
+		inode->nlookup++;
+		pthread_mutex_unlock(lock);
+		close(fd);
+		return inode;
+	}
+	inode = calloc(1, sizeof(struct bb_inode));
+	if (!inode) {
+		pthread_mutex_unlock(lock);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	inode->fd = fd;
+	inode->ino = st->st_ino;
+	inode->dev = st->st_dev;
+	inode->nlookup = 1;
+	inode->next = t->bucket[h];
+	t->bucket[h] = inode;
+	size = t->size;
+	pthread_mutex_unlock(lock);
+	if (__atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED) > size * 2)
+		inode_grow(t);
+	return inode;
+}
+
+void inode_forget(struct inode_table *t, struct bb_inode *inode, uint64_t nlookup)
+{
+	pthread_mutex_t *lock;
+	struct bb_inode **p;
+	if (inode == &t->root)
+		return;
+	lock = inode_lock(t, inode);
+	pthread_mutex_lock(lock);
+	if (inode->nlookup > nlookup) {
+		inode->nlookup -= nlookup;
+		pthread_mutex_unlock(lock);
+		return;
+	}
+	for (p = &t->bucket[inode_hash(inode->ino, inode->dev) & (t->size - 1)]; *p; p = &(*p)->next) {
+		if (*p == inode) {
+			*p = inode->next;
+			__atomic_sub_fetch(&t->count, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	close(inode->fd);
+	free(inode);
+}
@@ -0,0 +1,56 @@
+/*
+   sudolog File System - the inodes the kernel knows about
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * every inode that was handed to the kernel in a lookup has an O_PATH
+ * fd into the backing directory, so that the operations on it can use
+ * the *at() syscalls instead of building a path. Its address is the
+ * FUSE inode number.
+ */
+struct bb_inode {
+	int fd;			/* O_PATH | O_NOFOLLOW, -1 for the special ones */
+	ino_t ino;		/* of the backing file, the key of the table */
+	dev_t dev;
+	int special;		/* SPECIAL_*, see bbfs.c */
+	uint64_t nlookup;	/* the kernel's references, under inode_lock() */
+	/* the shipping state shared by all opens of the file, see bbfs.c.
+	 * This and the following fields are under inode_lock() as well */
+	struct file_state *ship;
+	/* FUSE passthrough: the kernel's handle for the backing file, shared
+	 * by all opens of the inode */
+	int backing_id;
+	unsigned int backing_refs;
+	struct bb_inode *next;	/* hash chain */
+};
+
+struct inode_table;
+struct file_state;
+
+/* opens the backing directory as the root inode */
+struct inode_table *inode_table_new(const char *rootdir);
+void inode_table_free(struct inode_table *t);
+struct bb_inode *inode_root(struct inode_table *t);
+/* the lock of the table stripe of the inode, which also protects the
+ * fields of the inode that are shared between opens */
+pthread_mutex_t *inode_lock(struct inode_table *t, struct bb_inode *inode);
+/* name in the directory parentfd, with one more lookup reference. The
+ * attributes are returned in st. NULL and errno set if it does not exist */
+struct bb_inode *inode_lookup(struct inode_table *t, int parentfd, const char *name,
+			      struct stat *st);
+/* drop nlookup references, the inode is freed with the last one */
+void inode_forget(struct inode_table *t, struct bb_inode *inode, uint64_t nlookup);
+
+#endif
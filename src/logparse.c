@@ -0,0 +1,229 @@
+/*
+   sudolog File System - parser for the shipped log messages
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Used by the receiver and the extractor, both of which see a lot of
+   messages, so this avoids sscanf() and friends.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+#include "logparse.h"
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* 1 to 16 hex digits from p up to end, returns where it stopped */
+static const char *parse_hex(const char *p, const char *end, uint64_t *v)
+{
+	const char *start = p;
+	int d;
+	*v = 0;
+	while (p < end && p - start < 16 && (d = hexval(*p)) >= 0) {
+		*v = *v << 4 | d;
+		p++;
+	}
+	return p == start ? NULL : p;
+}
+
+int log_parse(const char *buf, size_t len, struct log_msg *m)
+{
+	const char *p = buf, *end = buf + len, *q, *at;
+	uint64_t v;
+
+	while (end > p && (end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	/* "<109>", only in the messages as they are sent */
+	if (p < end && *p == '<') {
+		q = memchr(p, '>', end - p < 6 ? end - p : 6);
+		if (!q)
+			return -1;
+		p = q + 1;
+	}
+	/* "%b %e %T " has a space in it, anything else is one word */
+	m->ts = p;
+	if (end - p > 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' && p[15] == ' ') {
+		m->tslen = 15;
+		p += 16;
+	} else {
+		q = memchr(p, ' ', end - p);
+		if (!q)
+			return -1;
+		m->tslen = q - p;
+		p = q + 1;
+	}
+	q = memchr(p, ' ', end - p);
+	if (!q || q == p)
+		return -1;
+	m->host = p;
+	m->hostlen = q - p;
+	p = q + 1;
+
+	/* "filename:%08x ", rsyslog may have added a space after the colon */
+	q = memchr(p, ' ', end - p);
+	if (!q)
+		return -1;
+	m->file = p;
+	if (q[-1] == ':') {
+		m->filelen = q - p - 1;
+		p = q + 1;
+		if (end - p < 9 || p[8] != ' ')
+			return -1;
+	} else {
+		if (q - p < 10 || q[-9] != ':')
+			return -1;
+		m->filelen = q - p - 9;
+		p = q - 8;
+	}
+	if (m->filelen <= 0 || parse_hex(p, p + 8, &v) != p + 8)
+		return -1;
+	m->seq = v;
+	p += 9;
+
+	/* "size@offset " or "size@offset+Z ", base64 has neither '@' nor ' ' */
+	m->first = 0;
+	m->flag = 0;
+	q = memchr(p, ' ', end - p);
+	if (q) {
+		at = parse_hex(p, q, &v);
+		if (!at || *at != '@')
+			return -1;
+		m->size = v;
+		at = parse_hex(at + 1, q, &m->offset);
+		if (!at)
+			return -1;
+		if (at + 2 == q && at[0] == '+')
+			m->flag = at[1];
+		else if (at != q)
+			return -1;
+		m->first = 1;
+		p = q + 1;
+	}
+	m->data = p;
+	m->datalen = end - p;
+	return 0;
+}
+
+uint64_t log_hash(const struct log_msg *m)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+	for (i = 0; i < m->hostlen; i++)
+		h = (h ^ (unsigned char)m->host[i]) * 0x100000001b3ULL;
+	/* the separator, so that "ab" "/c" differs from "a" "b/c" */
+	h *= 0x100000001b3ULL;
+	for (i = 0; i < m->filelen; i++)
+		h = (h ^ (unsigned char)m->file[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* n digits, -1 if there are others */
+static int digits(const char *p, int n)
+{
+	int v = 0;
+	while (n--) {
+		if (*p < '0' || *p > '9')
+			return -1;
+		v = v * 10 + *p++ - '0';
+	}
+	return v;
+}
+
+/* days since 1970-01-01 in the proleptic Gregorian calendar */
+static int64_t days_from_civil(int y, int mon, int d)
+{
+	int64_t era;
+	unsigned int yoe, doy, doe;
+	y -= mon <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+void log_clock_init(struct log_clock *c, time_t ref)
+{
+	memset(c, 0, sizeof(struct log_clock));
+	c->ref = ref;
+}
+
+time_t log_time(struct log_clock *c, const struct log_msg *m)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	const char *p = m->ts, *end = m->ts + m->tslen;
+	int y, mon, d, h, min, s, zh, zm;
+	struct tm tm;
+	time_t t;
+
+	if (m->tslen == 15) {
+		min = digits(p + 10, 2);
+		s = digits(p + 13, 2);
+		if (min < 0 || s < 0)
+			return -1;
+		if (memcmp(c->hour, p, sizeof(c->hour))) {
+			for (mon = 0; mon < 12; mon++)
+				if (!memcmp(months + mon * 3, p, 3))
+					break;
+			d = p[4] == ' ' ? digits(p + 5, 1) : digits(p + 4, 2);
+			h = digits(p + 7, 2);
+			if (mon == 12 || d < 1 || h < 0)
+				return -1;
+			localtime_r(&c->ref, &tm);
+			tm.tm_mon = mon;
+			tm.tm_mday = d;
+			tm.tm_hour = h;
+			tm.tm_min = tm.tm_sec = 0;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+			if (t > c->ref + 86400) {
+				tm.tm_year--;
+				tm.tm_isdst = -1;
+				t = mktime(&tm);
+			}
+			memcpy(c->hour, p, sizeof(c->hour));
+			c->base = t;
+		}
+		return c->base + min * 60 + s;
+	}
+
+	/* RFC 3339, "2016-10-16T13:01:02.123456+02:00" */
+	if (m->tslen < 20 || p[4] != '-' || p[7] != '-' || p[10] != 'T' ||
+	    p[13] != ':' || p[16] != ':')
+		return -1;
+	y = digits(p, 4);
+	mon = digits(p + 5, 2);
+	d = digits(p + 8, 2);
+	h = digits(p + 11, 2);
+	min = digits(p + 14, 2);
+	s = digits(p + 17, 2);
+	if (y < 0 || mon < 1 || mon > 12 || d < 1 || h < 0 || min < 0 || s < 0)
+		return -1;
+	t = (days_from_civil(y, mon, d) * 24 + h) * 3600 + min * 60 + s;
+	p += 19;
+	if (*p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+			;
+	if (p < end && *p == 'Z')
+		return t;
+	if (end - p != 6 || (*p != '+' && *p != '-') || p[3] != ':')
+		return -1;
+	zh = digits(p + 1, 2);
+	zm = digits(p + 4, 2);
+	if (zh < 0 || zm < 0)
+		return -1;
+	return *p == '+' ? t - zh * 3600 - zm * 60 : t + zh * 3600 + zm * 60;
+}
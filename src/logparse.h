@@ -0,0 +1,58 @@
+/*
+   sudolog File System - parser for the shipped log messages
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _LOGPARSE_H_
+#define _LOGPARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* one message as log_send() builds it, all pointers point into the
+ * parsed buffer and are not terminated */
+struct log_msg {
+	const char *ts;
+	int tslen;
+	const char *host;
+	int hostlen;
+	const char *file;
+	int filelen;
+	unsigned int seq;
+	int first;		/* has the "size@offset" prefix, i.e. starts a record */
+	size_t size;
+	uint64_t offset;
+	char flag;		/* compression: 'Z', 'z', 'S', 's' or 0 */
+	const char *data;	/* base64 */
+	int datalen;
+};
+
+/*
+ * accepts the messages as they are sent, as well as the lines rsyslog
+ * writes from them:
+ *   [<PRI>]TIMESTAMP HOST FILENAME:[ ]SEQ [SIZE@OFFSET[+FLAG] ]BASE64
+ * TIMESTAMP is either "Mmm dd hh:mm:ss" or one RFC 3339 word.
+ * Returns 0, or -1 if buf is not such a message.
+ */
+int log_parse(const char *buf, size_t len, struct log_msg *m);
+/* converting the timestamps, "Mmm dd hh:mm:ss" needs a year and the
+ * time zone, which is expensive, so the start of the hour is cached */
+struct log_clock {
+	time_t ref;		/* the messages were logged before this */
+	char hour[9];		/* "Mmm dd hh" */
+	time_t base;
+};
+
+void log_clock_init(struct log_clock *c, time_t ref);
+/* seconds since the epoch, -1 if the timestamp is not understood. Without
+ * a year, it is the latest one that is not after c->ref (with a day of
+ * tolerance) */
+time_t log_time(struct log_clock *c, const struct log_msg *m);
+/* FNV-1a over host and file name, to spread the files over threads */
+uint64_t log_hash(const struct log_msg *m);
+
+#endif
@@ -3,6 +3,10 @@
 #include <netdb.h>
 #include "params.h"
 
-int log_open(char *hostname, struct sockaddr_in *addr);
+int log_open(struct bb_state *bb_data, char *hostname);
+void log_close(struct bb_state *bb_data);
+int log_poll(struct bb_state *bb_data, struct timespec *next);
+void log_idle(struct bb_state *bb_data);
+int log_header(struct bb_state *bb_data, struct file_state *file_state, const char *filename);
 int log_send(struct bb_state *bb_data, struct file_state *file_state,
-	     const char *filename, const char *msg, int len, off_t offset);
+	     const char *msg, int len, off_t offset);
@@ -12,25 +12,128 @@
 #define _PARAMS_H_
 
 // The FUSE API has been changed a number of times.  So, our code
-// needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 26
-#define FUSE_USE_VERSION 26
+// needs to define the version of the API that we assume: the FUSE 3
+// low-level API, with fuse_session_loop_mt() taking a fuse_loop_config
+#define FUSE_USE_VERSION 35
 
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/* a log host, see transport.c */
+struct spool;
+struct log_dest {
+	int proto;		/* LOG_UDP, LOG_TCP */
+	struct sockaddr_in addr;
+	char name[32];		/* "udp://addr:port", for logging and the stats */
+	int fd;			/* for UDP the first of ufd */
+	int *ufd;		/* UDP: a connected socket per sender thread */
+	unsigned int nufd;
+	int maxlen;		/* of one syslog message, may shrink with msgsize=auto */
+	int minlen;		/* what maxlen can shrink to */
+	int automtu;		/* msgsize=auto, maxlen follows the path MTU */
+	int probing;		/* UDP replay: is the log host there again? */
+	time_t mtucheck;	/* when to look at the path MTU again */
+	time_t icmplog;		/* when an ICMP error may be logged again */
+	/* connection state and what the socket did not take yet */
+	pthread_mutex_t lock;
+	int state;
+	int cork;
+	char *obuf;		/* TCP backlog, unless there is a spool */
+	size_t ohead, olen, osize;
+	size_t osent;		/* bytes of the first backlog message that were sent */
+	struct spool *spool;
+	unsigned long dropped;
+	struct timespec retry;
+	int backoff;		/* ms */
+	int failed;		/* down since the last error, for -o shard */
+	/* for the stats file, updated atomically: UDP sends do not take the lock */
+	unsigned long st_messages, st_dropped, st_errors;
+};
+
+struct sender;
+struct shard_point;
+struct inode_table;
 struct bb_state {
 	char *rootdir;
-	struct sockaddr_in log_addr;
-	int log_fd;
+	struct inode_table *inodes;	/* see inode.c */
+	/* the log hosts, every message goes to all of them */
+	struct log_dest *log;
+	unsigned int nlog;
+	int log_tcp;		/* one of them is TCP, the messages need the octet count */
+	/* -o shard: each session goes to one of them, see shard.c */
+	int shard;
+	struct shard_point *ring;
+	unsigned int nring;
+	char hostname[256];	/* our own, for the syslog header */
+	/* asynchronous shipping, see sender.c */
+	struct sender *sender;
+	unsigned int senders;
+	unsigned int queue_len;
+	int backpressure;
+	int coalesce_delay;	/* ms, 0 disables coalescing */
+	int compress;		/* COMPRESS_*, see compress.h */
+	int tcp_cork;		/* collect TCP messages while the senders are busy */
+	int uring;		/* send with io_uring, see uring.c */
+	int msgsize;		/* 0: default, LOG_SIZE_AUTO: path MTU */
+	char *spool_dir;	/* keep unsent messages here, see spool.c */
+	unsigned int spool_size;	/* MiB */
+	unsigned int mem_limit;	/* MiB of data on its way to the log hosts, see pool.c */
+	char *noship;		/* fnmatch() patterns of files that are not shipped */
+	int passthrough;	/* the kernel can pass I/O through to backing files */
 };
-#define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
+#define BB_DATA ((struct bb_state *) fuse_req_userdata(req))
 
+/* the shipping state of a file, shared by all its open handles (see
+ * bb_open_fd()): they ship through one sender, with one sequence of
+ * numbers, one coalescing buffer and one compression stream */
 struct file_state {
+	unsigned int refs;	/* open handles, under inode_lock() */
+	unsigned int seq;	/* only modified by the sender thread */
+	unsigned int sender;	/* index into bb_state->sender, the same for all handles */
+	char *path;		/* relative to the mount point, "/00/00/01/ttyout" */
+	char *hdr;		/* "hostname filename:", see log_header() */
+	int hdrlen;
+	unsigned int shard;	/* position on the ring of log hosts, with -o shard */
+	struct log_dest *sdest;	/* where the last record went, only used by the sender thread */
+	int noship;		/* matches -o noship, writes only go to the backing file */
+	/* coalescing of small writes, only used by the sender thread. cbuf
+	 * is only allocated while there is something in it */
+	char *cbuf;
+	size_t csize;		/* what fits into one packet */
+	size_t clen;
+	off_t coff;
+	struct timespec cdeadline;
+	struct file_state *cnext, *cprev;
+	/* compression stream, only used by the sender thread */
+	void *zctx;
+	int zmethod;
+	unsigned int zrecords;	/* in the current stream */
+	size_t zbytes;		/* uncompressed, in the current stream */
+	/* stats_now() of the oldest write in cbuf, and in what log_send()
+	 * ships, for the write-to-wire latency */
+	unsigned long long cwritten, written;
+	/* per file statistics, see stats.h. The writes are counted by the
+	 * FUSE threads, the messages only by the sender */
+	unsigned long st_writes, st_bytes, st_messages;
+	struct file_state *snext, *sprev;
+};
+
+/* what fi->fh points to, one per open */
+struct bb_file {
 	int fd;
-	unsigned int seq;
+	int passthrough;	/* the kernel does the I/O, holds a reference to backing_id */
+	struct file_state *file_state;
+	/* only for /.sudologfs/stats: what reads return, fd is -1 and
+	 * there is no file_state */
+	char *snapshot;
+	size_t snaplen;
 };
-#define FILE_STATE ((struct file_state *) fi->fh)
+#define FILE_HANDLE ((struct bb_file *) fi->fh)
+#define FILE_STATE (FILE_HANDLE->file_state)
 
 
 #endif
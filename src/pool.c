@@ -0,0 +1,273 @@
+/*
+   sudolog File System - buffers of the data on its way to the log hosts
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   The copies of the written data that wait for a sender, the coalescing
+   buffers and what log_send() encodes into are taken from here instead
+   of malloc(). The big ones would otherwise be mmap()ed and unmapped for
+   every write, and faulting in fresh pages costs more than the copy.
+
+   Blocks come in power of two size classes. Every thread keeps a few
+   free ones per class, so allocating and freeing usually takes no lock.
+   The FUSE threads allocate and the senders free, so the free blocks
+   pile up with the senders: beyond POOL_CACHE, half of them go to a
+   shared list, from which the FUSE threads take them in batches.
+
+   All blocks in use count against a budget (-o mem_limit). A write that
+   would exceed it gets the backpressure policy, like a full queue: it
+   waits until the senders freed enough, or fails with ENOBUFS. Without
+   that, a flood of output to a slow log host lets the daemon grow
+   without bound.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "pool.h"
+#include "stats.h"
+
+/* in front of every block */
+struct pool_block {
+	size_t size;			/* with the header, what counts against the budget */
+	struct pool_block *next;	/* while it is free */
+};
+
+struct pool_cache {
+	struct pool_block *head[POOL_CLASSES];
+	unsigned int count[POOL_CLASSES];
+};
+
+static size_t budget;
+static size_t used;		/* atomic */
+static size_t cached;		/* atomic, in all free lists */
+static unsigned int waiters;	/* atomic, pool_alloc() calls waiting for the budget */
+/* protects the shared free lists, and the waiting for the budget */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct pool_block *shared[POOL_CLASSES];
+static size_t shared_bytes;
+
+static __thread struct pool_cache *pool_local;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+void pool_init(size_t limit)
+{
+	budget = limit;
+}
+
+/* -1 if it is bigger than the largest class */
+static int pool_class(size_t size)
+{
+	int shift;
+	if (size <= 1UL << POOL_MIN_SHIFT)
+		return 0;
+	shift = (int)(8 * sizeof(unsigned long)) - __builtin_clzl(size - 1);
+	return shift > POOL_MAX_SHIFT ? -1 : shift - POOL_MIN_SHIFT;
+}
+
+/* free blocks of class c a thread keeps */
+static unsigned int pool_limit(int c)
+{
+	unsigned int n = POOL_CACHE >> (c + POOL_MIN_SHIFT);
+	return n ? n : 1;
+}
+
+/* called with pool_lock held */
+static void pool_put_shared(int c, struct pool_block *b)
+{
+	if (shared_bytes + b->size > POOL_SHARED_CACHE) {
+		__atomic_sub_fetch(&cached, b->size, __ATOMIC_RELAXED);
+		free(b);
+		return;
+	}
+	b->next = shared[c];
+	shared[c] = b;
+	shared_bytes += b->size;
+}
+
+/* a thread that exits hands its free blocks to the others */
+static void pool_cache_free(void *arg)
+{
+	struct pool_cache *pc = arg;
+	struct pool_block *b;
+	int c;
+	pthread_mutex_lock(&pool_lock);
+	for (c = 0; c < POOL_CLASSES; c++)
+		while ((b = pc->head[c])) {
+			pc->head[c] = b->next;
+			pool_put_shared(c, b);
+		}
+	pthread_mutex_unlock(&pool_lock);
+	pool_local = NULL;
+	free(pc);
+}
+
+static void pool_key_init(void)
+{
+	pthread_key_create(&pool_key, pool_cache_free);
+}
+
+/* the cache of the calling thread, NULL if there is none */
+static struct pool_cache *pool_cache_get(void)
+{
+	struct pool_cache *pc = pool_local;
+	if (pc)
+		return pc;
+	pthread_once(&pool_once, pool_key_init);
+	pc = calloc(1, sizeof(struct pool_cache));
+	if (!pc)
+		return NULL;
+	if (pthread_setspecific(pool_key, pc)) {
+		free(pc);
+		return NULL;
+	}
+	return pool_local = pc;
+}
+
+/* a block of class c from the shared list, and a batch more for the cache */
+static struct pool_block *pool_refill(struct pool_cache *pc, int c)
+{
+	struct pool_block *b, *m;
+	unsigned int n = pool_limit(c) / 2;
+	pthread_mutex_lock(&pool_lock);
+	b = shared[c];
+	if (b) {
+		shared[c] = b->next;
+		shared_bytes -= b->size;
+		for (; pc && n && (m = shared[c]); n--) {
+			shared[c] = m->next;
+			shared_bytes -= m->size;
+			m->next = pc->head[c];
+			pc->head[c] = m;
+			pc->count[c]++;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return b;
+}
+
+/* the cache of class c is over its limit, keep half of it */
+static void pool_spill(struct pool_cache *pc, int c)
+{
+	struct pool_block *b;
+	unsigned int keep = pool_limit(c) / 2;
+	pthread_mutex_lock(&pool_lock);
+	while (pc->count[c] > keep) {
+		b = pc->head[c];
+		pc->head[c] = b->next;
+		pc->count[c]--;
+		pool_put_shared(c, b);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * take size bytes of the budget. The waiters counter and used are
+ * sequentially consistent: either pool_uncharge() sees the waiter, or
+ * the waiter sees what was freed. A single block bigger than the whole
+ * budget gets through when nothing else is in use
+ */
+static int pool_charge(size_t size, int mode)
+{
+	size_t n = __atomic_add_fetch(&used, size, __ATOMIC_SEQ_CST);
+	if (!budget || n <= budget || n == size || mode == POOL_FORCE)
+		return 0;
+	__atomic_sub_fetch(&used, size, __ATOMIC_SEQ_CST);
+	if (mode == POOL_FAIL) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	stats_add(ST_MEMORY_WAITS, 1);
+	pthread_mutex_lock(&pool_lock);
+	__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+	while ((n = __atomic_add_fetch(&used, size, __ATOMIC_SEQ_CST)) > budget && n != size) {
+		__atomic_sub_fetch(&used, size, __ATOMIC_SEQ_CST);
+		pthread_cond_wait(&pool_cond, &pool_lock);
+	}
+	__atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+static void pool_uncharge(size_t size)
+{
+	__atomic_sub_fetch(&used, size, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+void *pool_alloc(size_t size, int mode)
+{
+	struct pool_cache *pc;
+	struct pool_block *b = NULL;
+	int c;
+	size += sizeof(struct pool_block);
+	c = pool_class(size);
+	if (c >= 0)
+		size = 1UL << (c + POOL_MIN_SHIFT);
+	if (pool_charge(size, mode) < 0)
+		return NULL;
+	if (c >= 0) {
+		pc = pool_cache_get();
+		if (pc && (b = pc->head[c])) {
+			pc->head[c] = b->next;
+			pc->count[c]--;
+		} else
+			b = pool_refill(pc, c);
+		if (b)
+			__atomic_sub_fetch(&cached, size, __ATOMIC_RELAXED);
+	}
+	if (!b) {
+		b = malloc(size);
+		if (!b) {
+			pool_uncharge(size);
+			errno = ENOMEM;
+			return NULL;
+		}
+		b->size = size;
+	}
+	return b + 1;
+}
+
+void pool_free(void *p)
+{
+	struct pool_block *b;
+	struct pool_cache *pc;
+	int c;
+	if (!p)
+		return;
+	b = (struct pool_block *)p - 1;
+	pool_uncharge(b->size);
+	c = pool_class(b->size);
+	if (c < 0) {
+		free(b);
+		return;
+	}
+	__atomic_add_fetch(&cached, b->size, __ATOMIC_RELAXED);
+	pc = pool_cache_get();
+	if (!pc) {
+		pthread_mutex_lock(&pool_lock);
+		pool_put_shared(c, b);
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	b->next = pc->head[c];
+	pc->head[c] = b;
+	if (++pc->count[c] > pool_limit(c))
+		pool_spill(pc, c);
+}
+
+void pool_usage(size_t *u, size_t *c)
+{
+	*u = __atomic_load_n(&used, __ATOMIC_RELAXED);
+	*c = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+/*
+   sudolog File System - buffers of the data on its way to the log hosts
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+/* size classes are powers of two, including the block header. Bigger
+ * blocks than the largest class come from malloc() directly. The largest
+ * holds log_send()'s buffer for a 1 MiB write */
+#define POOL_MIN_SHIFT 8
+#define POOL_MAX_SHIFT 21
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+/* free blocks a thread keeps per class, in bytes (but at least one) */
+#define POOL_CACHE (1 << 20)
+/* free blocks kept for all threads, beyond that they go back to malloc() */
+#define POOL_SHARED_CACHE (16 << 20)
+/* default -o mem_limit, in MiB */
+#define POOL_BUDGET 256
+
+/* what pool_alloc() does when the budget is used up */
+#define POOL_WAIT 0	/* wait until enough was freed */
+#define POOL_FAIL 1	/* return NULL with errno ENOBUFS */
+#define POOL_FORCE 2	/* go over it: for the sender threads, which free what
+			 * the others wait for, and must not wait themselves */
+
+/* the limit for the blocks in use, in bytes, 0 for none. Without a
+ * call, there is none */
+void pool_init(size_t budget);
+void *pool_alloc(size_t size, int mode);
+/* may be called by another thread than the one that allocated it */
+void pool_free(void *p);
+/* for the stats: bytes in blocks that are in use, and free ones kept */
+void pool_usage(size_t *used, size_t *cached);
+
+#endif
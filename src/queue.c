@@ -0,0 +1,90 @@
+/*
+   sudolog File System - bounded multi-producer / single-consumer queue
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "queue.h"
+
+int queue_init(struct queue *q, unsigned int size)
+{
+	unsigned int i, n = 1;
+	/* round up to the next power of two, so that we can mask */
+	while (n < size)
+		n <<= 1;
+	q->slots = calloc(n, sizeof(struct queue_slot));
+	if (!q->slots)
+		return -ENOMEM;
+	for (i = 0; i < n; i++)
+		q->slots[i].seq = i;
+	q->size = n;
+	q->head = 0;
+	q->tail = 0;
+	sem_init(&q->free, 0, n);
+	sem_init(&q->used, 0, 0);
+	return 0;
+}
+
+void queue_destroy(struct queue *q)
+{
+	sem_destroy(&q->free);
+	sem_destroy(&q->used);
+	free(q->slots);
+	q->slots = NULL;
+}
+
+int queue_push(struct queue *q, void *item, int block)
+{
+	unsigned long pos;
+	struct queue_slot *slot;
+	if (block) {
+		while (sem_wait(&q->free) < 0)
+			; /* EINTR */
+	} else if (sem_trywait(&q->free) < 0)
+		return -EAGAIN;
+	/* the semaphore guarantees that the slot we get here is free */
+	pos = __atomic_fetch_add(&q->tail, 1, __ATOMIC_RELAXED);
+	slot = &q->slots[pos & (q->size - 1)];
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&q->used);
+	return 0;
+}
+
+int queue_empty(struct queue *q)
+{
+	int val;
+	sem_getvalue(&q->used, &val);
+	return val <= 0;
+}
+
+void *queue_pop(struct queue *q, const struct timespec *deadline)
+{
+	void *item;
+	struct queue_slot *slot;
+	int ret;
+	do {
+		if (deadline)
+			ret = sem_timedwait(&q->used, deadline);
+		else
+			ret = sem_wait(&q->used);
+		if (ret < 0 && errno == ETIMEDOUT)
+			return NULL;
+	} while (ret < 0);
+	slot = &q->slots[q->head & (q->size - 1)];
+	/* a later producer may have published first, wait for "our" one */
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+		sched_yield();
+	item = slot->item;
+	slot->seq = q->head + q->size;
+	q->head++;
+	sem_post(&q->free);
+	return item;
+}
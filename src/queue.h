@@ -0,0 +1,45 @@
+/*
+   sudolog File System - bounded multi-producer / single-consumer queue
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <semaphore.h>
+#include <time.h>
+
+/*
+ * ring of pointers. Producers claim a position with an atomic increment
+ * of "tail" and publish the item by bumping the slot's sequence number,
+ * the single consumer walks "head". The two semaphores only count free
+ * and used slots, so that producers can block (or fail) when the ring
+ * is full and the consumer can sleep while it is empty.
+ */
+struct queue_slot {
+	void *item;
+	unsigned long seq;
+};
+
+struct queue {
+	struct queue_slot *slots;
+	unsigned int size;	/* power of two */
+	unsigned long head;	/* only touched by the consumer */
+	unsigned long tail;	/* atomically incremented by producers */
+	sem_t free;
+	sem_t used;
+};
+
+int queue_init(struct queue *q, unsigned int size);
+void queue_destroy(struct queue *q);
+/* returns 0, or -EAGAIN if !block and the queue is full */
+int queue_push(struct queue *q, void *item, int block);
+/* only reliable when called by the consumer */
+int queue_empty(struct queue *q);
+/* returns NULL if deadline (CLOCK_REALTIME, may be NULL) has passed */
+void *queue_pop(struct queue *q, const struct timespec *deadline);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+   sudolog File System - rebuilding the shipped files from the messages
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   Shared by sudologfs-recv, which gets the packets as they arrive, and
+   sudologfs-extract, which sorts them by sequence number first. A record
+   starts with a "size@offset" packet, the base64 data of it and the
+   following packets is decoded (and decompressed) and written at offset.
+   After a lost packet, the data cannot be placed until the next record
+   starts, for compressed data not until the next stream starts.
+*/
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "compress.h"
+#include "rebuild.h"
+
+int rfile_init(struct rfile *f, const char *outdir, const struct log_msg *m)
+{
+	memset(f, 0, sizeof(struct rfile));
+	f->host = malloc(m->hostlen + m->filelen + 2);
+	if (!f->host)
+		return -1;
+	f->name = f->host + m->hostlen + 1;
+	memcpy(f->host, m->host, m->hostlen);
+	f->host[m->hostlen] = '\0';
+	memcpy(f->name, m->file, m->filelen);
+	f->name[m->filelen] = '\0';
+	f->hostlen = m->hostlen;
+	f->namelen = m->filelen;
+	f->outdir = outdir;
+	f->fd = -1;
+	return 0;
+}
+
+int rfile_match(const struct rfile *f, const struct log_msg *m)
+{
+	return f->hostlen == m->hostlen && f->namelen == m->filelen &&
+	       !memcmp(f->host, m->host, m->hostlen) && !memcmp(f->name, m->file, m->filelen);
+}
+
+/* OUTDIR/HOST/FILENAME, creating the directories. The name comes from
+ * the network, so do not let it escape OUTDIR */
+static int rfile_open(struct rfile *f)
+{
+	char path[PATH_MAX], *p, *c;
+	int n;
+	if (f->fd != -1)
+		return f->fd;
+	if (f->name[0] != '/' || strstr(f->name, "/../") || strstr(f->name, "/./") ||
+	    (f->namelen >= 3 && !strcmp(f->name + f->namelen - 3, "/..")) ||
+	    strchr(f->host, '/') || f->host[0] == '.') {
+		syslog(LOG_ERR, "%s %s: invalid name, ignoring this file", f->host, f->name);
+		return f->fd = -2;
+	}
+	n = snprintf(path, sizeof(path), "%s/%s%s", f->outdir, f->host, f->name);
+	if (n >= (int)sizeof(path)) {
+		syslog(LOG_ERR, "%s %s: name too long, ignoring this file", f->host, f->name);
+		return f->fd = -2;
+	}
+	p = path + strlen(f->outdir) + 1;
+	while ((c = strchr(p, '/'))) {
+		*c = '\0';
+		if (mkdir(path, 0750) < 0 && errno != EEXIST) {
+			syslog(LOG_ERR, "mkdir %s: %m", path);
+			return -1;
+		}
+		*c = '/';
+		p = c + 1;
+	}
+	f->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0640);
+	if (f->fd < 0) {
+		syslog(LOG_ERR, "open %s: %m", path);
+		f->fd = -1;
+	}
+	return f->fd;
+}
+
+static void rfile_write(void *arg, const char *buf, size_t len)
+{
+	struct rfile *f = arg;
+	ssize_t ret;
+	if (f->discard) {
+		f->pos += len;
+		f->left -= len < f->left ? len : f->left;
+		return;
+	}
+	if (rfile_open(f) < 0)
+		return;
+	while (len) {
+		ret = pwrite(f->fd, buf, len, f->pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!f->werr++)
+				syslog(LOG_ERR, "%s %s: write: %m", f->host, f->name);
+			return;
+		}
+		buf += ret;
+		len -= ret;
+		f->pos += ret;
+		f->left -= (uint64_t)ret < f->left ? (uint64_t)ret : f->left;
+	}
+}
+
+/* a compression stream can only be continued without a gap */
+static void rfile_zreset(struct rfile *f)
+{
+	decompress_end(f->zmethod, f->zctx);
+	f->zctx = NULL;
+}
+
+void rfile_restart(struct rfile *f)
+{
+	if (f->synced && f->left)
+		f->shortrec++;
+	f->seq = 0;
+	f->synced = 0;
+	rfile_zreset(f);
+	/* open it again as well, in case it was moved away in the meantime */
+	rfile_close(f);
+}
+
+void rfile_packet(struct rfile *f, const struct log_msg *m, struct rbuf *buf)
+{
+	size_t n;
+	int method;
+
+	/* the file was opened again, the sequence numbers start over */
+	if (m->first && m->seq == 1 && f->seq)
+		rfile_restart(f);
+	if (m->seq <= f->seq) {
+		f->dups++;
+		return;
+	}
+	if (m->seq != f->seq + 1) {
+		syslog(LOG_WARNING, "%s %s: %u packets missing before %08x",
+		       f->host, f->name, m->seq - f->seq - 1, m->seq);
+		f->gaps++;
+		f->lost += m->seq - f->seq - 1;
+		f->synced = 0;
+		rfile_zreset(f);
+	}
+	f->seq = m->seq;
+	f->used = time(NULL);
+
+	if (m->first) {
+		if (f->synced && f->left)
+			f->shortrec++;
+		f->pos = m->offset;
+		f->left = m->size;
+		f->records++;
+		base64_init_decodestate(&f->b64);
+		f->synced = 1;
+		f->compressed = m->flag != 0;
+		if (m->flag) {
+			method = compress_flag_method(m->flag);
+			/* upper case: the first record of a stream */
+			if (isupper((unsigned char)m->flag)) {
+				rfile_zreset(f);
+				f->zmethod = method;
+				if (compress_supported(method) == 0)
+					f->zctx = decompress_start(method);
+				if (!f->zctx)
+					syslog(LOG_ERR, "%s %s: cannot decompress '%c' records",
+					       f->host, f->name, m->flag);
+			}
+			if (!f->zctx || method != f->zmethod)
+				f->synced = 0;
+		}
+	}
+	if (!f->synced) {
+		f->skipped++;
+		return;
+	}
+	/* uncompressed data that is not wanted does not need to be decoded */
+	if (f->discard && !f->compressed) {
+		f->left = 0;
+		return;
+	}
+
+	n = (size_t)m->datalen / 4 * 3 + 4;
+	if (n > buf->size) {
+		char *tmp = realloc(buf->data, n);
+		if (!tmp) {
+			syslog(LOG_ERR, "%s: malloc failed!", __func__);
+			return;
+		}
+		buf->data = tmp;
+		buf->size = n;
+	}
+	n = base64_decode_block(m->data, m->datalen, buf->data, &f->b64);
+	if (!f->compressed)
+		rfile_write(f, buf->data, n);
+	else if (decompress_chunk(f->zmethod, f->zctx, buf->data, n, rfile_write, f) < 0) {
+		syslog(LOG_ERR, "%s %s: corrupt compressed data at %08x", f->host, f->name, m->seq);
+		rfile_zreset(f);
+		f->synced = 0;
+	}
+}
+
+void rfile_report(const struct rfile *f)
+{
+	if (!f->gaps && !f->dups && !f->skipped && !f->shortrec)
+		return;
+	syslog(LOG_NOTICE, "%s %s: %lu records, %lu packets missing in %lu gaps, "
+	       "%lu duplicates, %lu packets not placed, %lu records incomplete",
+	       f->host, f->name, f->records, f->lost, f->gaps,
+	       f->dups, f->skipped, f->shortrec);
+}
+
+void rfile_close(struct rfile *f)
+{
+	if (f->fd >= 0) {
+		close(f->fd);
+		f->fd = -1;
+	}
+}
+
+void rfile_free(struct rfile *f)
+{
+	rfile_close(f);
+	rfile_zreset(f);
+	free(f->host);
+	f->host = f->name = NULL;
+}
@@ -0,0 +1,59 @@
+/*
+   sudolog File System - rebuilding the shipped files from the messages
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _REBUILD_H_
+#define _REBUILD_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "cdecode.h"
+#include "logparse.h"
+
+/* one shipped file, rebuilt as OUTDIR/HOST/FILENAME */
+struct rfile {
+	const char *outdir;
+	char *host, *name;
+	int hostlen, namelen;
+	int fd;			/* -1: closed, -2: unusable name */
+	time_t used;
+	unsigned int seq;	/* of the last packet */
+	int synced;		/* we know where the data of the next packet goes */
+	int discard;		/* set by the caller: do not write the current record */
+	off_t pos;
+	uint64_t left;		/* of the current record */
+	base64_decodestate b64;
+	int compressed;
+	int zmethod;
+	void *zctx;		/* NULL if there is no usable stream */
+	int werr;
+	unsigned long records, gaps, lost, dups, skipped, shortrec;
+};
+
+/* a buffer for the decoded data, one per thread */
+struct rbuf {
+	char *data;
+	size_t size;
+};
+
+/* for the file of message m, returns -1 if out of memory */
+int rfile_init(struct rfile *f, const char *outdir, const struct log_msg *m);
+/* 1 if message m belongs to this file */
+int rfile_match(const struct rfile *f, const struct log_msg *m);
+/* the sender opened the file again and starts over with sequence number 1 */
+void rfile_restart(struct rfile *f);
+/* apply the packets in order of their sequence numbers, gaps and
+ * duplicates are counted (and gaps logged) */
+void rfile_packet(struct rfile *f, const struct log_msg *m, struct rbuf *buf);
+/* logs the counters if something was missing */
+void rfile_report(const struct rfile *f);
+/* the file is opened again when the next data arrives */
+void rfile_close(struct rfile *f);
+void rfile_free(struct rfile *f);
+
+#endif
@@ -0,0 +1,514 @@
+/*
+   sudolog File System - receiver
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   sudologfs-recv takes the messages that sudologfs sends (via UDP and/or
+   TCP) and rebuilds the shipped files below a directory, as
+   DIR/HOST/FILENAME, while they are being written.
+
+   One thread reads the UDP socket with recvmmsg(), and one thread per
+   TCP connection reads the octet-counted stream. They only parse the
+   header, to pick a worker thread by a hash over host and file name, so
+   that all packets of a file are handled by the same worker, in the order
+   they arrived. The workers decode, decompress and pwrite() the data, and
+   keep track of the sequence numbers to report lost packets.
+*/
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "logparse.h"
+#include "queue.h"
+#include "rebuild.h"
+#include "transport.h"
+
+/* datagrams per recvmmsg() call */
+#define RECV_BATCH 64
+#define RECV_BUFSIZE 65536
+/* messages queued per worker before the network threads have to wait */
+#define RECV_QUEUE_LEN 16384
+#define RECV_HASH 4096
+/* seconds, files that were not written for that long are closed */
+#define RECV_IDLE 60
+/* seconds, after that they are forgotten. A packet that comes later
+ * looks like one after a gap, and is placed from the next record on */
+#define RECV_FORGET (10 * RECV_IDLE)
+
+enum rmsg_type {
+	RMSG_DATA,
+	RMSG_REPORT,	/* log the per file statistics */
+	RMSG_STOP
+};
+
+/* a message, queued for a worker */
+struct rmsg {
+	enum rmsg_type type;
+	uint64_t hash;
+	struct log_msg m;	/* points into buf */
+	char buf[];
+};
+
+/* a file that is being rebuilt, in the hash table of its worker */
+struct rentry {
+	struct rentry *next;
+	uint64_t hash;
+	struct rfile f;
+};
+
+struct worker {
+	pthread_t thread;
+	struct queue q;
+	struct rentry *files[RECV_HASH];
+	struct rbuf buf;
+};
+
+static const char *outdir;
+static struct worker *workers;
+static unsigned int nworkers;
+static unsigned long bad_msgs;
+
+static struct rfile *rfile_get(struct worker *w, const struct log_msg *m, uint64_t hash)
+{
+	struct rentry **b = &w->files[(hash >> 32) % RECV_HASH];
+	struct rentry *e;
+	for (e = *b; e; e = e->next)
+		if (e->hash == hash && rfile_match(&e->f, m))
+			return &e->f;
+	e = malloc(sizeof(struct rentry));
+	if (!e)
+		return NULL;
+	if (rfile_init(&e->f, outdir, m) < 0) {
+		free(e);
+		return NULL;
+	}
+	e->hash = hash;
+	e->next = *b;
+	*b = e;
+	return &e->f;
+}
+
+static void worker_report(struct worker *w)
+{
+	struct rentry *e;
+	int i;
+	for (i = 0; i < RECV_HASH; i++)
+		for (e = w->files[i]; e; e = e->next)
+			rfile_report(&e->f);
+}
+
+/* close the files that were not written for a while, and forget the
+ * ones that were not written for much longer, so that a receiver that
+ * runs for months does not keep every file it ever saw */
+static void worker_sweep(struct worker *w, time_t now)
+{
+	struct rentry **p, *e;
+	int i;
+	for (i = 0; i < RECV_HASH; i++)
+		for (p = &w->files[i]; (e = *p); ) {
+			if (now - e->f.used > RECV_FORGET) {
+				*p = e->next;
+				rfile_report(&e->f);
+				rfile_free(&e->f);
+				free(e);
+				continue;
+			}
+			if (now - e->f.used > RECV_IDLE)
+				rfile_close(&e->f);
+			p = &e->next;
+		}
+}
+
+static void worker_free(struct worker *w)
+{
+	struct rentry *e, *next;
+	int i;
+	for (i = 0; i < RECV_HASH; i++)
+		for (e = w->files[i]; e; e = next) {
+			next = e->next;
+			rfile_free(&e->f);
+			free(e);
+		}
+	free(w->buf.data);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct rmsg *r;
+	struct rfile *f;
+	struct timespec deadline;
+	time_t last = time(NULL);
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		r = queue_pop(&w->q, &deadline);
+		if (deadline.tv_sec - last > RECV_IDLE / 4) {
+			worker_sweep(w, deadline.tv_sec);
+			last = deadline.tv_sec;
+		}
+		if (!r)
+			continue;
+		switch (r->type) {
+		case RMSG_DATA:
+			f = rfile_get(w, &r->m, r->hash);
+			if (f)
+				rfile_packet(f, &r->m, &w->buf);
+			break;
+		case RMSG_REPORT:
+			worker_report(w);
+			break;
+		case RMSG_STOP:
+			worker_report(w);
+			worker_free(w);
+			free(r);
+			return NULL;
+		}
+		free(r);
+	}
+}
+
+static void dispatch(const char *buf, size_t len)
+{
+	struct log_msg m;
+	struct rmsg *r;
+	if (log_parse(buf, len, &m) < 0) {
+		/* do not flood the log with garbage */
+		if (!(__atomic_fetch_add(&bad_msgs, 1, __ATOMIC_RELAXED) & 1023))
+			syslog(LOG_WARNING, "ignoring malformed messages (%lu so far)", bad_msgs);
+		return;
+	}
+	r = malloc(sizeof(struct rmsg) + len);
+	if (!r) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return;
+	}
+	r->type = RMSG_DATA;
+	memcpy(r->buf, buf, len);
+	r->m = m;
+	r->m.ts = r->buf + (m.ts - buf);
+	r->m.host = r->buf + (m.host - buf);
+	r->m.file = r->buf + (m.file - buf);
+	r->m.data = r->buf + (m.data - buf);
+	r->hash = log_hash(&m);
+	queue_push(&workers[r->hash % nworkers].q, r, 1);
+}
+
+static void *udp_thread(void *arg)
+{
+	int fd = (intptr_t)arg;
+	char *bufs = malloc(RECV_BATCH * RECV_BUFSIZE);
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr mh[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	int i, n;
+	if (!bufs) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return NULL;
+	}
+	memset(mh, 0, sizeof(mh));
+	for (i = 0; i < RECV_BATCH; i++) {
+		iov[i].iov_base = bufs + i * RECV_BUFSIZE;
+		iov[i].iov_len = RECV_BUFSIZE;
+		mh[i].msg_hdr.msg_iov = &iov[i];
+		mh[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (1) {
+		n = recvmmsg(fd, mh, RECV_BATCH, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "recvmmsg: %m");
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			dispatch(bufs + i * RECV_BUFSIZE, mh[i].msg_len);
+	}
+#else
+	ssize_t n;
+	if (!bufs) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return NULL;
+	}
+	while (1) {
+		n = recv(fd, bufs, RECV_BUFSIZE, 0);
+		if (n < 0) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "recv: %m");
+			continue;
+		}
+		dispatch(bufs, n);
+	}
+#endif
+	return NULL;
+}
+
+/* dispatch the complete messages in buf, RFC 6587 octet counting or one
+ * message per line. Returns the number of bytes used, or -1 if the
+ * stream makes no sense. *need is set to the size the buffer must have
+ * for the next message */
+static ssize_t tcp_frames(const char *buf, size_t len, size_t *need)
+{
+	const char *p = buf, *end = buf + len, *q;
+	size_t frame;
+	*need = 0;
+	while (p < end) {
+		if (isdigit((unsigned char)*p)) {
+			frame = 0;
+			for (q = p; q < end && q - p < 8 && isdigit((unsigned char)*q); q++)
+				frame = frame * 10 + *q - '0';
+			if (q == end)
+				break;
+			if (*q != ' ' || frame > LOG_TCP_MAX_LENGTH) {
+				syslog(LOG_ERR, "framing error on TCP connection, closing it");
+				return -1;
+			}
+			if ((size_t)(end - q - 1) < frame) {
+				*need = q + 1 - p + frame;
+				break;
+			}
+			dispatch(q + 1, frame);
+			p = q + 1 + frame;
+		} else {
+			q = memchr(p, '\n', end - p);
+			if (!q) {
+				if (end - p > LOG_TCP_MAX_LENGTH) {
+					syslog(LOG_ERR, "overlong line on TCP connection, closing it");
+					return -1;
+				}
+				break;
+			}
+			if (q > p)
+				dispatch(p, q - p);
+			p = q + 1;
+		}
+	}
+	return p - buf;
+}
+
+static void *tcp_thread(void *arg)
+{
+	int fd = (intptr_t)arg;
+	size_t size = RECV_BUFSIZE, len = 0, need;
+	char *buf = malloc(size), *tmp;
+	ssize_t n;
+
+	while (buf) {
+		n = read(fd, buf + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		n = tcp_frames(buf, len, &need);
+		if (n < 0)
+			break;
+		/* keep the incomplete rest for the next read */
+		len -= n;
+		memmove(buf, buf + n, len);
+		if (len == size && need <= size)
+			need = size * 2;
+		if (need > size) {
+			tmp = realloc(buf, need);
+			if (!tmp)
+				break;
+			buf = tmp;
+			size = need;
+		}
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *accept_thread(void *arg)
+{
+	int lfd = (intptr_t)arg, fd;
+	pthread_attr_t attr;
+	pthread_t t;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (1) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				syslog(LOG_ERR, "accept: %m");
+			continue;
+		}
+		if (pthread_create(&t, &attr, tcp_thread, (void *)(intptr_t)fd)) {
+			syslog(LOG_ERR, "cannot start a thread for a TCP connection");
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+/* "[addr:]port" */
+static int listen_on(const char *spec, int type)
+{
+	struct sockaddr_in addr;
+	struct hostent *h;
+	const char *port = strrchr(spec, ':');
+	char host[256];
+	int fd, one = 1, size = 8 << 20;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (port) {
+		if ((size_t)(port - spec) >= sizeof(host))
+			return -1;
+		memcpy(host, spec, port - spec);
+		host[port - spec] = '\0';
+		h = gethostbyname(host);
+		if (!h) {
+			fprintf(stderr, "cannot resolve %s\n", host);
+			return -1;
+		}
+		memcpy(&addr.sin_addr.s_addr, h->h_addr_list[0], h->h_length);
+		port++;
+	} else
+		port = spec;
+	addr.sin_port = htons(atoi(port));
+	fd = socket(AF_INET, type, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* bursts of a few thousand packets must not overflow the socket */
+	if (type == SOCK_DGRAM)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    (type == SOCK_STREAM && listen(fd, 64) < 0)) {
+		perror(spec);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: sudologfs-recv [-u [ADDR:]PORT] [-t [ADDR:]PORT] [-w WORKERS] DIR\n"
+			"    -u  receive UDP (default: port %d if -t is not given)\n"
+			"    -t  receive TCP\n"
+			"    -w  number of worker threads (default: one per CPU)\n"
+			"the files are rebuilt as DIR/HOST/FILENAME, SIGUSR1 logs lost packets\n",
+			LOG_PORT);
+	exit(1);
+}
+
+static void push_all(enum rmsg_type type)
+{
+	unsigned int i;
+	for (i = 0; i < nworkers; i++) {
+		struct rmsg *r = calloc(1, sizeof(struct rmsg));
+		if (!r)
+			continue;
+		r->type = type;
+		queue_push(&workers[i].q, r, 1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *udp = NULL, *tcp = NULL;
+	char port[16];
+	int opt, fd, sig;
+	unsigned int i;
+	long ncpu;
+	sigset_t set;
+	pthread_t t;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = ncpu > 0 ? ncpu : 1;
+	while ((opt = getopt(argc, argv, "u:t:w:")) != -1) {
+		switch (opt) {
+		case 'u':
+			udp = optarg;
+			break;
+		case 't':
+			tcp = optarg;
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || nworkers < 1)
+		usage();
+	outdir = argv[optind];
+	if (!udp && !tcp) {
+		snprintf(port, sizeof(port), "%d", LOG_PORT);
+		udp = port;
+	}
+	openlog(NULL, LOG_PERROR | LOG_PID, LOG_DAEMON);
+	if (mkdir(outdir, 0750) < 0 && errno != EEXIST) {
+		perror(outdir);
+		return 1;
+	}
+
+	/* the signals are only taken by sigwait() below */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = calloc(nworkers, sizeof(struct worker));
+	if (!workers)
+		return 1;
+	for (i = 0; i < nworkers; i++)
+		if (queue_init(&workers[i].q, RECV_QUEUE_LEN) < 0 ||
+		    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+			fprintf(stderr, "cannot start the worker threads\n");
+			return 1;
+		}
+	if (udp) {
+		fd = listen_on(udp, SOCK_DGRAM);
+		if (fd < 0 || pthread_create(&t, NULL, udp_thread, (void *)(intptr_t)fd))
+			return 1;
+	}
+	if (tcp) {
+		fd = listen_on(tcp, SOCK_STREAM);
+		if (fd < 0 || pthread_create(&t, NULL, accept_thread, (void *)(intptr_t)fd))
+			return 1;
+	}
+	syslog(LOG_NOTICE, "receiving%s%s%s%s into %s with %u workers",
+	       udp ? " udp " : "", udp ? udp : "", tcp ? " tcp " : "", tcp ? tcp : "",
+	       outdir, nworkers);
+
+	while (sigwait(&set, &sig) == 0) {
+		if (sig == SIGUSR1) {
+			push_all(RMSG_REPORT);
+			continue;
+		}
+		break;
+	}
+	/* write out what is queued, then report */
+	push_all(RMSG_STOP);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (bad_msgs)
+		syslog(LOG_NOTICE, "%lu malformed messages were ignored", bad_msgs);
+	syslog(LOG_NOTICE, "exiting");
+	return 0;
+}
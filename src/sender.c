@@ -0,0 +1,338 @@
+/*
+   sudolog File System - asynchronous log shipping
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   bb_write() only copies the written buffer into a record and queues
+   it, the actual encoding and sending is done by one or more sender
+   threads. Every open file is bound to exactly one sender, so the
+   records of a file are always shipped in the order they were written
+   and the sequence numbers are only ever touched by that thread.
+
+   sudo writes the terminal output in many tiny pieces. To not send a
+   full syslog header for every few bytes, the sender merges records
+   that append to the previous one into a per file buffer, which is
+   shipped when it fills a packet, when it is older than the configured
+   delay, or when the file is flushed or closed.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "compress.h"
+#include "my_syslog.h"
+#include "pool.h"
+#include "queue.h"
+#include "sender.h"
+#include "stats.h"
+#include "uring.h"
+
+enum rec_type {
+	REC_DATA,
+	REC_FLUSH,	/* ship the coalescing buffer of the file now */
+	REC_RELEASE,	/* last record of a file, free the file_state */
+	REC_STOP	/* terminate the sender thread */
+};
+
+struct log_record {
+	enum rec_type type;
+	struct file_state *file_state;
+	off_t offset;
+	size_t len;
+	unsigned long long written;	/* stats_now() */
+	char data[];
+};
+
+struct sender {
+	struct bb_state *bb_data;
+	struct queue q;
+	pthread_t thread;
+	int running;
+	/* files with data in their coalescing buffer, oldest first */
+	struct file_state *pending;
+	struct file_state *pending_tail;
+};
+
+static void coalesce_unlink(struct sender *s, struct file_state *fs)
+{
+	if (fs->cprev)
+		fs->cprev->cnext = fs->cnext;
+	else
+		s->pending = fs->cnext;
+	if (fs->cnext)
+		fs->cnext->cprev = fs->cprev;
+	else
+		s->pending_tail = fs->cprev;
+	fs->cnext = fs->cprev = NULL;
+}
+
+/* the buffer goes back to the pool right away: it counts against
+ * -o mem_limit, and most of the open files are idle most of the time */
+static void coalesce_flush(struct sender *s, struct file_state *fs)
+{
+	if (!fs->clen)
+		return;
+	fs->written = fs->cwritten;
+	log_send(s->bb_data, fs, fs->cbuf, fs->clen, fs->coff);
+	fs->clen = 0;
+	pool_free(fs->cbuf);
+	fs->cbuf = NULL;
+	coalesce_unlink(s, fs);
+}
+
+/* ship everything that is older than the coalescing delay */
+static void coalesce_expire(struct sender *s)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	while (s->pending && (s->pending->cdeadline.tv_sec < now.tv_sec ||
+			      (s->pending->cdeadline.tv_sec == now.tv_sec &&
+			       s->pending->cdeadline.tv_nsec <= now.tv_nsec)))
+		coalesce_flush(s, s->pending);
+}
+
+static void coalesce_add(struct sender *s, struct log_record *rec)
+{
+	struct file_state *fs = rec->file_state;
+	unsigned int delay = s->bb_data->coalesce_delay;
+	/* not an append to what we have: ship that first */
+	if (fs->clen && (rec->offset != fs->coff + (off_t)fs->clen ||
+			 fs->clen + rec->len > fs->csize))
+		coalesce_flush(s, fs);
+	if (!delay || rec->len >= fs->csize) {
+		fs->written = rec->written;
+		log_send(s->bb_data, fs, rec->data, rec->len, rec->offset);
+		return;
+	}
+	if (!fs->cbuf) {
+		fs->cbuf = pool_alloc(fs->csize, POOL_FORCE);
+		if (!fs->cbuf) {
+			fs->written = rec->written;
+			log_send(s->bb_data, fs, rec->data, rec->len, rec->offset);
+			return;
+		}
+	}
+	if (!fs->clen) {
+		/* every file gets the same delay, so appending keeps the list sorted */
+		fs->coff = rec->offset;
+		fs->cwritten = rec->written;
+		clock_gettime(CLOCK_REALTIME, &fs->cdeadline);
+		fs->cdeadline.tv_nsec += (delay % 1000) * 1000000L;
+		fs->cdeadline.tv_sec += delay / 1000 + fs->cdeadline.tv_nsec / 1000000000L;
+		fs->cdeadline.tv_nsec %= 1000000000L;
+		fs->cprev = s->pending_tail;
+		if (s->pending_tail)
+			s->pending_tail->cnext = fs;
+		else
+			s->pending = fs;
+		s->pending_tail = fs;
+	}
+	memcpy(fs->cbuf + fs->clen, rec->data, rec->len);
+	fs->clen += rec->len;
+	if (fs->clen == fs->csize)
+		coalesce_flush(s, fs);
+}
+
+static void *sender_thread(void *arg)
+{
+	struct sender *s = (struct sender *)arg;
+	struct log_record *rec;
+	struct timespec next, *deadline;
+	if (s->bb_data->uring)
+		uring_init(s->bb_data, s - s->bb_data->sender);
+	while (1) {
+		deadline = s->pending ? &s->pending->cdeadline : NULL;
+		/* the transport may want to reconnect or flush its backlog */
+		if (log_poll(s->bb_data, &next) &&
+		    (!deadline || next.tv_sec < deadline->tv_sec ||
+		     (next.tv_sec == deadline->tv_sec && next.tv_nsec < deadline->tv_nsec)))
+			deadline = &next;
+		rec = queue_pop(&s->q, deadline);
+		if (!rec) {
+			coalesce_expire(s);
+			continue;
+		}
+		switch (rec->type) {
+		case REC_DATA:
+			coalesce_add(s, rec);
+			break;
+		case REC_FLUSH:
+			coalesce_flush(s, rec->file_state);
+			break;
+		case REC_RELEASE:
+			coalesce_flush(s, rec->file_state);
+			compress_free(rec->file_state);
+			pool_free(rec->file_state->cbuf);
+			free(rec->file_state->hdr);
+			free(rec->file_state->path);
+			free(rec->file_state);
+			break;
+		case REC_STOP:
+			while (s->pending)
+				coalesce_flush(s, s->pending);
+			pool_free(rec);
+			uring_exit();
+			return NULL;
+		}
+		pool_free(rec);
+		/* a busy queue must not hold back old buffers */
+		if (s->pending)
+			coalesce_expire(s);
+		if (queue_empty(&s->q))
+			log_idle(s->bb_data);
+	}
+}
+
+int sender_start(struct bb_state *bb_data)
+{
+	unsigned int i;
+	int ret;
+	if (bb_data->senders < 1)
+		bb_data->senders = 1;
+	if (bb_data->queue_len < 1)
+		bb_data->queue_len = SENDER_QUEUE_LEN;
+	if (bb_data->coalesce_delay < 0)
+		bb_data->coalesce_delay = SENDER_COALESCE_DELAY;
+	pool_init((size_t)bb_data->mem_limit << 20);
+	bb_data->sender = calloc(bb_data->senders, sizeof(struct sender));
+	if (!bb_data->sender)
+		return -ENOMEM;
+	for (i = 0; i < bb_data->senders; i++) {
+		struct sender *s = &bb_data->sender[i];
+		s->bb_data = bb_data;
+		ret = queue_init(&s->q, bb_data->queue_len);
+		if (ret < 0)
+			return ret;
+		ret = pthread_create(&s->thread, NULL, sender_thread, s);
+		if (ret) {
+			syslog(LOG_ERR, "%s: pthread_create: %s", __func__, strerror(ret));
+			queue_destroy(&s->q);
+			return -ret;
+		}
+		s->running = 1;
+	}
+	return 0;
+}
+
+/* ships everything that is still queued, then stops the threads */
+void sender_stop(struct bb_state *bb_data)
+{
+	unsigned int i;
+	if (!bb_data->sender)
+		return;
+	for (i = 0; i < bb_data->senders; i++) {
+		struct sender *s = &bb_data->sender[i];
+		struct log_record *rec;
+		if (!s->running)
+			continue;
+		rec = pool_alloc(sizeof(struct log_record), POOL_FORCE);
+		if (rec) {
+			memset(rec, 0, sizeof(struct log_record));
+			rec->type = REC_STOP;
+			queue_push(&s->q, rec, 1);
+			pthread_join(s->thread, NULL);
+		} else
+			pthread_cancel(s->thread);
+		queue_destroy(&s->q);
+	}
+	free(bb_data->sender);
+	bb_data->sender = NULL;
+}
+
+/* bind a newly opened file to one of the senders */
+void sender_attach(struct bb_state *bb_data, struct file_state *file_state)
+{
+	static unsigned int next;
+	file_state->sender = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % bb_data->senders;
+}
+
+/* a record for size bytes of data, to be filled in by the caller and
+ * handed to sender_submit(), or to sender_discard(). It counts against
+ * the memory budget, the backpressure policy applies if that is used up */
+char *sender_buffer(struct bb_state *bb_data, size_t size)
+{
+	struct log_record *rec = pool_alloc(sizeof(struct log_record) + size,
+					    bb_data->backpressure == BP_BLOCK ? POOL_WAIT : POOL_FAIL);
+	if (!rec) {
+		if (errno == ENOBUFS)
+			syslog(LOG_ERR, "memory budget used up, failing write");
+		else
+			syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return NULL;
+	}
+	rec->type = REC_DATA;
+	rec->len = size;
+	return rec->data;
+}
+
+void sender_discard(char *data)
+{
+	pool_free(data - offsetof(struct log_record, data));
+}
+
+/* data is owned by the sender afterwards, also if this fails. size is
+ * at most what the buffer was allocated for */
+int sender_submit(struct bb_state *bb_data, struct file_state *file_state,
+		  const char *path, char *data, size_t size, off_t offset)
+{
+	struct log_record *rec = (struct log_record *)(data - offsetof(struct log_record, data));
+	int ret;
+	rec->len = size;
+	rec->file_state = file_state;
+	rec->offset = offset;
+	rec->written = stats_now();
+	ret = queue_push(&bb_data->sender[file_state->sender].q, rec,
+			 bb_data->backpressure == BP_BLOCK);
+	if (ret < 0) {
+		syslog(LOG_ERR, "sender queue full, failing write to %s", path);
+		pool_free(rec);
+		return -ENOBUFS;
+	}
+	return 0;
+}
+
+int sender_write(struct bb_state *bb_data, struct file_state *file_state,
+		 const char *path, const char *buf, size_t size, off_t offset)
+{
+	char *data = sender_buffer(bb_data, size);
+	if (!data)
+		return -errno;
+	memcpy(data, buf, size);
+	return sender_submit(bb_data, file_state, path, data, size, offset);
+}
+
+static int sender_mark(struct bb_state *bb_data, struct file_state *file_state, enum rec_type type)
+{
+	/* not subject to the budget, the sender still has to learn about it */
+	struct log_record *rec = pool_alloc(sizeof(struct log_record), POOL_FORCE);
+	if (!rec) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return -ENOMEM;
+	}
+	memset(rec, 0, sizeof(struct log_record));
+	rec->type = type;
+	rec->file_state = file_state;
+	queue_push(&bb_data->sender[file_state->sender].q, rec, 1);
+	return 0;
+}
+
+/* ship what is waiting in the coalescing buffer of the file */
+void sender_flush(struct bb_state *bb_data, struct file_state *file_state)
+{
+	sender_mark(bb_data, file_state, REC_FLUSH);
+}
+
+/* the file_state is freed by the sender, after the last record is shipped */
+void sender_release(struct bb_state *bb_data, struct file_state *file_state)
+{
+	/* if this fails, better leak the file_state than free it under the sender's feet */
+	sender_mark(bb_data, file_state, REC_RELEASE);
+}
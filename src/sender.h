@@ -0,0 +1,39 @@
+/*
+   sudolog File System - asynchronous log shipping
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _SENDER_H_
+#define _SENDER_H_
+
+#include <sys/types.h>
+#include "params.h"
+
+/* what to do in bb_write() if the sender queue is full */
+#define BP_BLOCK 0	/* wait until the sender caught up */
+#define BP_FAIL  1	/* fail the write with ENOBUFS */
+
+#define SENDER_QUEUE_LEN 4096
+/* milliseconds a small write may wait for more data to be appended */
+#define SENDER_COALESCE_DELAY 5
+
+int sender_start(struct bb_state *bb_data);
+void sender_stop(struct bb_state *bb_data);
+void sender_attach(struct bb_state *bb_data, struct file_state *file_state);
+int sender_write(struct bb_state *bb_data, struct file_state *file_state,
+		 const char *path, const char *buf, size_t size, off_t offset);
+/* sender_write() without the copy: fill in the data returned by
+ * sender_buffer() and queue it with sender_submit(), with the size that
+ * was filled in, at most the one asked for. NULL and errno set if the
+ * memory budget is used up and backpressure=fail */
+char *sender_buffer(struct bb_state *bb_data, size_t size);
+void sender_discard(char *data);
+int sender_submit(struct bb_state *bb_data, struct file_state *file_state,
+		  const char *path, char *data, size_t size, off_t offset);
+void sender_flush(struct bb_state *bb_data, struct file_state *file_state);
+void sender_release(struct bb_state *bb_data, struct file_state *file_state);
+
+#endif
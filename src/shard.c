@@ -0,0 +1,110 @@
+/*
+   sudolog File System - spreading the sessions over a pool of log hosts
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   With -o shard, every message goes to only one of the log hosts. The
+   log hosts are placed on a hash ring (SHARD_VNODES points each, hashed
+   from their address, so the ring does not depend on the order they were
+   given in), and a file goes to the owner of the first point after the
+   hash of its directory. sudo puts all files of a session into one
+   directory ("00/00/01/ttyout", "00/00/01/timing", ...), so a session
+   always lands on one log host.
+
+   If the log host of a session failed, its messages go to the next one
+   on the ring that did not, so the sessions of the other log hosts stay
+   where they are. Once it is back, they go to it again. Failed means a
+   lost or refused TCP connection, or for UDP a send error noticed with a
+   spool or msgsize=auto.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "shard.h"
+#include "transport.h"
+
+/* FNV-1a, with a final mix: the keys of the points of a log host only
+ * differ in the last characters */
+static uint64_t shard_hash(const char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int shard_cmp(const void *a, const void *b)
+{
+	const struct shard_point *x = a, *y = b;
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+int shard_init(struct bb_state *bb_data)
+{
+	unsigned int i, v, n = 0;
+	char key[64];
+	bb_data->ring = malloc(bb_data->nlog * SHARD_VNODES * sizeof(struct shard_point));
+	if (!bb_data->ring) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return -1;
+	}
+	for (i = 0; i < bb_data->nlog; i++) {
+		for (v = 0; v < SHARD_VNODES; v++) {
+			int len = snprintf(key, sizeof(key), "%s#%u", bb_data->log[i].name, v);
+			bb_data->ring[n].hash = shard_hash(key, len);
+			bb_data->ring[n++].dest = i;
+		}
+	}
+	qsort(bb_data->ring, n, sizeof(struct shard_point), shard_cmp);
+	bb_data->nring = n;
+	return 0;
+}
+
+void shard_free(struct bb_state *bb_data)
+{
+	free(bb_data->ring);
+	bb_data->ring = NULL;
+	bb_data->nring = 0;
+}
+
+unsigned int shard_lookup(struct bb_state *bb_data, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = slash && slash != path ? (size_t)(slash - path) : 1;
+	uint64_t h = shard_hash(path, len);
+	unsigned int lo = 0, hi = bb_data->nring;
+	/* the first point at or after h, wrapping around */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (bb_data->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo == bb_data->nring ? 0 : lo;
+}
+
+struct log_dest *shard_dest(struct bb_state *bb_data, unsigned int pos)
+{
+	struct log_dest *d;
+	unsigned int i;
+	for (i = 0; i < bb_data->nring; i++) {
+		d = &bb_data->log[bb_data->ring[(pos + i) % bb_data->nring].dest];
+		if (!dest_failed(d))
+			return d;
+	}
+	/* all of them failed: the owner keeps it in its backlog or spool */
+	return &bb_data->log[bb_data->ring[pos].dest];
+}
@@ -0,0 +1,31 @@
+/*
+   sudolog File System - spreading the sessions over a pool of log hosts
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stdint.h>
+#include "params.h"
+
+/* points on the ring per log host, for an even spread */
+#define SHARD_VNODES 160
+
+struct shard_point {
+	uint64_t hash;
+	unsigned int dest;	/* index into bb_state->log */
+};
+
+/* builds the ring from the log hosts in bb_data */
+int shard_init(struct bb_state *bb_data);
+void shard_free(struct bb_state *bb_data);
+/* the ring position of the session a file belongs to */
+unsigned int shard_lookup(struct bb_state *bb_data, const char *path);
+/* the log host for a ring position, skipping failed ones */
+struct log_dest *shard_dest(struct bb_state *bb_data, unsigned int pos);
+
+#endif
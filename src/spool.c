@@ -0,0 +1,299 @@
+/*
+   sudolog File System - disk spool for messages the log host did not get
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   While the log host is unreachable, the transport appends the messages
+   to a spool directory instead of dropping them, and replays them in the
+   original order once it is back. The spool is a ring of fixed size
+   segment files ("%08x.spool"), each of them mmap'd and filled from the
+   front. A segment starts with a small header that holds the read and
+   write position, followed by the messages as "u32 length, data".
+   Segments are allocated up front with posix_fallocate(), so that a full
+   disk is noticed when a segment is created and not with a SIGBUS in the
+   middle of a memcpy().
+
+   Nothing is ever fsync()ed, the kernel writes the pages back when it
+   likes to. That is good enough to survive a restart of sudologfs or a
+   log host outage; after a crash of the machine, a few messages may be
+   lost or sent twice, which the receiver sees from the sequence numbers.
+
+   When the spool is full, the oldest segment is thrown away.
+*/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+#define SPOOL_MAGIC "SLSPOOL1"
+
+struct spool_hdr {
+	char magic[8];
+	uint32_t rpos;
+	uint32_t wpos;
+};
+
+#define HDR(map) ((struct spool_hdr *)(map))
+
+static void seg_path(struct spool *s, unsigned int n, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%08x.spool", s->dir, n);
+}
+
+/* map segment n, a new one is created if create is set */
+static char *seg_map(struct spool *s, unsigned int n, int create)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	char *map;
+	int fd, err;
+
+	seg_path(s, n, path, sizeof(path));
+	fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+	if (fd < 0)
+		return NULL;
+	if (create) {
+		err = posix_fallocate(fd, 0, SPOOL_SEGMENT);
+		if (err) {
+			close(fd);
+			unlink(path);
+			errno = err;
+			return NULL;
+		}
+	} else if (fstat(fd, &st) < 0 || st.st_size != SPOOL_SEGMENT) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, SPOOL_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (create) {
+		memcpy(HDR(map)->magic, SPOOL_MAGIC, sizeof(HDR(map)->magic));
+		HDR(map)->rpos = HDR(map)->wpos = sizeof(struct spool_hdr);
+	} else if (memcmp(HDR(map)->magic, SPOOL_MAGIC, sizeof(HDR(map)->magic)) ||
+		   HDR(map)->rpos > HDR(map)->wpos || HDR(map)->wpos > SPOOL_SEGMENT) {
+		munmap(map, SPOOL_SEGMENT);
+		errno = EINVAL;
+		return NULL;
+	}
+	return map;
+}
+
+static void seg_unmap(struct spool *s, char *map)
+{
+	if (map && map != s->rmap && map != s->wmap)
+		munmap(map, SPOOL_SEGMENT);
+}
+
+static void seg_remove(struct spool *s, unsigned int n)
+{
+	char path[PATH_MAX];
+	seg_path(s, n, path, sizeof(path));
+	unlink(path);
+}
+
+/* forget the oldest segment, whether it was replayed or not */
+static void seg_drop_first(struct spool *s)
+{
+	char *map = s->rmap;
+	s->rmap = NULL;
+	seg_unmap(s, map);
+	seg_remove(s, s->first);
+	/* segments that cannot be read any more are skipped */
+	while (++s->first != s->last) {
+		s->rmap = seg_map(s, s->first, 0);
+		if (s->rmap)
+			return;
+		syslog(LOG_ERR, "spool segment %08x is unusable: %m", s->first);
+		seg_remove(s, s->first);
+	}
+	s->rmap = s->wmap;
+}
+
+int spool_open(struct spool *s, const char *dir, size_t size)
+{
+	DIR *d;
+	struct dirent *de;
+	unsigned int n, found = 0;
+	char end;
+
+	memset(s, 0, sizeof(struct spool));
+	s->maxseg = size / SPOOL_SEGMENT;
+	if (s->maxseg < 2)
+		s->maxseg = 2;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "spool directory %s: %m", dir);
+		return -1;
+	}
+	d = opendir(dir);
+	if (!d) {
+		syslog(LOG_ERR, "spool directory %s: %m", dir);
+		return -1;
+	}
+	s->dir = strdup(dir);
+	/* what an earlier mount did not get rid of */
+	while ((de = readdir(d))) {
+		if (strlen(de->d_name) != 14 ||
+		    sscanf(de->d_name, "%8x.spoo%c", &n, &end) != 2 || end != 'l')
+			continue;
+		if (!found++ || n < s->first)
+			s->first = n;
+		if (found == 1 || n > s->last)
+			s->last = n;
+	}
+	closedir(d);
+
+	if (found) {
+		s->wmap = seg_map(s, s->last, 0);
+		if (!s->wmap) {
+			syslog(LOG_ERR, "spool segment %08x is unusable: %m", s->last);
+			seg_remove(s, s->last);
+			s->wmap = seg_map(s, ++s->last, 1);
+		}
+		if (s->wmap) {
+			s->rmap = s->first == s->last ? s->wmap : seg_map(s, s->first, 0);
+			if (!s->rmap)
+				seg_drop_first(s);
+			while (s->last - s->first >= s->maxseg)
+				seg_drop_first(s);
+			if (!spool_empty(s))
+				syslog(LOG_NOTICE, "spool %s: replaying %u segments from an earlier mount",
+				       dir, s->last - s->first + 1);
+		}
+	} else
+		s->wmap = s->rmap = seg_map(s, 0, 1);
+	if (!s->wmap) {
+		syslog(LOG_ERR, "spool segment in %s: %m", dir);
+		free(s->dir);
+		s->dir = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void spool_close(struct spool *s)
+{
+	char *rmap = s->rmap, *wmap = s->wmap;
+	if (!s->dir)
+		return;
+	if (!spool_empty(s))
+		syslog(LOG_NOTICE, "spool %s: %u segments left for the next mount",
+		       s->dir, s->last - s->first + 1);
+	else
+		seg_remove(s, s->last);
+	s->rmap = s->wmap = NULL;
+	seg_unmap(s, rmap);
+	seg_unmap(s, wmap);
+	free(s->dir);
+	s->dir = NULL;
+}
+
+int spool_empty(struct spool *s)
+{
+	return s->first == s->last && HDR(s->rmap)->rpos == HDR(s->rmap)->wpos;
+}
+
+int spool_put(struct spool *s, const struct iovec *iov, int cnt)
+{
+	struct spool_hdr *h = HDR(s->wmap);
+	uint32_t len = 0;
+	char *p, *map;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+	if (sizeof(len) + len > SPOOL_SEGMENT - sizeof(struct spool_hdr))
+		return -EMSGSIZE;
+	if (h->wpos + sizeof(len) + len > SPOOL_SEGMENT) {
+		/* start the next segment, making room if the spool is full */
+		if (s->last - s->first + 1 >= s->maxseg) {
+			if (!s->dropped++)
+				syslog(LOG_ERR, "spool %s is full, dropping the oldest messages", s->dir);
+			s->lost++;
+			seg_drop_first(s);
+		}
+		map = seg_map(s, s->last + 1, 1);
+		if (!map) {
+			i = errno;
+			syslog(LOG_ERR, "spool segment in %s: %m", s->dir);
+			return -i;
+		}
+		p = s->wmap;
+		s->wmap = map;
+		s->last++;
+		seg_unmap(s, p);
+		h = HDR(s->wmap);
+	}
+	p = s->wmap + h->wpos;
+	memcpy(p, &len, sizeof(len));
+	p += sizeof(len);
+	for (i = 0; i < cnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	h->wpos = p - s->wmap;
+	return 0;
+}
+
+const char *spool_peek(struct spool *s, size_t *len)
+{
+	struct spool_hdr *h = HDR(s->rmap);
+	uint32_t l;
+	while (h->rpos == h->wpos) {
+		if (s->first == s->last) {
+			/* all replayed: start from the front again */
+			h->rpos = h->wpos = sizeof(struct spool_hdr);
+			if (s->dropped) {
+				syslog(LOG_NOTICE, "spool %s: %lu segments were dropped", s->dir, s->dropped);
+				s->dropped = 0;
+			}
+			return NULL;
+		}
+		seg_drop_first(s);
+		h = HDR(s->rmap);
+	}
+	memcpy(&l, s->rmap + h->rpos, sizeof(l));
+	if (h->rpos + sizeof(l) + l > h->wpos) {
+		syslog(LOG_ERR, "spool segment %08x is corrupt, skipping the rest", s->first);
+		s->lost++;
+		h->rpos = h->wpos;
+		return spool_peek(s, len);
+	}
+	*len = l;
+	return s->rmap + h->rpos + sizeof(l);
+}
+
+void spool_next(struct spool *s)
+{
+	struct spool_hdr *h = HDR(s->rmap);
+	uint32_t l;
+	memcpy(&l, s->rmap + h->rpos, sizeof(l));
+	h->rpos += sizeof(l) + l;
+}
+
+/* the segments between the first and the last one are not mapped,
+ * they are counted as full */
+size_t spool_pending(struct spool *s)
+{
+	size_t n = HDR(s->rmap)->wpos - HDR(s->rmap)->rpos;
+	if (s->first == s->last)
+		return n;
+	return n + (size_t)(s->last - s->first - 1) * (SPOOL_SEGMENT - sizeof(struct spool_hdr)) +
+		HDR(s->wmap)->wpos - sizeof(struct spool_hdr);
+}
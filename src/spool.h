@@ -0,0 +1,45 @@
+/*
+   sudolog File System - disk spool for messages the log host did not get
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* size of one segment file, the spool size is a multiple of it */
+#define SPOOL_SEGMENT (4 << 20)
+/* default -o spool_size, in MiB */
+#define SPOOL_SIZE 64
+
+struct spool {
+	char *dir;
+	unsigned int maxseg;
+	unsigned int first, last;	/* oldest and newest segment */
+	char *rmap, *wmap;		/* the mappings of first and last */
+	unsigned long dropped;		/* segments thrown away because the spool was full */
+	/* bumped whenever the oldest message is thrown away without
+	 * spool_next(), because the spool was full or is corrupt */
+	unsigned long lost;
+};
+
+/* opens dir (creating it if needed) and picks up what an earlier
+ * mount left behind */
+int spool_open(struct spool *s, const char *dir, size_t size);
+void spool_close(struct spool *s);
+int spool_empty(struct spool *s);
+/* append one message, gathered from iov */
+int spool_put(struct spool *s, const struct iovec *iov, int cnt);
+/* the oldest message, NULL if there is none. It stays in the spool
+ * until spool_next() is called */
+const char *spool_peek(struct spool *s, size_t *len);
+void spool_next(struct spool *s);
+/* bytes that wait to be replayed, roughly */
+size_t spool_pending(struct spool *s);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+   sudolog File System - statistics
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   The counters are rendered in the Prometheus text format, so a copy
+   of /.sudologfs/stats can be dropped into the directory of the
+   node_exporter textfile collector as it is. Only the open files are
+   listed per file, the file system wide counters include the closed
+   ones.
+
+   The latency histograms are exported with one bucket per power of two,
+   on SIGUSR1 the percentiles from the finer buckets are logged instead.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "pool.h"
+#include "stats.h"
+#include "transport.h"
+
+/* in the order of enum stats_counter */
+static const struct {
+	const char *name;
+	const char *help;
+	int scale;	/* ns are exported as seconds */
+} stats_names[ST_MAX] = {
+	{ "writes_total", "Writes to files in the mount.", 0 },
+	{ "write_bytes_total", "Bytes written to files in the mount.", 0 },
+	{ "write_errors_total", "Writes that failed because the sender queue or the memory budget was full.", 0 },
+	{ "memory_waits_total", "Writes that waited because the memory budget was used up.", 0 },
+	{ "records_total", "Pieces of file data shipped, after merging small writes.", 0 },
+	{ "record_bytes_total", "Bytes of file data shipped, before compression.", 0 },
+	{ "messages_total", "Syslog messages built.", 0 },
+	{ "message_bytes_total", "Size of the syslog messages built.", 0 },
+	{ "encode_seconds_total", "Time spent compressing and base64 encoding.", 1 },
+	{ "send_errors_total", "Failed sends to the log host, including lost TCP connections.", 0 },
+	{ "spooled_total", "Messages written to the spool.", 0 },
+	{ "dropped_total", "Messages that were neither sent nor spooled.", 0 },
+};
+
+/* in the order of enum stats_hist */
+static const struct {
+	const char *name;
+	const char *help;
+} stats_hists[H_MAX] = {
+	{ "write", "Time spent in a write to a file in the mount." },
+	{ "queue", "Time spent handing a write to the sender thread." },
+	{ "pwrite", "Time spent writing the backing file." },
+	{ "compress", "Time spent compressing a record." },
+	{ "encode", "Time spent base64 encoding a record." },
+	{ "header", "Time spent building the syslog messages of a record." },
+	{ "send", "Time spent sending a batch of syslog messages." },
+	{ "wire", "Time from a write until its data was sent." },
+};
+/* the exported buckets: 2^10 .. 2^34 ns, about 1us .. 17s */
+#define STATS_LE_MIN 10
+#define STATS_LE_MAX 34
+
+__thread struct stats *stats_local;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats *stats_threads;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+/* open files, for the per file counters */
+static struct file_state *stats_files;
+static unsigned int stats_nfiles;
+/* SIGUSR1 wakes up the dump thread through this pipe */
+static int stats_pipe[2] = { -1, -1 };
+static pthread_t stats_thread;
+
+/* the thread exits, its block can be reused */
+static void stats_exit(void *arg)
+{
+	struct stats *s = (struct stats *)arg;
+	pthread_mutex_lock(&stats_lock);
+	s->busy = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_init(void)
+{
+	pthread_key_create(&stats_key, stats_exit);
+}
+
+/* first counter update of a thread */
+struct stats *stats_register(void)
+{
+	struct stats *s;
+	pthread_once(&stats_once, stats_key_init);
+	pthread_mutex_lock(&stats_lock);
+	for (s = stats_threads; s && s->busy; s = s->next)
+		;
+	if (!s) {
+		s = calloc(1, sizeof(struct stats));
+		if (s) {
+			s->next = stats_threads;
+			stats_threads = s;
+		}
+	}
+	if (s)
+		s->busy = 1;
+	pthread_mutex_unlock(&stats_lock);
+	if (s) {
+		pthread_setspecific(stats_key, s);
+		stats_local = s;
+	}
+	return s;
+}
+
+void stats_open(struct file_state *file_state)
+{
+	pthread_mutex_lock(&stats_lock);
+	file_state->sprev = NULL;
+	file_state->snext = stats_files;
+	if (stats_files)
+		stats_files->sprev = file_state;
+	stats_files = file_state;
+	stats_nfiles++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* after this, the sender may still count messages, but nobody reads them */
+void stats_close(struct file_state *file_state)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (file_state->sprev)
+		file_state->sprev->snext = file_state->snext;
+	else
+		stats_files = file_state->snext;
+	if (file_state->snext)
+		file_state->snext->sprev = file_state->sprev;
+	stats_nfiles--;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_header(FILE *f, const char *name, const char *help, const char *type)
+{
+	fprintf(f, "# HELP sudologfs_%s %s\n# TYPE sudologfs_%s %s\n", name, help, name, type);
+}
+
+/* a label value, with \, " and newline escaped */
+static void stats_label(FILE *f, const char *label, const char *name, int len)
+{
+	int i;
+	fprintf(f, "{%s=\"", label);
+	for (i = 0; i < len; i++) {
+		if (name[i] == '\\' || name[i] == '"')
+			fputc('\\', f);
+		if (name[i] == '\n')
+			fputs("\\n", f);
+		else
+			fputc(name[i], f);
+	}
+	fputs("\"}", f);
+}
+
+static void stats_per_file(FILE *f, struct bb_state *bb_data, const char *name, const char *help,
+			   size_t field)
+{
+	struct file_state *fs;
+	int skip = strlen(bb_data->hostname) + 1;
+	stats_header(f, name, help, "counter");
+	for (fs = stats_files; fs; fs = fs->snext) {
+		/* files with a name too long to ship have no header */
+		if (!fs->hdr)
+			continue;
+		fprintf(f, "sudologfs_%s", name);
+		/* "hostname filename:" */
+		stats_label(f, "file", fs->hdr + skip, fs->hdrlen - skip - 1);
+		fprintf(f, " %lu\n", __atomic_load_n((unsigned long *)((char *)fs + field),
+						     __ATOMIC_RELAXED));
+	}
+}
+
+/* called with the lock held */
+static void stats_sum(struct stats *sum)
+{
+	struct stats *s;
+	int i, j;
+	memset(sum, 0, sizeof(struct stats));
+	for (s = stats_threads; s; s = s->next) {
+		for (i = 0; i < ST_MAX; i++)
+			sum->v[i] += __atomic_load_n(&s->v[i], __ATOMIC_RELAXED);
+		for (i = 0; i < H_MAX; i++) {
+			for (j = 0; j < STATS_BUCKETS; j++)
+				sum->h[i][j] += __atomic_load_n(&s->h[i][j], __ATOMIC_RELAXED);
+			sum->hsum[i] += __atomic_load_n(&s->hsum[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void stats_histogram(FILE *f, struct stats *sum, int h)
+{
+	unsigned long count = 0;
+	char name[64];
+	int b = 0, k;
+	snprintf(name, sizeof(name), "%s_seconds", stats_hists[h].name);
+	stats_header(f, name, stats_hists[h].help, "histogram");
+	for (k = STATS_LE_MIN; k <= STATS_LE_MAX; k++) {
+		/* bucket 4k-5 is the last one below 2^k ns */
+		for (; b <= 4 * k - 5; b++)
+			count += sum->h[h][b];
+		fprintf(f, "sudologfs_%s_bucket{le=\"%.12g\"} %lu\n", name, (double)(1ULL << k) / 1e9, count);
+	}
+	for (; b < STATS_BUCKETS; b++)
+		count += sum->h[h][b];
+	fprintf(f, "sudologfs_%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+	fprintf(f, "sudologfs_%s_sum %lu.%09lu\n", name, sum->hsum[h] / 1000000000UL,
+		sum->hsum[h] % 1000000000UL);
+	fprintf(f, "sudologfs_%s_count %lu\n", name, count);
+}
+
+/* health of the log hosts. Not under stats_lock: the transport holds
+ * the lock of a log host while counting */
+static void stats_dests(FILE *f, struct bb_state *bb_data)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		size_t field;
+	} counters[] = {
+		{ "dest_messages_total", "Syslog messages passed to a log host.",
+		  offsetof(struct log_dest, st_messages) },
+		{ "dest_dropped_total", "Messages to a log host that were neither sent nor spooled.",
+		  offsetof(struct log_dest, st_dropped) },
+		{ "dest_errors_total", "Failed sends and lost connections to a log host.",
+		  offsetof(struct log_dest, st_errors) },
+	};
+	struct log_dest *d;
+	size_t backlog;
+	unsigned int i, j;
+	int up;
+
+	stats_header(f, "dest_up", "Whether a log host is reachable, as far as we know.", "gauge");
+	for (i = 0; i < bb_data->nlog; i++) {
+		d = &bb_data->log[i];
+		dest_health(d, &up, &backlog);
+		fputs("sudologfs_dest_up", f);
+		stats_label(f, "dest", d->name, strlen(d->name));
+		fprintf(f, " %d\n", up);
+	}
+	stats_header(f, "dest_backlog_bytes", "Data waiting for a log host, in memory or spooled.", "gauge");
+	for (i = 0; i < bb_data->nlog; i++) {
+		d = &bb_data->log[i];
+		dest_health(d, &up, &backlog);
+		fputs("sudologfs_dest_backlog_bytes", f);
+		stats_label(f, "dest", d->name, strlen(d->name));
+		fprintf(f, " %zu\n", backlog);
+	}
+	for (j = 0; j < sizeof(counters) / sizeof(counters[0]); j++) {
+		stats_header(f, counters[j].name, counters[j].help, "counter");
+		for (i = 0; i < bb_data->nlog; i++) {
+			d = &bb_data->log[i];
+			fprintf(f, "sudologfs_%s", counters[j].name);
+			stats_label(f, "dest", d->name, strlen(d->name));
+			fprintf(f, " %lu\n", __atomic_load_n((unsigned long *)((char *)d + counters[j].field),
+							     __ATOMIC_RELAXED));
+		}
+	}
+}
+
+char *stats_render(struct bb_state *bb_data, size_t *len)
+{
+	struct stats *sum;
+	char *buf = NULL;
+	size_t used, cached;
+	FILE *f;
+	int i;
+
+	/* too big for the stack of a FUSE thread */
+	sum = malloc(sizeof(struct stats));
+	if (!sum)
+		return NULL;
+	f = open_memstream(&buf, len);
+	if (!f) {
+		free(sum);
+		return NULL;
+	}
+	pthread_mutex_lock(&stats_lock);
+	stats_sum(sum);
+	for (i = 0; i < ST_MAX; i++) {
+		stats_header(f, stats_names[i].name, stats_names[i].help, "counter");
+		if (stats_names[i].scale)
+			fprintf(f, "sudologfs_%s %lu.%09lu\n", stats_names[i].name,
+				sum->v[i] / 1000000000UL, sum->v[i] % 1000000000UL);
+		else
+			fprintf(f, "sudologfs_%s %lu\n", stats_names[i].name, sum->v[i]);
+	}
+	for (i = 0; i < H_MAX; i++)
+		stats_histogram(f, sum, i);
+	stats_header(f, "open_files", "Files open in the mount.", "gauge");
+	fprintf(f, "sudologfs_open_files %u\n", stats_nfiles);
+	pool_usage(&used, &cached);
+	stats_header(f, "memory_bytes", "Memory of the data on its way to the log hosts.", "gauge");
+	fprintf(f, "sudologfs_memory_bytes %zu\n", used);
+	stats_header(f, "memory_cached_bytes", "Memory kept for the next writes.", "gauge");
+	fprintf(f, "sudologfs_memory_cached_bytes %zu\n", cached);
+	stats_per_file(f, bb_data, "file_writes_total", "Writes to an open file.",
+		       offsetof(struct file_state, st_writes));
+	stats_per_file(f, bb_data, "file_write_bytes_total", "Bytes written to an open file.",
+		       offsetof(struct file_state, st_bytes));
+	stats_per_file(f, bb_data, "file_messages_total", "Syslog messages built for an open file.",
+		       offsetof(struct file_state, st_messages));
+	pthread_mutex_unlock(&stats_lock);
+	stats_dests(f, bb_data);
+	free(sum);
+	if (fclose(f)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* exclusive upper bound of a bucket, in ns */
+static unsigned long long stats_upper(int b)
+{
+	if (b < 4)
+		return b + 1;
+	return (unsigned long long)(5 + b % 4) << (b / 4 - 1);
+}
+
+/* the smallest bucket bound that permille of the samples are below */
+static double stats_percentile(unsigned long *h, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	int b;
+	for (b = 0; b < STATS_BUCKETS - 1; b++) {
+		seen += h[b];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return stats_upper(b) / 1e3;
+}
+
+static void stats_dump(void)
+{
+	struct stats *sum = malloc(sizeof(struct stats));
+	unsigned long count;
+	int i, b;
+	if (!sum)
+		return;
+	pthread_mutex_lock(&stats_lock);
+	stats_sum(sum);
+	pthread_mutex_unlock(&stats_lock);
+	for (i = 0; i < H_MAX; i++) {
+		for (count = 0, b = 0; b < STATS_BUCKETS; b++)
+			count += sum->h[i][b];
+		if (!count)
+			continue;
+		syslog(LOG_INFO, "latency %s: n=%lu avg=%.1fus p50<%.1fus p90<%.1fus "
+		       "p99<%.1fus p99.9<%.1fus max<%.1fus", stats_hists[i].name, count,
+		       sum->hsum[i] / 1e3 / count, stats_percentile(sum->h[i], count, 500),
+		       stats_percentile(sum->h[i], count, 900), stats_percentile(sum->h[i], count, 990),
+		       stats_percentile(sum->h[i], count, 999), stats_percentile(sum->h[i], count, 1000));
+	}
+	free(sum);
+}
+
+static void stats_signal(int sig)
+{
+	int err = errno;
+	char c = sig;
+	ssize_t ret;
+	/* if the pipe is full, a dump is pending anyway */
+	ret = write(stats_pipe[1], &c, 1);
+	(void)ret;
+	errno = err;
+}
+
+static void *stats_dump_thread(void *arg)
+{
+	char c;
+	ssize_t ret;
+	(void)arg;
+	while ((ret = read(stats_pipe[0], &c, 1)) != 0) {
+		if (ret > 0)
+			stats_dump();
+		else if (errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+/* the FUSE threads are not ours to block signals in, so the handler
+ * only pokes the dump thread */
+int stats_start(void)
+{
+	struct sigaction sa;
+	int ret;
+	if (pipe(stats_pipe) < 0) {
+		syslog(LOG_ERR, "%s: pipe: %m", __func__);
+		return -1;
+	}
+	fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+	ret = pthread_create(&stats_thread, NULL, stats_dump_thread, NULL);
+	if (ret) {
+		syslog(LOG_ERR, "%s: pthread_create: %s", __func__, strerror(ret));
+		close(stats_pipe[0]);
+		close(stats_pipe[1]);
+		stats_pipe[0] = stats_pipe[1] = -1;
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	return 0;
+}
+
+void stats_stop(void)
+{
+	if (stats_pipe[1] < 0)
+		return;
+	signal(SIGUSR1, SIG_IGN);
+	close(stats_pipe[1]);
+	pthread_join(stats_thread, NULL);
+	close(stats_pipe[0]);
+	stats_pipe[0] = stats_pipe[1] = -1;
+}
@@ -0,0 +1,135 @@
+/*
+   sudolog File System - statistics, see /.sudologfs/stats in the mount
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <time.h>
+#include "params.h"
+
+/* USDT probes, e.g. "bpftrace -l 'usdt:/usr/bin/sudologfs:*'". Without
+ * a tracer attached, each is a single nop */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(sudologfs, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(sudologfs, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(sudologfs, name, a, b, c)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+/* the file system wide counters, keep stats.c:stats_names in sync */
+enum stats_counter {
+	ST_WRITES,		/* bb_write() calls */
+	ST_WRITE_BYTES,
+	ST_WRITE_ERRORS,	/* writes failed because the data could not be queued */
+	ST_MEMORY_WAITS,	/* writes that waited for the memory budget, see pool.c */
+	ST_RECORDS,		/* log_send() calls, after coalescing */
+	ST_RECORD_BYTES,	/* before compression */
+	ST_MESSAGES,		/* syslog messages built */
+	ST_MESSAGE_BYTES,	/* their size on the wire, without TCP framing */
+	ST_ENCODE_NS,		/* compression and base64 encoding */
+	ST_SEND_ERRORS,		/* failed sends, lost or failed TCP connections */
+	ST_SPOOLED,		/* messages written to the spool */
+	ST_DROPPED,		/* messages neither sent nor spooled */
+	ST_MAX
+};
+
+/* latency histograms of the stages a write goes through, keep
+ * stats.c:stats_hists in sync */
+enum stats_hist {
+	H_WRITE,	/* all of bb_write() */
+	H_QUEUE,	/* handing the data to the sender, waiting if the queue or the memory budget is full */
+	H_PWRITE,	/* writing the backing file */
+	H_COMPRESS,
+	H_ENCODE,	/* base64 */
+	H_HEADER,	/* building the syslog messages of a record */
+	H_SEND,		/* sending a batch of messages to all log hosts */
+	H_WIRE,		/* from bb_write() until the last message of its data was sent */
+	H_MAX
+};
+
+/* log-linear: 4 buckets per power of two nanoseconds, up to 2^40 ns */
+#define STATS_BUCKETS 160
+
+/*
+ * every thread counts into its own block, so the hot path needs neither
+ * a lock nor an atomic read-modify-write. The reader sums up the blocks
+ * of all threads. The block of a thread that exited is handed to the
+ * next new one, the counters only ever grow.
+ */
+struct stats {
+	unsigned long v[ST_MAX];
+	unsigned long h[H_MAX][STATS_BUCKETS];
+	unsigned long hsum[H_MAX];	/* ns */
+	struct stats *next;
+	int busy;
+};
+
+extern __thread struct stats *stats_local;
+struct stats *stats_register(void);
+
+static inline void stats_add(enum stats_counter c, unsigned long n)
+{
+	struct stats *s = stats_local;
+	if (!s && !(s = stats_register()))
+		return;
+	/* only this thread writes, the store just must not tear */
+	__atomic_store_n(&s->v[c], s->v[c] + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int stats_bucket(unsigned long long ns)
+{
+	int msb, b;
+	if (ns < 4)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	b = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static inline void stats_record(enum stats_hist h, unsigned long long ns)
+{
+	struct stats *s = stats_local;
+	int b = stats_bucket(ns);
+	if (!s && !(s = stats_register()))
+		return;
+	__atomic_store_n(&s->h[h][b], s->h[h][b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->hsum[h], s->hsum[h] + ns, __ATOMIC_RELAXED);
+}
+
+/* account the time since start (from stats_now()) to a stage. Returns
+ * the current time, for the start of the next stage */
+static inline unsigned long long stats_time(enum stats_hist h, unsigned long long start)
+{
+	unsigned long long now = stats_now();
+	stats_record(h, now - start);
+	return now;
+}
+
+/* the per file counters live in the file_state, these make the open
+ * files visible to stats_render() */
+void stats_open(struct file_state *file_state);
+void stats_close(struct file_state *file_state);
+/* Prometheus text format, malloc()ed. NULL if out of memory */
+char *stats_render(struct bb_state *bb_data, size_t *len);
+/* log the latency percentiles on SIGUSR1 */
+int stats_start(void);
+void stats_stop(void);
+
+#endif
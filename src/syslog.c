@@ -2,7 +2,9 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>	/* mkdir */
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>	/* inet_ntoa */
@@ -12,137 +14,385 @@
 #include <stdlib.h>	/* malloc */
 #include <time.h>	/* strftime */
 #include <inttypes.h>	/* PRIx64 */
+#include <sys/uio.h>	/* struct iovec */
 #include "cencode.h"
+#include "compress.h"
 #include "params.h"
+#include "pool.h"
+#include "shard.h"
+#include "stats.h"
+#include "transport.h"
+#include "uring.h"
 
 /* configurable stuff here */
-/*
- * syslog RFC says, that 1024 is the maximum size of a log message.
- * UDP transport probably prohibits anything beyond MTU (1500) anyway
- */
-#define LOG_PACKET_LENGTH 1024
 /*
  *the minimum "payload size" we want in the syslog packet, after the
  * header, filename, ...
  */
 #define MIN_BUF_SPACE 128
+/* maximum number of packets passed to one sendmmsg() call */
+#define LOG_BATCH 1024
+/* base64 encoded per batch: the memory a write needs does not grow with
+ * its size, and the data is still in the cache when it is sent */
+#define LOG_BATCH_BYTES (256 << 10)
+/* log_audit.log_notice, 109 */
+#define LOG_PRIO "<109>"
+/* "%b %e %T " */
+#define LOG_TS_LEN 16
 
-int log_open(char *hostname, struct sockaddr_in *addr)
+/* with several log hosts, each gets a spool of its own below spool_dir */
+static int log_spool(struct bb_state *bb_data, struct log_dest *d, int shared)
 {
-	struct hostent *srv;
-	int sock;
+	char dir[PATH_MAX];
+	size_t size = (size_t)bb_data->spool_size << 20;
+	if (!shared)
+		return dest_spool(d, bb_data->spool_dir, size);
+	if (mkdir(bb_data->spool_dir, 0700) < 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "spool directory %s: %m", bb_data->spool_dir);
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s/%s-%s-%d", bb_data->spool_dir,
+		 d->proto == LOG_TCP ? "tcp" : "udp", inet_ntoa(d->addr.sin_addr),
+		 ntohs(d->addr.sin_port));
+	return dest_spool(d, dir, size);
+}
+
+/* hostname is a comma separated list of log hosts */
+int log_open(struct bb_state *bb_data, char *hostname)
+{
+	char *hosts, *spec, *save = NULL;
+	unsigned int n = 1;
+	const char *p;
+
 	openlog(NULL, LOG_PERROR|LOG_PID, LOG_DAEMON);
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		syslog(LOG_ERR, "socket: %m");
-		return sock;
+	base64_encode_select(NULL);
+	syslog(LOG_INFO, "using %s base64 encoder", base64_encode_impl());
+	for (p = hostname; *p; p++)
+		n += *p == ',';
+	bb_data->log = calloc(n, sizeof(struct log_dest));
+	hosts = strdup(hostname);
+	if (!bb_data->log || !hosts) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		free(hosts);
+		return -1;
+	}
+	for (spec = strtok_r(hosts, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+		struct log_dest *d = &bb_data->log[bb_data->nlog];
+		if (dest_open(d, spec, bb_data->tcp_cork, bb_data->msgsize,
+			      bb_data->senders ? bb_data->senders : 1) < 0)
+			break;
+		bb_data->nlog++;
+		if (d->proto == LOG_TCP)
+			bb_data->log_tcp = 1;
+		if (bb_data->spool_dir && log_spool(bb_data, d, n > 1) < 0)
+			break;
 	}
-	/* gethostbyname(3): "Here name is either a hostname or an IPv4 address in standard dot notation" */
-	srv = gethostbyname(hostname);
-	if (!srv) {
-		syslog(LOG_ERR, "gethostbyname(%s): %s", hostname, strerror(h_errno));
+	free(hosts);
+	if (spec || !bb_data->nlog)
 		return -1;
+	if (bb_data->shard && shard_init(bb_data) < 0)
+		return -1;
+
+	/* our own name does not change, so look it up only once */
+	if (gethostname(bb_data->hostname, sizeof(bb_data->hostname)) < 0)
+		strcpy(bb_data->hostname, inet_ntoa(bb_data->log[0].addr.sin_addr));
+	bb_data->hostname[sizeof(bb_data->hostname) - 1] = '\0';
+
+	return 0;
+}
+
+void log_close(struct bb_state *bb_data)
+{
+	unsigned int i;
+	shard_free(bb_data);
+	for (i = 0; i < bb_data->nlog; i++)
+		dest_close(&bb_data->log[i]);
+	free(bb_data->log);
+	bb_data->log = NULL;
+	bb_data->nlog = 0;
+}
+
+/* retry connecting / sending what the transport could not send yet.
+ * Every log host has its own backlog and retry time, *next is the
+ * earliest of them */
+int log_poll(struct bb_state *bb_data, struct timespec *next)
+{
+	struct timespec t;
+	unsigned int i;
+	int ret = 0;
+	for (i = 0; i < bb_data->nlog; i++) {
+		if (!dest_poll(&bb_data->log[i], &t))
+			continue;
+		if (next && (!ret || t.tv_sec < next->tv_sec ||
+			     (t.tv_sec == next->tv_sec && t.tv_nsec < next->tv_nsec)))
+			*next = t;
+		ret = 1;
+	}
+	return ret;
+}
+
+/* called by the senders when they run out of work */
+void log_idle(struct bb_state *bb_data)
+{
+	unsigned int i;
+	for (i = 0; i < bb_data->nlog; i++)
+		dest_idle(&bb_data->log[i]);
+}
+
+/* a message has to fit every log host. With msgsize=auto, maxlen
+ * changes at runtime */
+static int log_maxlen(struct bb_state *bb_data, int runtime)
+{
+	unsigned int i;
+	int len = INT_MAX, l;
+	for (i = 0; i < bb_data->nlog; i++) {
+		l = runtime ? __atomic_load_n(&bb_data->log[i].maxlen, __ATOMIC_RELAXED) :
+			bb_data->log[i].maxlen;
+		if (l < len)
+			len = l;
 	}
-	memset(addr, 0, sizeof(struct sockaddr_in));
-	addr->sin_family = AF_INET;
-	addr->sin_port = htons(514);
-	memcpy(&addr->sin_addr.s_addr, srv->h_addr_list[0], srv->h_length);
+	return len;
+}
 
-	return sock;
+static int log_minlen(struct bb_state *bb_data)
+{
+	unsigned int i;
+	int len = INT_MAX;
+	for (i = 0; i < bb_data->nlog; i++)
+		if (bb_data->log[i].minlen < len)
+			len = bb_data->log[i].minlen;
+	return len;
+}
+
+/* prepare the per file part of the syslog header: "hostname filename:" */
+int log_header(struct bb_state *bb_data, struct file_state *file_state, const char *filename)
+{
+	int n, chunk;
+	n = strlen(bb_data->hostname) + strlen(filename) + 2;
+	/* "<109>", timestamp, header, "%08x ". Check against the smallest
+	 * message size, which msgsize=auto may fall back to later */
+	chunk = log_minlen(bb_data) - 1 - (sizeof(LOG_PRIO) - 1 + LOG_TS_LEN + n + 9);
+	if (chunk < MIN_BUF_SPACE) {
+		/* we assume that MIN_BUF_SPACE is much bigger than strlen "size@offset"
+		 * here, so no extra check for that is made */
+		syslog(LOG_ERR, "filename too long, writes will not be shipped");
+		syslog(LOG_ERR, "%s", filename);
+		return -1;
+	}
+	file_state->hdr = malloc(n + 1);
+	if (!file_state->hdr) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
+		return -1;
+	}
+	file_state->hdrlen = sprintf(file_state->hdr, "%s %s:", bb_data->hostname, filename);
+	if (bb_data->shard)
+		file_state->shard = shard_lookup(bb_data, filename);
+	/* raw bytes that fit into the first packet, after a "size@offset " of
+	 * up to 24 characters. The coalescing in sender.c uses that */
+	chunk += log_maxlen(bb_data, 0) - log_minlen(bb_data);
+	file_state->csize = (chunk - 24) / 4 * 3;
+	return 0;
+}
+
+/* "%b %e %T ", only formatted once per second and thread */
+static const char *log_timestamp(void)
+{
+	static __thread time_t last = -1;
+	static __thread char ts[LOG_TS_LEN + 1];
+	struct tm tm;
+	time_t now = time(NULL);
+	if (now != last) {
+		gmtime_r(&now, &tm);
+		strftime(ts, sizeof(ts), "%b %e %T ", &tm);
+		last = now;
+	}
+	return ts;
+}
+
+/* per packet data that is not shared with the other packets of a write */
+struct log_packet {
+	struct iovec iov[7];
+	char frame[12];		/* TCP octet count */
+	char seq[12];
+};
+
+/* "%08x " without the printf overhead */
+static void hex8(char *p, unsigned int v)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	for (i = 7; i >= 0; i--) {
+		p[i] = hex[v & 0xf];
+		v >>= 4;
+	}
+	p[8] = ' ';
 }
 
 int log_send(struct bb_state *bb_data, struct file_state *file_state,
-	     const char *filename, const char *msg, int len, off_t offset)
+	     const char *msg, int len, off_t offset)
 {
-	static char hn[512] = "\0";
-	char buf[LOG_PACKET_LENGTH];
 	char off[64];
-	int i, l, m, n, chunk, ret;
-	int prio = 13 * 8 + 5; /* log_audit.log_notice, 109 */
-	/* timestamp stuff */
-	struct tm tm;
-	time_t now;
+	int i, l, m, p, chunk, npkt, batch, offlen, end, in, inend, sent = 0;
+	unsigned int n;
+	const char *ts, *flag = "";
+	unsigned long long t0, t, zip_ns, enc_ns = 0, hdr_ns = 0;
+	struct log_dest *dest = NULL;
+	/* packet descriptors for sendmmsg() */
+	struct mmsghdr *mh;
+	struct log_packet *pkt;
 
 	/* base64 encoder stuff*/
 	base64_encodestate s;
 	int b64len;
-	char *b64 = (char *)malloc(len*4/3+8);
-	char *c = b64;
-	if (!b64) {
-		syslog(LOG_ERR, "%s: malloc failed!", __func__);
-		return -1;
-	}
+	char *b64, *c;
 
-	now = time(NULL);
-	gmtime_r(&now, &tm);
-
-	base64_init_encodestate(&s);
-	n = base64_encode_block(msg, len, c, &s);
-	c += n;
-	b64len = n;
-	n = base64_encode_blockend(c, &s);
-	c += n;
-	*c = '\0';
-	b64len += n;
-	// fprintf(stderr, "b64: '%s'\n", b64);
-
-	ret = gethostname(hn, 512);
-	if (ret < 0)
-		strcpy(hn, inet_ntoa(bb_data->log_addr.sin_addr));
-	n = sprintf(buf, "<%d>", prio);
-	n += strftime(buf + n, LOG_PACKET_LENGTH - n, "%b %e %T ", &tm);
-	strncat(buf + n, hn, LOG_PACKET_LENGTH - n);
-	n += strlen(hn);
-	m = snprintf(buf + n, LOG_PACKET_LENGTH - n, " %s:%08x ", filename, 0);
-	if (m >= LOG_PACKET_LENGTH - n) {
-		syslog(LOG_ERR, "filename too long, not sending log message");
-		syslog(LOG_ERR, "%s", filename);
-		free(b64);
+	if (len <= 0)
+		return 0;
+	/* log_header() complained already */
+	if (!file_state->hdr)
 		return -1;
-	}
-	n += m;
 
-	/* "size@offset " */
-	l = sprintf(off, "%x@%" PRIx64 " ", len, offset);
+	/* the header up to and including "filename:" is shared by all packets,
+	 * each packet then gets its own "%08x " sequence number */
+	ts = log_timestamp();
+	/* the message size can change at runtime with msgsize=auto */
+	chunk = log_maxlen(bb_data, 1) - 1 -
+		(sizeof(LOG_PRIO) - 1 + LOG_TS_LEN + file_state->hdrlen + 9);
 
-	chunk = LOG_PACKET_LENGTH - 1 - n;
-	if (chunk < MIN_BUF_SPACE) {
-		/* we assume that MIN_BUF_SPACE is much bigger than l (strlen "size@offset")
-		 * here, so no extra check for l is made */
-		syslog(LOG_ERR, "not enough space in packet (%d), not sending log message", chunk);
-		syslog(LOG_ERR, "%s", filename);
-		free(b64);
+	PROBE3(record__start, file_state->hdr, len, offset);
+	/* with -o shard, a record goes to one log host as a whole. When the
+	 * file moves to another one, the records it has do not help that
+	 * one: start a new compression stream there */
+	if (bb_data->shard) {
+		dest = shard_dest(bb_data, file_state->shard);
+		if (dest != file_state->sdest) {
+			compress_free(file_state);
+			file_state->sdest = dest;
+		}
+	}
+	t0 = t = stats_now();
+	/* the receiver needs the uncompressed size, so take it before */
+	l = len;
+	if (bb_data->compress) {
+		len = compress_record(bb_data->compress, file_state, msg, len, (char **)&msg, &flag);
+		if (len < 0) {
+			syslog(LOG_ERR, "compression failed, not sending log message");
+			return -1;
+		}
+		t = stats_time(H_COMPRESS, t);
+	}
+	/* "size@offset " or "size@offset+flag " */
+	stats_add(ST_RECORDS, 1);
+	stats_add(ST_RECORD_BYTES, l);
+	offlen = l = sprintf(off, "%x@%" PRIx64 "%s ", l, offset, flag);
+	zip_ns = t - t0;
+
+	b64len = (len + 2) / 3 * 4;
+	npkt = 1 + (b64len - (chunk - l) + chunk - 1) / chunk;
+	batch = LOG_BATCH_BYTES / chunk;
+	if (batch > LOG_BATCH)
+		batch = LOG_BATCH;
+	if (batch > npkt)
+		batch = npkt;
+	if (batch < 1)
+		batch = 1;
+	/* one allocation for the packet descriptors and the encoded data of
+	 * a batch, with a partial group of 4 at either end */
+	mh = pool_alloc(batch * (sizeof(struct mmsghdr) + sizeof(struct log_packet) + chunk) + 8,
+			POOL_FORCE);
+	if (!mh) {
+		syslog(LOG_ERR, "%s: malloc failed!", __func__);
 		return -1;
 	}
+	pkt = (struct log_packet *)(mh + batch);
+	b64 = (char *)(pkt + batch);
 
-	for (i = 0; i < b64len; /*i+= chunk*/) {
-		sprintf(buf + n -9 , "%08x ", ++file_state->seq);
-		/* first packet of this log message: add "size@offset " prefix */
-		if (l)
-			strcpy(buf + n, off);
-		/* strncpy stops at end of b64 string, so it does not matter that chunk may point beyound b64 array */
-		strncpy(buf + n + l, b64 + i, chunk - l);
-#if 0
-		/* debugging, send length of base64 string instead of string */
-		char tmp[128];
-		int x = strlen(buf+n);
-		sprintf(tmp, "strlen %d, n: %d, tot: %d", x, n, x+n);
-		strcpy(buf + n, tmp);
-#else
-		m = b64len - i + n + l;
-		if (m > LOG_PACKET_LENGTH)
-			m = LOG_PACKET_LENGTH;
-		ret = sendto(bb_data->log_fd, buf, m, 0, (struct sockaddr *)&(bb_data->log_addr), sizeof(struct sockaddr_in));
-		if (ret < 0) {
-			syslog(LOG_ERR, "Error, send() failed: %m");
-			//return 1;
+	for (i = 0; i < b64len; /* i += payload of the packet */) {
+		/* the base64 for the payload of this batch, [i, end). Encoding
+		 * starts at the group of 4 that i is in, i.e. at a multiple of
+		 * 3 input bytes, where the encoder has no state carried over,
+		 * so the output is the same as of encoding it all at once */
+		end = i + batch * chunk - l;
+		if (end > b64len)
+			end = b64len;
+		in = i / 4 * 3;
+		inend = (end + 3) / 4 * 3;
+		if (inend > len)
+			inend = len;
+		base64_init_encodestate(&s);
+		c = b64 + base64_encode_block(msg + in, inend - in, b64, &s);
+		if (inend == len)
+			c += base64_encode_blockend(c, &s);
+		PROBE2(encode__done, inend - in, (int)(c - b64));
+		c = b64 + i % 4;
+		t0 = stats_now();
+		enc_ns += t0 - t;
+		t = t0;
+		for (p = 0; p < batch && i < b64len; p++) {
+			/* iov[0] is the octet count, only used for TCP */
+			struct iovec *iov = pkt[p].iov;
+			int k = 1;
+			hex8(pkt[p].seq, ++file_state->seq);
+			iov[k].iov_base = LOG_PRIO;
+			iov[k++].iov_len = sizeof(LOG_PRIO) - 1;
+			iov[k].iov_base = (char *)ts;
+			iov[k++].iov_len = LOG_TS_LEN;
+			iov[k].iov_base = file_state->hdr;
+			iov[k++].iov_len = file_state->hdrlen;
+			iov[k].iov_base = pkt[p].seq;
+			iov[k++].iov_len = 9;
+			/* first packet of this log message: add "size@offset " prefix */
+			if (l) {
+				iov[k].iov_base = off;
+				iov[k++].iov_len = l;
+			}
+			m = b64len - i;
+			if (m > chunk - l)
+				m = chunk - l;
+			iov[k].iov_base = c;
+			iov[k++].iov_len = m;
+			c += m;
+			/* the TCP form, dest_send() skips iov[0] for UDP */
+			memset(&mh[p], 0, sizeof(struct mmsghdr));
+			iov[0].iov_base = pkt[p].frame;
+			iov[0].iov_len = 0;
+			if (bb_data->log_tcp)
+				iov[0].iov_len = sprintf(pkt[p].frame, "%d ",
+					(int)(sizeof(LOG_PRIO) - 1 + LOG_TS_LEN + file_state->hdrlen + 9 + l + m));
+			mh[p].msg_hdr.msg_iov = iov;
+			mh[p].msg_hdr.msg_iovlen = k;
+			i += m;
+			l = 0; /* reset after first packet */
 		}
-#endif
-		i += chunk - l;
-		l = 0; /* reset after first packet is sent */
-		fprintf(stderr, "sendto: %s\n", buf);
+		sent += p;
+		t0 = stats_now();
+		hdr_ns += t0 - t;
+		PROBE1(send__start, p);
+		/* encoded once, the same messages go to every log host. Each
+		 * of them keeps what it cannot send right away in its own
+		 * backlog or spool, so a slow one does not hold up the others */
+		if (dest)
+			dest_send(dest, file_state->sender, mh, p);
+		/* with io_uring, to all of them in one system call */
+		else if (!uring_send(bb_data, mh, p))
+			for (n = 0; n < bb_data->nlog; n++)
+				dest_send(&bb_data->log[n], file_state->sender, mh, p);
+		t = stats_time(H_SEND, t0);
+		PROBE1(send__done, p);
 	}
-	free(b64);
+	pool_free(mh);
+	stats_record(H_ENCODE, enc_ns);
+	stats_add(ST_ENCODE_NS, zip_ns + enc_ns);
+	stats_record(H_HEADER, hdr_ns);
+	/* packet_bench calls us without a sender */
+	if (file_state->written)
+		stats_record(H_WIRE, t - file_state->written);
+	PROBE2(record__done, file_state->hdr, sent);
+	stats_add(ST_MESSAGES, sent);
+	stats_add(ST_MESSAGE_BYTES, sent * (sizeof(LOG_PRIO) - 1 + LOG_TS_LEN + file_state->hdrlen + 9) +
+		  offlen + b64len);
+	/* only the sender thread of the file gets here */
+	__atomic_store_n(&file_state->st_messages, file_state->st_messages + sent, __ATOMIC_RELAXED);
 
 	return 0;
 }
@@ -0,0 +1,1017 @@
+/*
+   sudolog File System - transport of the log messages to the log host
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   UDP simply sends every message as one datagram. TCP keeps one
+   persistent, non-blocking connection and frames the messages with
+   RFC 6587 octet counting ("LEN SP MSG"). Whatever the socket does not
+   take immediately is kept in a backlog buffer (as whole messages, so
+   that a message that was cut off by a lost connection can be sent
+   again in full after reconnecting) and flushed from dest_poll(). A
+   lost connection is reestablished with exponential backoff.
+
+   With a spool directory, the backlog lives on disk instead (see
+   spool.c) and has no size limit but that of the spool. UDP then uses
+   the spool as well: after a send error, the messages are spooled and
+   sent again when the retry timer expires. Of course, UDP only notices
+   errors the local kernel knows about, a packet that got lost on the
+   way stays lost.
+
+   UDP has a connected socket per sender thread, so that the senders do
+   not contend for one socket, and the kernel does not look up the route
+   for every datagram. Connected, and with IP_RECVERR, they also report
+   the ICMP errors that come back, e.g. for a closed port on the log host.
+   With msgsize=auto, the kernel tells us the path MTU on them, and
+   messages are sized to fit into one unfragmented datagram.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#ifdef IP_RECVERR
+#include <linux/errqueue.h>
+#endif
+#include "spool.h"
+#include "stats.h"
+#include "transport.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define DEST_DOWN 0
+#define DEST_CONNECTING 1
+#define DEST_UP 2
+
+/* log_dest.probing */
+#define UDP_PROBE_SENT 1
+#define UDP_PROBE_OK 2
+
+#ifndef HAVE_SENDMMSG
+static int sendmmsg(int fd, struct mmsghdr *vec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+	for (i = 0; i < vlen; i++) {
+		ret = sendmsg(fd, &vec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? (int)i : -1;
+		vec[i].msg_len = ret;
+	}
+	return i;
+}
+#endif
+
+/* all times are CLOCK_REALTIME, like the sender's sem_timedwait() */
+static void ts_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	ts->tv_sec += ms / 1000 + ts->tv_nsec / 1000000000L;
+	ts->tv_nsec %= 1000000000L;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static size_t msg_len(const struct msghdr *m)
+{
+	size_t i, len = 0;
+	for (i = 0; i < m->msg_iovlen; i++)
+		len += m->msg_iov[i].iov_len;
+	return len;
+}
+
+#if defined(IP_MTU) && defined(IP_MTU_DISCOVER)
+/* the biggest message that fits into one datagram on the path to the log host */
+static int udp_mtu(struct log_dest *d)
+{
+	int mtu;
+	socklen_t len = sizeof(mtu);
+	if (getsockopt(d->fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+		return -1;
+	d->mtucheck = time(NULL) + LOG_MTU_RECHECK;
+	mtu -= 20 + 8;	/* IPv4 and UDP header */
+	if (mtu < d->minlen)
+		return d->minlen;
+	if (mtu > LOG_UDP_MAX_LENGTH)
+		return LOG_UDP_MAX_LENGTH;
+	return mtu;
+}
+
+/* called when sending failed with EMSGSIZE or the path MTU is due for a
+ * check, it may have grown again when the kernel forgot an old value */
+static void udp_mtu_update(struct log_dest *d)
+{
+	int mtu = udp_mtu(d);
+	if (mtu < 0 || mtu == d->maxlen)
+		return;
+	syslog(LOG_NOTICE, "path MTU to log host %s changed, messages are now up to %d bytes",
+	       inet_ntoa(d->addr.sin_addr), mtu);
+	__atomic_store_n(&d->maxlen, mtu, __ATOMIC_RELAXED);
+}
+
+static void udp_auto(struct log_dest *d)
+{
+	int val = IP_PMTUDISC_DO, mtu;
+	unsigned int i;
+	/* IP_MTU only works on a connected socket. With DF set, a message that
+	 * does not fit fails with EMSGSIZE instead of getting fragmented */
+	d->minlen = LOG_UDP_LENGTH;
+	for (i = 0; i < d->nufd; i++)
+		if (setsockopt(d->ufd[i], IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) < 0)
+			break;
+	if (i < d->nufd || (mtu = udp_mtu(d)) < 0) {
+		syslog(LOG_WARNING, "msgsize=auto: cannot get the path MTU (%m), using %d", d->maxlen);
+		return;
+	}
+	d->maxlen = mtu;
+	d->automtu = 1;
+}
+
+/* a message that was cut with the old path MTU: send it fragmented.
+ * Called with the lock held, the socket option is shared by the senders
+ * of the socket (the spool replay uses the first one) */
+static int udp_send_fragmented(struct log_dest *d, int fd, struct msghdr *m)
+{
+	int val = IP_PMTUDISC_DONT, ret;
+	(void)d;
+	setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+	ret = sendmsg(fd, m, 0);
+	val = IP_PMTUDISC_DO;
+	setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+	return ret;
+}
+#else
+static void udp_mtu_update(struct log_dest *d)
+{
+	(void)d;
+}
+
+static void udp_auto(struct log_dest *d)
+{
+	syslog(LOG_WARNING, "msgsize=auto is not supported on this system, using %d", d->maxlen);
+}
+
+static int udp_send_fragmented(struct log_dest *d, int fd, struct msghdr *m)
+{
+	(void)d;
+	(void)fd;
+	(void)m;
+	errno = EMSGSIZE;
+	return -1;
+}
+#endif
+
+/* a UDP socket that only talks to the log host */
+static int udp_socket(struct log_dest *d)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0), val;
+	if (fd < 0)
+		return -1;
+	/* a burst of terminal output should not fail with ENOBUFS locally.
+	 * Root may go beyond net.core.wmem_max */
+	val = LOG_UDP_SNDBUF;
+#ifdef SO_SNDBUFFORCE
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val)) < 0)
+#endif
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+#ifdef IP_RECVERR
+	val = 1;
+	setsockopt(fd, IPPROTO_IP, IP_RECVERR, &val, sizeof(val));
+#endif
+	if (connect(fd, (struct sockaddr *)&d->addr, sizeof(d->addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int dest_open(struct log_dest *d, const char *spec, int cork, int msgsize, unsigned int socks)
+{
+	struct hostent *srv;
+	char host[256];
+	const char *p = spec;
+	size_t n;
+	int port = LOG_PORT;
+
+	memset(d, 0, sizeof(struct log_dest));
+	d->fd = -1;
+	d->proto = LOG_UDP;
+	if (!strncmp(p, "udp://", 6))
+		p += 6;
+	else if (!strncmp(p, "tcp://", 6)) {
+		d->proto = LOG_TCP;
+		p += 6;
+	}
+	n = strcspn(p, ":");
+	if (n >= sizeof(host)) {
+		syslog(LOG_ERR, "log host name too long: %s", spec);
+		return -1;
+	}
+	memcpy(host, p, n);
+	host[n] = '\0';
+	if (p[n] == ':') {
+		port = atoi(p + n + 1);
+		if (port <= 0 || port > 65535) {
+			syslog(LOG_ERR, "invalid port in '%s'", spec);
+			return -1;
+		}
+	}
+	/* gethostbyname(3): "Here name is either a hostname or an IPv4 address in standard dot notation" */
+	srv = gethostbyname(host);
+	if (!srv) {
+		syslog(LOG_ERR, "gethostbyname(%s): %s", host, strerror(h_errno));
+		return -1;
+	}
+	d->addr.sin_family = AF_INET;
+	d->addr.sin_port = htons(port);
+	memcpy(&d->addr.sin_addr.s_addr, srv->h_addr_list[0], srv->h_length);
+	snprintf(d->name, sizeof(d->name), "%s://%s:%d", d->proto == LOG_TCP ? "tcp" : "udp",
+		 inet_ntoa(d->addr.sin_addr), port);
+
+	d->maxlen = d->proto == LOG_UDP ? LOG_UDP_LENGTH : LOG_TCP_LENGTH;
+	if (msgsize && msgsize != LOG_SIZE_AUTO) {
+		if (msgsize < LOG_MIN_LENGTH || msgsize >
+		    (d->proto == LOG_UDP ? LOG_UDP_MAX_LENGTH : LOG_TCP_MAX_LENGTH)) {
+			syslog(LOG_ERR, "invalid message size %d", msgsize);
+			return -1;
+		}
+		d->maxlen = msgsize;
+	}
+	d->minlen = d->maxlen;
+	pthread_mutex_init(&d->lock, NULL);
+
+	if (d->proto == LOG_UDP) {
+		d->nufd = socks ? socks : 1;
+		d->ufd = malloc(d->nufd * sizeof(int));
+		if (!d->ufd) {
+			syslog(LOG_ERR, "%s: malloc failed!", __func__);
+			return -1;
+		}
+		for (n = 0; n < d->nufd; n++) {
+			d->ufd[n] = udp_socket(d);
+			if (d->ufd[n] < 0) {
+				syslog(LOG_ERR, "UDP socket to %s: %m", d->name);
+				while (n--)
+					close(d->ufd[n]);
+				free(d->ufd);
+				d->ufd = NULL;
+				return -1;
+			}
+		}
+		d->fd = d->ufd[0];
+		if (msgsize == LOG_SIZE_AUTO)
+			udp_auto(d);
+		d->state = DEST_UP;
+		d->backoff = LOG_BACKOFF_MIN;
+		return 0;
+	}
+	/* TCP does not fragment, "auto" simply is the default */
+	d->cork = cork;
+	d->backoff = LOG_BACKOFF_MIN;
+	/* the first connect happens on the first dest_poll(), so that a log
+	 * host that is down at mount time is not fatal, same as with UDP */
+	d->state = DEST_DOWN;
+	return 0;
+}
+
+int dest_spool(struct log_dest *d, const char *dir, size_t size)
+{
+	struct spool *s = malloc(sizeof(struct spool));
+	if (!s || spool_open(s, dir, size) < 0) {
+		free(s);
+		return -1;
+	}
+	d->spool = s;
+	/* UDP: replay what an earlier mount left behind, before anything new.
+	 * TCP does that anyway after connecting */
+	if (d->proto == LOG_UDP && !spool_empty(s)) {
+		d->state = DEST_DOWN;
+		clock_gettime(CLOCK_REALTIME, &d->retry);
+	}
+	return 0;
+}
+
+void dest_close(struct log_dest *d)
+{
+	unsigned int i;
+	if (d->ufd) {
+		for (i = 0; i < d->nufd; i++)
+			close(d->ufd[i]);
+		free(d->ufd);
+		d->ufd = NULL;
+	} else if (d->fd >= 0)
+		close(d->fd);
+	d->fd = -1;
+	if (d->olen)
+		syslog(LOG_ERR, "%zu bytes to the log host were never sent", d->olen);
+	free(d->obuf);
+	d->obuf = NULL;
+	if (d->spool) {
+		spool_close(d->spool);
+		free(d->spool);
+		d->spool = NULL;
+	}
+	pthread_mutex_destroy(&d->lock);
+}
+
+/* the destination failed, try again after the backoff delay */
+static void dest_backoff(struct log_dest *d)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	d->retry = now;
+	ts_add_ms(&d->retry, d->backoff);
+	d->backoff *= 2;
+	if (d->backoff > LOG_BACKOFF_MAX)
+		d->backoff = LOG_BACKOFF_MAX;
+}
+
+/* a message goes to the spool, for TCP without the octet count */
+static void spool_msg(struct log_dest *d, struct msghdr *m)
+{
+	int skip = d->proto == LOG_TCP;
+	if (spool_put(d->spool, m->msg_iov + skip, m->msg_iovlen - skip) < 0) {
+		stats_add(ST_DROPPED, 1);
+		__atomic_fetch_add(&d->st_dropped, 1, __ATOMIC_RELAXED);
+		if (!d->dropped++)
+			syslog(LOG_ERR, "log host %s: cannot spool, dropping messages",
+			       inet_ntoa(d->addr.sin_addr));
+	} else
+		stats_add(ST_SPOOLED, 1);
+}
+
+/* called with the lock held */
+static void udp_down(struct log_dest *d, int err)
+{
+	__atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+	stats_add(ST_SEND_ERRORS, 1);
+	__atomic_fetch_add(&d->st_errors, 1, __ATOMIC_RELAXED);
+	if (d->state == DEST_UP)
+		syslog(LOG_ERR, "log host %s is unreachable (%s), spooling messages",
+		       inet_ntoa(d->addr.sin_addr), strerror(err));
+	__atomic_store_n(&d->state, DEST_DOWN, __ATOMIC_RELAXED);
+	d->probing = 0;
+	dest_backoff(d);
+}
+
+/*
+ * with IP_RECVERR, the ICMP errors that came back for earlier datagrams
+ * are queued on the socket, and the next send fails with the error of the
+ * latest one. Empty the queue, so it does not eat into the socket buffer.
+ * Each of them is a lost datagram and counts as a send error, where they
+ * came from is logged once a minute. errno is left alone
+ */
+static void udp_recverr(struct log_dest *d, int fd)
+{
+#ifdef IP_RECVERR
+	char cbuf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+	struct sock_extended_err *ee;
+	struct sockaddr_in *from;
+	struct cmsghdr *c;
+	struct msghdr msg;
+	time_t now, next;
+	int err = errno;
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level != IPPROTO_IP || c->cmsg_type != IP_RECVERR)
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(c);
+			if (ee->ee_origin != SO_EE_ORIGIN_ICMP)
+				continue;
+			stats_add(ST_SEND_ERRORS, 1);
+			__atomic_fetch_add(&d->st_errors, 1, __ATOMIC_RELAXED);
+			/* several senders may get here, one of them logs */
+			now = time(NULL);
+			next = __atomic_load_n(&d->icmplog, __ATOMIC_RELAXED);
+			if (now < next || !__atomic_compare_exchange_n(&d->icmplog, &next,
+					now + LOG_ICMP_INTERVAL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				continue;
+			from = (struct sockaddr_in *)SO_EE_OFFENDER(ee);
+			syslog(LOG_WARNING, "log host %s: ICMP error from %s: %s", d->name,
+			       inet_ntoa(from->sin_addr), strerror(ee->ee_errno));
+		}
+	}
+	errno = err;
+#else
+	(void)d;
+	(void)fd;
+#endif
+}
+
+/* UDP: a failing packet is skipped after logging the error, the rest
+ * of the write is still sent. With a spool, it and the rest go there */
+static void udp_send(struct log_dest *d, int fd, struct mmsghdr *mh, unsigned int cnt)
+{
+	unsigned int done = 0;
+	int ret;
+	if (d->automtu && time(NULL) >= d->mtucheck)
+		udp_mtu_update(d);
+	while (done < cnt) {
+		ret = sendmmsg(fd, mh + done, cnt - done, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EMSGSIZE)
+				udp_recverr(d, fd);
+			if (d->spool && errno != EMSGSIZE) {
+				pthread_mutex_lock(&d->lock);
+				udp_down(d, errno);
+				for (; done < cnt; done++)
+					spool_msg(d, &mh[done].msg_hdr);
+				pthread_mutex_unlock(&d->lock);
+				return;
+			}
+			/* the path MTU went down, later messages will be smaller */
+			if (errno == EMSGSIZE && d->automtu) {
+				udp_mtu_update(d);
+				pthread_mutex_lock(&d->lock);
+				ret = udp_send_fragmented(d, fd, &mh[done].msg_hdr);
+				pthread_mutex_unlock(&d->lock);
+			}
+			/* the socket reports an ICMP error from an earlier
+			 * packet, this one was not sent yet */
+			else if (errno == ECONNREFUSED)
+				continue;
+			if (ret < 0) {
+				stats_add(ST_SEND_ERRORS, 1);
+				__atomic_fetch_add(&d->st_errors, 1, __ATOMIC_RELAXED);
+				syslog(LOG_ERR, "Error, send() failed: %m");
+			}
+			ret = 1;
+		}
+		done += ret ? ret : 1;
+	}
+}
+
+/*
+ * a connected socket only learns about a closed port from the ICMP answer
+ * to a packet. So the first spooled message is sent as a probe and kept,
+ * if no error came back in the next round, the replay starts (sending the
+ * probe again, the receiver sees the duplicate from the sequence number)
+ */
+static int udp_probe(struct log_dest *d, struct msghdr *msg, const struct timespec *now)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	size_t l;
+	if (d->probing == UDP_PROBE_OK)
+		return 1;
+	if (d->probing == UDP_PROBE_SENT) {
+		getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		udp_recverr(d, d->fd);
+		if (!err) {
+			d->probing = UDP_PROBE_OK;
+			return 1;
+		}
+		udp_down(d, err);
+		return 0;
+	}
+	msg->msg_iov->iov_base = (char *)spool_peek(d->spool, &l);
+	msg->msg_iov->iov_len = l;
+	if (!msg->msg_iov->iov_base)
+		return 1;
+	if (sendmsg(d->fd, msg, 0) < 0) {
+		udp_down(d, errno);
+		return 0;
+	}
+	d->probing = UDP_PROBE_SENT;
+	d->retry = *now;
+	ts_add_ms(&d->retry, LOG_UDP_PROBE);
+	return 0;
+}
+
+/* UDP with a spool: send the spooled messages once the retry time came */
+static int udp_poll(struct log_dest *d, struct timespec *next)
+{
+	struct timespec now;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t len;
+	int i;
+
+	if (!d->spool || __atomic_load_n(&d->state, __ATOMIC_RELAXED) == DEST_UP)
+		return 0;
+	pthread_mutex_lock(&d->lock);
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (d->state == DEST_DOWN && !ts_before(&now, &d->retry) && udp_probe(d, &msg, &now)) {
+		for (i = 0; i < LOG_SPOOL_BATCH; i++) {
+			iov.iov_base = (char *)spool_peek(d->spool, &len);
+			if (!iov.iov_base)
+				break;
+			iov.iov_len = len;
+			if (sendmsg(d->fd, &msg, 0) < 0 &&
+			    (errno != EMSGSIZE || udp_send_fragmented(d, d->fd, &msg) < 0)) {
+				if (errno != EINTR)
+					udp_down(d, errno);
+				break;
+			}
+			spool_next(d->spool);
+		}
+		if (spool_empty(d->spool)) {
+			syslog(LOG_NOTICE, "log host %s is reachable again", inet_ntoa(d->addr.sin_addr));
+			if (d->dropped) {
+				syslog(LOG_NOTICE, "log host %s: %lu messages were dropped",
+				       inet_ntoa(d->addr.sin_addr), d->dropped);
+				d->dropped = 0;
+			}
+			d->backoff = LOG_BACKOFF_MIN;
+			__atomic_store_n(&d->failed, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&d->state, DEST_UP, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&d->lock);
+			return 0;
+		}
+	}
+	/* still down, or more to replay right away */
+	if (next)
+		*next = d->retry;
+	pthread_mutex_unlock(&d->lock);
+	return 1;
+}
+
+static void tcp_down(struct log_dest *d, int err)
+{
+	__atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+	stats_add(ST_SEND_ERRORS, 1);
+	__atomic_fetch_add(&d->st_errors, 1, __ATOMIC_RELAXED);
+	if (d->state == DEST_UP)
+		syslog(LOG_ERR, "connection to log host %s lost: %s",
+		       inet_ntoa(d->addr.sin_addr), strerror(err));
+	close(d->fd);
+	d->fd = -1;
+	d->state = DEST_DOWN;
+	/* a message that was only sent in part is sent again completely */
+	d->osent = 0;
+	dest_backoff(d);
+}
+
+static void tcp_up(struct log_dest *d)
+{
+	syslog(LOG_NOTICE, "connected to log host %s", inet_ntoa(d->addr.sin_addr));
+	d->state = DEST_UP;
+	d->backoff = LOG_BACKOFF_MIN;
+	__atomic_store_n(&d->failed, 0, __ATOMIC_RELAXED);
+}
+
+static void tcp_connect(struct log_dest *d)
+{
+	int one = 1;
+	d->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (d->fd < 0) {
+		tcp_down(d, errno);
+		return;
+	}
+	fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) | O_NONBLOCK);
+#ifdef TCP_CORK
+	if (d->cork)
+		setsockopt(d->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+	else
+#endif
+		/* we always write whole batches, Nagle would only add latency */
+		setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(d->fd, (struct sockaddr *)&d->addr, sizeof(d->addr)) == 0)
+		tcp_up(d);
+	else if (errno == EINPROGRESS)
+		d->state = DEST_CONNECTING;
+	else
+		tcp_down(d, errno);
+}
+
+static void tcp_check(struct log_dest *d)
+{
+	struct pollfd pfd = { d->fd, POLLOUT, 0 };
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (poll(&pfd, 1, 0) <= 0)
+		return; /* still in progress */
+	if (getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err)
+		tcp_down(d, err);
+	else
+		tcp_up(d);
+}
+
+/*
+ * a log host that closed the connection (e.g. because it restarts) still
+ * lets the next send() succeed, the data is only refused with a RST
+ * afterwards. The server never talks to us, so a readable socket means
+ * EOF or an error: notice that before handing it more messages.
+ */
+static void tcp_alive(struct log_dest *d)
+{
+	char buf[256];
+	ssize_t ret = recv(d->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (ret == 0)
+		tcp_down(d, ECONNRESET);
+	else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		tcp_down(d, errno);
+}
+
+/* forget the messages at the head of the backlog that are sent completely */
+static void tcp_consume(struct log_dest *d)
+{
+	while (d->olen) {
+		char *p = d->obuf + d->ohead;
+		char *end;
+		size_t len = strtoul(p, &end, 10) + (end - p) + 1;
+		if (d->osent < len)
+			break;
+		d->ohead += len;
+		d->olen -= len;
+		d->osent -= len;
+	}
+	if (!d->olen)
+		d->ohead = 0;
+}
+
+/* is there a backlog, in memory or in the spool? */
+static int tcp_pending(struct log_dest *d)
+{
+	return d->olen || (d->spool && !spool_empty(d->spool));
+}
+
+/*
+ * the spool threw away its oldest message (see spool.h:lost) while it was
+ * sent in part. The rest of that frame is gone, and sending the next one
+ * would splice it onto the cut off one: restart the connection, so the
+ * stream starts on a frame boundary again. Returns 1 if it did
+ */
+static int tcp_spool_lost(struct log_dest *d, unsigned long lost)
+{
+	if (d->spool->lost == lost || !d->osent)
+		return 0;
+	syslog(LOG_ERR, "log host %s: a partly sent message was dropped from the spool, reconnecting",
+	       inet_ntoa(d->addr.sin_addr));
+	tcp_down(d, ECONNABORTED);
+	return 1;
+}
+
+/* send the spooled messages straight from the mapping */
+static void tcp_flush_spool(struct log_dest *d)
+{
+	char frame[16];
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t len, want;
+	unsigned long lost;
+	ssize_t ret;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	for (i = 0; i < LOG_SPOOL_BATCH; i++) {
+		lost = d->spool->lost;
+		iov[1].iov_base = (char *)spool_peek(d->spool, &len);
+		if (tcp_spool_lost(d, lost) || !iov[1].iov_base)
+			return;
+		iov[0].iov_base = frame;
+		iov[0].iov_len = sprintf(frame, "%zu ", len);
+		iov[1].iov_len = len;
+		want = iov[0].iov_len + len;
+		/* skip what was sent before the socket was full */
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		if (d->osent >= iov[0].iov_len) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+			iov[1].iov_base = (char *)iov[1].iov_base + d->osent - iov[0].iov_len;
+			iov[1].iov_len -= d->osent - iov[0].iov_len;
+		} else {
+			iov[0].iov_base = frame + d->osent;
+			iov[0].iov_len -= d->osent;
+		}
+		ret = sendmsg(d->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				tcp_down(d, errno);
+			return;
+		}
+		d->osent += ret;
+		if (d->osent < want)
+			return;
+		d->osent = 0;
+		spool_next(d->spool);
+	}
+}
+
+static void tcp_flush(struct log_dest *d)
+{
+	ssize_t ret;
+	if (d->spool) {
+		tcp_flush_spool(d);
+		return;
+	}
+	while (d->olen > d->osent) {
+		ret = send(d->fd, d->obuf + d->ohead + d->osent, d->olen - d->osent,
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				tcp_down(d, errno);
+			return;
+		}
+		d->osent += ret;
+		tcp_consume(d);
+	}
+}
+
+/* append messages to the backlog, skip bytes of the first one were sent */
+static void tcp_queue(struct log_dest *d, struct mmsghdr *mh, unsigned int cnt, size_t skip)
+{
+	unsigned int i;
+	unsigned long lost;
+	size_t j, len;
+	if (d->spool) {
+		/* the first message may have been sent in part: the rest of it
+		 * is then the first thing in the spool */
+		if (spool_empty(d->spool))
+			d->osent = skip;
+		lost = d->spool->lost;
+		for (i = 0; i < cnt; i++)
+			spool_msg(d, &mh[i].msg_hdr);
+		tcp_spool_lost(d, lost);
+		return;
+	}
+	for (i = 0; i < cnt; i++) {
+		struct msghdr *m = &mh[i].msg_hdr;
+		len = msg_len(m);
+		if (d->ohead + d->olen + len > d->osize) {
+			if (d->ohead) {
+				memmove(d->obuf, d->obuf + d->ohead, d->olen);
+				d->ohead = 0;
+			}
+			if (d->olen + len > d->osize && d->osize < LOG_TCP_BACKLOG) {
+				size_t size = d->osize ? d->osize : 65536;
+				char *tmp;
+				while (size < d->olen + len && size < LOG_TCP_BACKLOG)
+					size *= 2;
+				tmp = realloc(d->obuf, size);
+				if (tmp) {
+					d->obuf = tmp;
+					d->osize = size;
+				}
+			}
+			if (d->olen + len > d->osize) {
+				stats_add(ST_DROPPED, 1);
+				__atomic_fetch_add(&d->st_dropped, 1, __ATOMIC_RELAXED);
+				if (!d->dropped++)
+					syslog(LOG_ERR, "log host %s: backlog full, dropping messages",
+					       inet_ntoa(d->addr.sin_addr));
+				/* the log host got the start of it, the rest would
+				 * be taken as part of the next frame */
+				if (skip) {
+					syslog(LOG_ERR, "log host %s: a partly sent message was dropped, reconnecting",
+					       inet_ntoa(d->addr.sin_addr));
+					tcp_down(d, ECONNABORTED);
+				}
+				skip = 0;
+				continue;
+			}
+		}
+		if (!d->olen)
+			d->osent = skip;
+		skip = 0;
+		for (j = 0; j < m->msg_iovlen; j++) {
+			memcpy(d->obuf + d->ohead + d->olen, m->msg_iov[j].iov_base, m->msg_iov[j].iov_len);
+			d->olen += m->msg_iov[j].iov_len;
+		}
+	}
+}
+
+/* write as many messages as the socket takes, queue the rest */
+static void tcp_send(struct log_dest *d, struct mmsghdr *mh, unsigned int cnt)
+{
+	struct iovec iov[IOV_MAX];
+	struct msghdr msg;
+	unsigned int i = 0, first;
+	size_t k, j, want, written;
+	ssize_t ret;
+
+	while (i < cnt) {
+		/* as many whole messages as fit into one call */
+		first = i;
+		want = 0;
+		for (k = 0; i < cnt && k + mh[i].msg_hdr.msg_iovlen <= IOV_MAX; i++) {
+			for (j = 0; j < mh[i].msg_hdr.msg_iovlen; j++) {
+				iov[k++] = mh[i].msg_hdr.msg_iov[j];
+				want += mh[i].msg_hdr.msg_iov[j].iov_len;
+			}
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = k;
+		do
+			ret = sendmsg(d->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		while (ret < 0 && errno == EINTR);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			tcp_down(d, errno);
+		written = ret < 0 ? 0 : ret;
+		if (written == want)
+			continue;
+		/* find the message that was cut off, queue it and all following */
+		for (i = first; written >= msg_len(&mh[i].msg_hdr); i++)
+			written -= msg_len(&mh[i].msg_hdr);
+		tcp_queue(d, mh + i, cnt - i, d->state == DEST_UP ? written : 0);
+		return;
+	}
+	if (d->dropped) {
+		syslog(LOG_NOTICE, "log host %s: %lu messages were dropped",
+		       inet_ntoa(d->addr.sin_addr), d->dropped);
+		d->dropped = 0;
+	}
+}
+
+static int tcp_poll(struct log_dest *d, struct timespec *next)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (d->state == DEST_DOWN && !ts_before(&now, &d->retry))
+		tcp_connect(d);
+	if (d->state == DEST_CONNECTING)
+		tcp_check(d);
+	if (d->state == DEST_UP)
+		tcp_alive(d);
+	if (d->state == DEST_UP && tcp_pending(d))
+		tcp_flush(d);
+	if (d->state == DEST_DOWN) {
+		if (next)
+			*next = d->retry;
+		return 1;
+	}
+	if (d->state == DEST_CONNECTING || tcp_pending(d)) {
+		/* we do not get woken up by the socket, so look again soon */
+		if (next) {
+			*next = now;
+			ts_add_ms(next, 10);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* the messages come with the TCP octet count in iov[0]. For UDP, it is
+ * skipped (the sockets are connected, there is no address to fill in),
+ * and afterwards they are put back as they were, for the next log host */
+static void udp_address(struct mmsghdr *mh, unsigned int cnt, int set)
+{
+	unsigned int i;
+	for (i = 0; i < cnt; i++) {
+		struct msghdr *m = &mh[i].msg_hdr;
+		m->msg_iov += set ? 1 : -1;
+		m->msg_iovlen += set ? -1 : 1;
+	}
+}
+
+int dest_socket(struct log_dest *d, unsigned int sock)
+{
+	return d->proto == LOG_UDP ? d->ufd[sock % d->nufd] : d->fd;
+}
+
+void dest_send(struct log_dest *d, unsigned int sock, struct mmsghdr *mh, unsigned int cnt)
+{
+	unsigned int i;
+	__atomic_fetch_add(&d->st_messages, cnt, __ATOMIC_RELAXED);
+	if (d->proto == LOG_UDP) {
+		udp_address(mh, cnt, 1);
+		/* while the spool is replayed, new messages go behind it */
+		if (d->spool && __atomic_load_n(&d->state, __ATOMIC_RELAXED) != DEST_UP) {
+			pthread_mutex_lock(&d->lock);
+			if (d->state != DEST_UP) {
+				for (i = 0; i < cnt; i++)
+					spool_msg(d, &mh[i].msg_hdr);
+				pthread_mutex_unlock(&d->lock);
+				udp_address(mh, cnt, 0);
+				return;
+			}
+			pthread_mutex_unlock(&d->lock);
+		}
+		udp_send(d, dest_socket(d, sock), mh, cnt);
+		udp_address(mh, cnt, 0);
+		return;
+	}
+	pthread_mutex_lock(&d->lock);
+	tcp_poll(d, NULL);
+	/* keep the order: while there is a backlog, new messages go behind it */
+	if (d->state == DEST_UP && !tcp_pending(d))
+		tcp_send(d, mh, cnt);
+	else
+		tcp_queue(d, mh, cnt, 0);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* the io_uring engine (see uring.c) sends the messages to a UDP log host
+ * itself, unless they have to go behind a spool replay */
+int dest_direct(struct log_dest *d)
+{
+	if (d->proto != LOG_UDP ||
+	    (d->spool && __atomic_load_n(&d->state, __ATOMIC_RELAXED) != DEST_UP))
+		return 0;
+	if (d->automtu && time(NULL) >= d->mtucheck)
+		udp_mtu_update(d);
+	return 1;
+}
+
+/* one of these messages failed with err, handled like in udp_send() */
+void dest_send_error(struct log_dest *d, int fd, struct msghdr *m, int err)
+{
+	int ret = -1;
+	if (err != EMSGSIZE)
+		udp_recverr(d, fd);
+	if (d->spool && err != EMSGSIZE) {
+		pthread_mutex_lock(&d->lock);
+		if (d->state == DEST_UP)
+			udp_down(d, err);
+		spool_msg(d, m);
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+	if (err == EMSGSIZE && d->automtu) {
+		udp_mtu_update(d);
+		pthread_mutex_lock(&d->lock);
+		ret = udp_send_fragmented(d, fd, m);
+		pthread_mutex_unlock(&d->lock);
+	} else if (err == ECONNREFUSED) {
+		/* an ICMP error from an earlier packet, this one was not sent yet */
+		ret = sendmsg(fd, m, 0);
+	}
+	if (ret < 0) {
+		stats_add(ST_SEND_ERRORS, 1);
+		__atomic_fetch_add(&d->st_errors, 1, __ATOMIC_RELAXED);
+		syslog(LOG_ERR, "Error, send() failed: %s", strerror(err));
+	}
+}
+
+/* a TCP connection that was not tried yet, or is being set up for the
+ * first time, has not failed */
+int dest_failed(struct log_dest *d)
+{
+	return __atomic_load_n(&d->failed, __ATOMIC_RELAXED);
+}
+
+void dest_health(struct log_dest *d, int *up, size_t *backlog)
+{
+	pthread_mutex_lock(&d->lock);
+	*up = d->state == DEST_UP;
+	/* with a spool, osent is about its first message */
+	*backlog = d->spool ? spool_pending(d->spool) : d->olen - d->osent;
+	pthread_mutex_unlock(&d->lock);
+}
+
+int dest_poll(struct log_dest *d, struct timespec *next)
+{
+	int ret;
+	if (d->proto == LOG_UDP)
+		return udp_poll(d, next);
+	pthread_mutex_lock(&d->lock);
+	ret = tcp_poll(d, next);
+	pthread_mutex_unlock(&d->lock);
+	return ret;
+}
+
+void dest_idle(struct log_dest *d)
+{
+#ifdef TCP_CORK
+	int val = 0;
+	if (d->proto != LOG_TCP || !d->cork)
+		return;
+	pthread_mutex_lock(&d->lock);
+	if (d->state == DEST_UP) {
+		/* uncorking sends the partial segment, then collect again */
+		setsockopt(d->fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+		val = 1;
+		setsockopt(d->fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+	}
+	pthread_mutex_unlock(&d->lock);
+#else
+	(void)d;
+#endif
+}
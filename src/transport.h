@@ -0,0 +1,87 @@
+/*
+   sudolog File System - transport of the log messages to the log host
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/socket.h>
+#include <time.h>
+#include "params.h"
+
+#define LOG_UDP 0
+#define LOG_TCP 1
+
+#define LOG_PORT 514
+/*
+ * syslog RFC says, that 1024 is the maximum size of a log message.
+ * UDP transport probably prohibits anything beyond MTU (1500) anyway
+ */
+#define LOG_UDP_LENGTH 1024
+/* rsyslog's default $MaxMessageSize, longer messages get truncated */
+#define LOG_TCP_LENGTH 8192
+/* limits for -o msgsize: the smallest message every receiver has to
+ * accept (RFC 5426), the largest UDP datagram, an arbitrary TCP limit */
+#define LOG_MIN_LENGTH 480
+#define LOG_UDP_MAX_LENGTH 65507
+#define LOG_TCP_MAX_LENGTH (1 << 20)
+/* msgsize for dest_open(): 0 is the default of the protocol, this one
+ * follows the path MTU to the log host */
+#define LOG_SIZE_AUTO -1
+/* seconds, the kernel forgets a learned path MTU after 10 minutes */
+#define LOG_MTU_RECHECK 60
+/* send buffer of each UDP socket, so that a burst of terminal output is
+ * not dropped locally with ENOBUFS */
+#define LOG_UDP_SNDBUF (4 << 20)
+/* how much a TCP connection may buffer while the log host is slow or away */
+#define LOG_TCP_BACKLOG (4 << 20)
+/* reconnect / retry delays, doubled on every failed attempt */
+#define LOG_BACKOFF_MIN 100
+#define LOG_BACKOFF_MAX 30000
+/* messages sent from the spool per dest_poll() */
+#define LOG_SPOOL_BATCH 256
+/* seconds between two log lines about ICMP errors from a UDP log host */
+#define LOG_ICMP_INTERVAL 60
+/* ms to wait for an ICMP error after a UDP probe */
+#define LOG_UDP_PROBE 50
+
+#ifndef HAVE_SENDMMSG
+/* poor man's sendmmsg(), see transport.c */
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+/* spec is [udp://|tcp://]host[:port], msgsize 0, LOG_SIZE_AUTO or bytes.
+ * UDP gets socks connected sockets, one for each sender thread */
+int dest_open(struct log_dest *d, const char *spec, int cork, int msgsize, unsigned int socks);
+/* keep what cannot be sent in a disk spool, see spool.c */
+int dest_spool(struct log_dest *d, const char *dir, size_t size);
+void dest_close(struct log_dest *d);
+/* the messages are in the TCP form, see log_send(). They are the same
+ * again afterwards, so they can be passed to the next destination. sock
+ * is the index of the calling sender, UDP sends on its own socket */
+void dest_send(struct log_dest *d, unsigned int sock, struct mmsghdr *mh, unsigned int cnt);
+/* the socket dest_send() uses for sock */
+int dest_socket(struct log_dest *d, unsigned int sock);
+/* for the io_uring engine: the messages to d can be sent on its socket
+ * right away. It hands the failed ones (in the UDP form) to
+ * dest_send_error(), with the socket they were sent on */
+int dest_direct(struct log_dest *d);
+void dest_send_error(struct log_dest *d, int fd, struct msghdr *m, int err);
+/* connect, flush buffered data. Returns 1 and the time of the next
+ * attempt in *next if there is still something to do */
+int dest_poll(struct log_dest *d, struct timespec *next);
+/* the sender has nothing to do right now: push out corked data */
+void dest_idle(struct log_dest *d);
+/* the last send or connection attempt failed, and none succeeded since */
+int dest_failed(struct log_dest *d);
+/* for the stats: connected (or not known to fail), and bytes not sent yet */
+void dest_health(struct log_dest *d, int *up, size_t *backlog);
+
+#endif
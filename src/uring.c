@@ -0,0 +1,212 @@
+/*
+   sudolog File System - io_uring engine of the sender threads
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+
+   With -o io_uring, every sender thread has its own ring, and hands the
+   messages of a batch for all UDP log hosts to the kernel with a single
+   io_uring_enter(), instead of one sendmmsg() per log host. The sockets
+   of the sender (see dest_socket()) are registered with the ring, so
+   the kernel does not look up the fd for every message. The messages to
+   one log host are linked, so they still leave in order.
+
+   A UDP send is done (or failed) when the kernel has issued it, so the
+   sender waits for the completions in the same io_uring_enter(). That
+   way log_send() can reuse its message descriptors for the next batch,
+   and a failed message is spooled before the next batch, as with
+   sendmmsg(). TCP log hosts, and UDP ones that are replaying their
+   spool, are left to dest_send().
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+/* what a queued message belongs to, for its completion */
+struct uring_slot {
+	struct log_dest *d;
+	int fd;
+	struct msghdr msg;	/* the UDP form, see udp_address() in transport.c */
+};
+
+struct uring {
+	struct io_uring ring;
+	unsigned int sock;	/* the index of the sender */
+	struct uring_slot slot[URING_ENTRIES];
+	unsigned int queued;
+};
+
+static __thread struct uring *uring;
+
+int uring_supported(void)
+{
+	return 0;
+}
+
+int uring_init(struct bb_state *bb_data, unsigned int sock)
+{
+	struct uring *u = calloc(1, sizeof(struct uring));
+	int *fds = calloc(bb_data->nlog, sizeof(int));
+	unsigned int i;
+	int ret = -ENOMEM;
+	if (!u || !fds)
+		goto fail;
+	ret = io_uring_queue_init(URING_ENTRIES, &u->ring, 0);
+	if (ret < 0)
+		goto fail;
+	/* the fixed file of a log host is its index. The socket of a TCP
+	 * one changes with every reconnect, it is not sent from here */
+	for (i = 0; i < bb_data->nlog; i++)
+		fds[i] = bb_data->log[i].proto == LOG_UDP ? dest_socket(&bb_data->log[i], sock) : -1;
+	ret = io_uring_register_files(&u->ring, fds, bb_data->nlog);
+	if (ret < 0) {
+		io_uring_queue_exit(&u->ring);
+		goto fail;
+	}
+	free(fds);
+	u->sock = sock;
+	uring = u;
+	return 0;
+ fail:
+	syslog(LOG_ERR, "cannot set up io_uring (%s), sending without it", strerror(-ret));
+	free(fds);
+	free(u);
+	return -1;
+}
+
+void uring_exit(void)
+{
+	if (!uring)
+		return;
+	io_uring_queue_exit(&uring->ring);
+	free(uring);
+	uring = NULL;
+}
+
+/* submit what is queued and handle the completions */
+static void uring_flush(struct uring *u)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_slot *sl;
+	unsigned int i;
+	int ret, res;
+	if (!u->queued)
+		return;
+	do
+		ret = io_uring_submit_and_wait(&u->ring, u->queued);
+	while (ret == -EINTR);
+	if (ret < 0) {
+		/* nothing was submitted: send them the old way, and leave
+		 * the ring alone from now on */
+		syslog(LOG_ERR, "io_uring_enter: %s, sending without io_uring", strerror(-ret));
+		for (i = 0; i < u->queued; i++) {
+			sl = &u->slot[i];
+			if (sendmsg(sl->fd, &sl->msg, 0) < 0)
+				dest_send_error(sl->d, sl->fd, &sl->msg, errno);
+		}
+		uring_exit();
+		return;
+	}
+	for (i = 0; i < u->queued; i++) {
+		while ((ret = io_uring_wait_cqe(&u->ring, &cqe)) == -EINTR)
+			;
+		if (ret < 0)
+			break;
+		sl = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&u->ring, cqe);
+		/* an earlier message to the same log host failed, which
+		 * cancels the rest of its chain */
+		if (res == -ECANCELED)
+			res = sendmsg(sl->fd, &sl->msg, 0) < 0 ? -errno : 0;
+		if (res < 0)
+			dest_send_error(sl->d, sl->fd, &sl->msg, -res);
+	}
+	u->queued = 0;
+}
+
+int uring_send(struct bb_state *bb_data, struct mmsghdr *mh, unsigned int cnt)
+{
+	struct uring *u = uring;
+	struct io_uring_sqe *sqe;
+	struct uring_slot *sl;
+	unsigned int i, n, sock;
+	if (!u)
+		return 0;
+	sock = u->sock;
+	for (n = 0; n < bb_data->nlog; n++) {
+		struct log_dest *d = &bb_data->log[n];
+		if (!u || !dest_direct(d)) {
+			dest_send(d, sock, mh, cnt);
+			continue;
+		}
+		sqe = NULL;
+		for (i = 0; i < cnt; i++) {
+			if (u->queued == URING_ENTRIES) {
+				/* what is submitted is done before the rest is queued */
+				if (sqe)
+					sqe->flags &= ~IOSQE_IO_LINK;
+				uring_flush(u);
+				if (!(u = uring)) {
+					/* the ring failed, the rest goes the old way */
+					dest_send(d, sock, mh + i, cnt - i);
+					break;
+				}
+			}
+			sl = &u->slot[u->queued++];
+			sl->d = d;
+			sl->fd = dest_socket(d, sock);
+			sl->msg = mh[i].msg_hdr;
+			sl->msg.msg_iov++;
+			sl->msg.msg_iovlen--;
+			sqe = io_uring_get_sqe(&u->ring);
+			io_uring_prep_sendmsg(sqe, n, &sl->msg, 0);
+			sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+			io_uring_sqe_set_data(sqe, sl);
+			__atomic_fetch_add(&d->st_messages, 1, __ATOMIC_RELAXED);
+		}
+		/* the chain ends with the log host */
+		if (u && sqe)
+			sqe->flags &= ~IOSQE_IO_LINK;
+	}
+	if (u)
+		uring_flush(u);
+	return 1;
+}
+
+#else
+
+int uring_supported(void)
+{
+	return -1;
+}
+
+int uring_init(struct bb_state *bb_data, unsigned int sock)
+{
+	(void)bb_data;
+	(void)sock;
+	return -1;
+}
+
+void uring_exit(void)
+{
+}
+
+int uring_send(struct bb_state *bb_data, struct mmsghdr *mh, unsigned int cnt)
+{
+	(void)bb_data;
+	(void)mh;
+	(void)cnt;
+	return 0;
+}
+
+#endif
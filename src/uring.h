@@ -0,0 +1,30 @@
+/*
+   sudolog File System - io_uring engine of the sender threads
+   Copyright (C) 2016 Stefan Seyfried, <seife@tuxbox-git.slipkontur.de>
+
+   This program can be distributed under the terms of the GNU GPLv3.
+   See the file COPYING.
+*/
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "params.h"
+#include "transport.h"
+
+/* submission queue entries per ring, a batch of log_send() needs one
+ * per message and log host, bigger ones are submitted in pieces */
+#define URING_ENTRIES 1024
+
+/* 0 if it was compiled in */
+int uring_supported(void);
+/* set up the ring of the calling sender thread (with the UDP sockets of
+ * sender sock), -1 if the kernel does not have io_uring, the thread then
+ * sends with sendmmsg() */
+int uring_init(struct bb_state *bb_data, unsigned int sock);
+void uring_exit(void);
+/* send the messages (in the TCP form, as for dest_send()) to all log
+ * hosts. 0 if the thread has no ring, the caller has to dest_send() them */
+int uring_send(struct bb_state *bb_data, struct mmsghdr *mh, unsigned int cnt);
+
+#endif